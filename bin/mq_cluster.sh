@@ -0,0 +1,34 @@
+#!/bin/bash
+
+# Run a local cluster of message queue servers on consecutive ports and print
+# the endpoint list to pass to mq_create as its host.
+
+SERVERS=${1:-3}
+PORT=${2:-9620}
+shift 2 2> /dev/null
+
+usage() {
+    echo "Usage: $(basename $0) [SERVERS [PORT [SERVER OPTIONS...]]]"
+    exit $1
+}
+
+cleanup() {
+    kill $PIDS 2> /dev/null
+    wait
+    exit 0
+}
+
+[ "$SERVERS" -ge 1 ] 2> /dev/null || usage 1
+
+PIDS=
+ENDPOINTS=
+for i in $(seq 0 $((SERVERS - 1))); do
+    $(dirname $0)/mq_server.py --port=$((PORT + i)) "$@" &
+    PIDS="$PIDS $!"
+    ENDPOINTS="${ENDPOINTS:+$ENDPOINTS,}localhost:$((PORT + i))"
+done
+
+trap "cleanup" EXIT INT TERM
+
+echo "$ENDPOINTS"
+wait
@@ -4,25 +4,1577 @@
 
 This Message Queue Server supports the following REST API:
 
-    PUT     /topic/$topic               Publish message to $topic.
+    PUT     /topic/$topic               Publish message to $topic (X-Priority: 0-7).
+    PUT     /topic/$topic?at=$time      Publish message to $topic at Unix $time.
+    PUT     /topic/$topic?delay=$secs   Publish message to $topic after $secs.
+    PUT     /topic/$topic?ttl=$secs     Publish message that expires after $secs.
+    PUT     /topic/$topic?key=$key      Publish message with $key (see compaction).
+                                        (Repeats of an X-Message-Id are ignored.)
 
-    GET     /queue/$queue               Retrieve one message from $queue.
+    GET     /queue/$queue               Retrieve one message from $queue (X-Topic).
+    GET     /queue/$queue?lease=$secs   Lease up to ?prefetch=$n messages from $queue
+                                        (redelivered unless acknowledged in $secs),
+                                        waiting up to ?linger=$secs for more.
+    GET     /queue/$queue?member=$name  Retrieve as $name of the consumer group $queue
+                                        (members take turns receiving messages).
+    DELETE  /queue/$queue?member=$name  Release pending retrievals of member $name.
+    GET     /stream/$queue              Push messages of $queue as frames on one connection
+                                        (X-Sequence); ?resume=$seq resends frames after $seq
+                                        that a dropped connection may have lost.
+    PUT     /ack/$queue                 Acknowledge leased messages (ids in body).
+    PUT     /queue/$queue?$policy       Set ttl, max_length, max_bytes, overflow
+                                        (drop-oldest, drop-newest, reject); messages
+                                        larger than max_bytes are refused (413).
 
     PUT     /subscription/$queue/$topic Subscribe $queue to $topic.
     DELETE  /subscription/$queue/$topic Unsubscribe $queue from $topic.
+
+    PUT     /compaction/$topic          Keep only the latest message per key of $topic.
+    DELETE  /compaction/$topic          Keep every message of $topic again.
+
+    PUT     /federation/$upstream/$topic    Mirror $topic from broker $upstream (host:port).
+    DELETE  /federation/$upstream/$topic    Stop mirroring $topic from $upstream.
+
+    GET     /stats                      Report broker statistics (JSON).
+    GET     /metrics                    Report broker statistics (Prometheus).
+
+Clients on the same host publish and receive through shared memory set up
+on the unix socket --shm_socket (see ShmSession); everything else uses HTTP.
+
+Bodies of --spool_size bytes or more are received into unlinked files under
+--spool_dir instead of memory (see Blob) and sent from there a chunk at a
+time, so large messages neither inflate the broker nor stall the event loop
+for the small ones; local clients are handed the file itself.
+
+On compacted topics (--compact or /compaction), a message published with a
+key takes the place of the message with the same key still waiting in each
+subscriber queue, so a backlog holds at most one message per key however
+fast they are updated.
+
+With --data_dir, subscriptions, policies and queued messages are journaled
+there and restored at startup from the latest snapshot plus the journal
+written since (scheduled messages and message ids are not kept).
 '''
 
+import array
 import collections
+import functools
+import itertools
+import json
 import logging
+import math
+import mmap
+import os
 import signal
 import socket
+import struct
 import sys
+import tempfile
 import time
+import urllib.parse
+import zlib
 
+import tornado.concurrent
 import tornado.gen
+import tornado.httpclient
+import tornado.iostream
+import tornado.netutil
+import tornado.tcpclient
 import tornado.options
+import tornado.tcpserver
 import tornado.web
 
+STARTED = time.monotonic()   # When process started (for restart timing)
+
+# Message
+
+class Message(object):
+    ''' Published message (shared by every queue it is delivered to). '''
+    __slots__ = ('body', 'priority', 'ttl', 'topic', 'path', 'timestamp', 'sequence', 'key')
+
+    def __init__(self, body, priority=0, ttl=None, topic=None, path=(), timestamp=None, key=None):
+        self.body      = body
+        self.priority  = priority
+        self.ttl       = ttl        # Seconds message may wait in a queue
+        self.topic     = topic      # Topic message was published to
+        self.path      = path       # Brokers that forwarded message to us
+        self.timestamp = timestamp or time.time()   # When first published
+        self.sequence  = None       # Number in journal (None until journaled)
+        self.key       = key        # Key of compacted topics (None if it has none)
+
+    def __len__(self):
+        return len(self.body)
+
+class Blob(object):
+    ''' Message body kept out of line in an unlinked spool file.
+
+    It costs a descriptor instead of memory, and since every read is
+    positional, the queues and connections sending it share one file.
+    '''
+    __slots__ = ('file', 'size')
+    CHUNK = 256 << 10       # Bytes read (and written to a connection) at a time
+
+    def __init__(self, directory=None):
+        self.file = tempfile.TemporaryFile(dir=directory or None, buffering=0)
+        self.size = 0
+
+    def append(self, data):
+        view = memoryview(data)
+        while view:
+            view = view[self.file.write(view):]
+        self.size += len(data)
+
+    def fileno(self):
+        return self.file.fileno()
+
+    def chunks(self):
+        for offset in range(0, self.size, self.CHUNK):
+            yield os.pread(self.file.fileno(), min(self.CHUNK, self.size - offset), offset)
+
+    def __len__(self):
+        return self.size
+
+    def __bytes__(self):
+        return os.pread(self.file.fileno(), self.size, 0)
+
+# Queue
+
+class Queue(object):
+    ''' Priority-ordered message store with expiry and length limits.
+
+    Each priority level is a FIFO of (expires, message) entries and a bitmap
+    records which levels are non-empty, so both push and pop (of the oldest
+    message of the highest non-empty level) are O(1).  Expired entries are
+    discarded when they reach the front of their level, either by pop or by
+    the periodic sweep.
+
+    Pending retrievals wait in per-member FIFOs and members are served in
+    turn, so the consumers of a group share a queue fairly however many
+    requests each of them keeps pending.  A member that leaves with nothing
+    pending is remembered for a while (DEPARTED_TTL, at most DEPARTED of
+    them), so that a retrieval it still had on the way is released too.
+
+    Messages pushed on streams are numbered and the last REPLAY of them are
+    kept, so a member that reconnects can resume where its stream broke off.
+
+    Entries of compacted messages are mutable [expires, message] slots,
+    indexed by topic and key, so a newer message with the same key replaces
+    the queued one in place (keeping its position) in O(1).  A replacement
+    with a different priority moves to the back of its new level instead
+    (O(n) in the old level), and only the growth in bytes counts towards the
+    limits.  Entries leave the index when they leave the queue; one
+    redelivered after a newer one arrived is simply queued ahead of it.
+
+    With a journal, every entry added to or removed for good from the queue
+    is recorded (leased entries count as present until acknowledged).
+    '''
+    PRIORITIES   = 8
+    OVERFLOWS    = ('drop-oldest', 'drop-newest', 'reject')
+    REPLAY       = 1024         # Streamed messages kept for resuming streams
+    DEPARTED     = 1024         # Departed members remembered
+    DEPARTED_TTL = 10.0         # Seconds a departed member is remembered
+
+    def __init__(self, stats, ttl=None, max_length=None, max_bytes=None, overflow='drop-oldest', name=None, journal=None):
+        self.levels     = [collections.deque() for _ in range(self.PRIORITIES)]
+        self.nonempty   = 0
+        self.size       = 0
+        self.leases     = {}            # Unacknowledged entries by lease id
+        self.next_lease = 0
+        self.waiters    = collections.OrderedDict()    # Pending futures by member
+        self.departed   = collections.OrderedDict()    # When members left with nothing pending
+        self.sequence   = 0             # Number of last streamed message
+        self.replay     = collections.deque(maxlen=self.REPLAY)    # (sequence, member, message)
+        self.keys       = {}            # Queued compacted entries by (topic, key)
+        self.stats      = stats         # QueueStatistics (depth, bytes, ...)
+        self.ttl        = ttl           # Seconds any message may wait
+        self.max_length = max_length    # Maximum messages queued
+        self.max_bytes  = max_bytes     # Maximum bytes queued
+        self.overflow   = overflow      # What to do when a limit is reached
+        self.active     = time.monotonic()
+        self.name       = name          # Name of queue (in journal records)
+        self.journal    = journal       # Journal of changes (None if not persistent)
+
+    def __len__(self):
+        return self.size
+
+    def oversize(self, message):
+        ''' Return whether message alone exceeds this queue's byte limit. '''
+        return self.max_bytes is not None and len(message) > self.max_bytes
+
+    def full(self, message):
+        ''' Return whether message would exceed this queue's limits. '''
+        return (self.max_length is not None and self.size + 1 > self.max_length) or \
+               (self.max_bytes  is not None and self.stats.bytes + len(message) > self.max_bytes)
+
+    def slot(self, message):
+        ''' Return queued entry message would replace if compacted (or None). '''
+        return self.keys.get((message.topic, message.key)) if message.key is not None else None
+
+    def overflows(self, message, compact=False):
+        ''' Return whether pushing message would exceed this queue's limits. '''
+        slot = self.slot(message) if compact else None
+        if slot is None:
+            return self.full(message)
+        return self.max_bytes is not None and self.stats.bytes + len(message) - len(slot[1]) > self.max_bytes
+
+    def push(self, message, now, compact=False):
+        ''' Append message, or with compact replace the queued one with its key
+        (returns False if the overflow policy dropped it).  A message that
+        could never fit is dropped without evicting anything. '''
+        ttls    = [ttl for ttl in (self.ttl, message.ttl) if ttl is not None]
+        expires = now + min(ttls) if ttls else None
+
+        if self.oversize(message):
+            self.stats.dropped += 1
+            return False
+
+        if self.overflows(message, compact):
+            if self.overflow != 'drop-oldest':
+                self.stats.dropped += 1
+                return False
+            while self.size and self.overflows(message, compact):
+                self._remove(self.nonempty & -self.nonempty)
+                self.stats.dropped += 1
+
+        slot = self.slot(message) if compact else None
+        if slot is not None:
+            replaced             = slot[1]
+            moved                = message.priority != replaced.priority
+            if moved:
+                level = self.levels[replaced.priority]
+                del level[next(i for i, entry in enumerate(level) if entry is slot)]
+                if not level:
+                    self.nonempty &= ~(1 << replaced.priority)
+                self.levels[message.priority].append(slot)
+                self.nonempty |= 1 << message.priority
+            slot[0], slot[1]     = expires, message
+            self.stats.bytes    += len(message) - len(replaced)
+            self.stats.enqueued += 1
+            self.stats.compacted += 1
+            if self.journal is not None:
+                if moved:
+                    self.journal.remove(self.name, replaced)
+                    self.journal.add(self.name, slot)
+                else:
+                    self.journal.replace(self.name, replaced, slot)
+            return True
+
+        entry = (expires, message)
+        if compact and message.key is not None:
+            entry = self.keys[(message.topic, message.key)] = [expires, message]
+
+        self.levels[message.priority].append(entry)
+        self.nonempty       |= 1 << message.priority
+        self.size           += 1
+        self.stats.depth    += 1
+        self.stats.bytes    += len(message)
+        self.stats.enqueued += 1
+        if self.journal is not None:
+            self.journal.add(self.name, entry)
+        self.dispatch(now)
+        return True
+
+    def restore(self, entry, compact=False):
+        ''' Append entry loaded from journal (bypassing limits). '''
+        expires, message = entry
+        if compact and message.key is not None:
+            entry = self.keys[(message.topic, message.key)] = [expires, message]
+        self.levels[message.priority].append(entry)
+        self.nonempty    |= 1 << message.priority
+        self.size        += 1
+        self.stats.depth += 1
+        self.stats.bytes += len(message)
+
+    def pop(self, now):
+        ''' Remove and return next unexpired message (None if there is none). '''
+        entry = self.take(now)
+        return entry[1] if entry else None
+
+    def take(self, now):
+        ''' Remove and return next unexpired (expires, message) entry. '''
+        while self.nonempty:
+            entry = self._remove(1 << (self.nonempty.bit_length() - 1))
+            if entry[0] is None or entry[0] > now:
+                self.stats.dequeued += 1
+                return entry
+            self.stats.expired += 1
+        return None
+
+    def lease(self, entry):
+        ''' Hold taken entry until it is acknowledged (returns lease id). '''
+        self.next_lease += 1
+        self.leases[self.next_lease] = entry
+        self.stats.leased += 1
+        if self.journal is not None:
+            self.journal.add(self.name, entry)
+        return self.next_lease
+
+    def ack(self, lease):
+        ''' Forget leased entry (returns whether the lease was still held). '''
+        entry = self.leases.pop(lease, None)
+        if entry is None:
+            return False
+        self.stats.leased -= 1
+        if self.journal is not None:
+            self.journal.remove(self.name, entry[1])
+        return True
+
+    def release(self, lease):
+        ''' Make unacknowledged entry visible again (at the front of its level). '''
+        entry = self.leases.pop(lease, None)
+        if entry is None:
+            return
+
+        self.stats.leased      -= 1
+        self.stats.redelivered += 1
+
+        self._requeue(entry)        # Still journaled as present
+
+    def requeue(self, entry):
+        ''' Put taken entry back at the front of its level. '''
+        if self.journal is not None:
+            self.journal.add(self.name, entry, republish=True)
+        self._requeue(entry)
+
+    def _requeue(self, entry):
+        expires, message = entry
+        self.levels[message.priority].appendleft(entry)
+        self.nonempty    |= 1 << message.priority
+        self.size        += 1
+        self.stats.depth += 1
+        self.stats.bytes += len(message)
+        self.dispatch(time.monotonic())
+
+    def stream(self, message, member=None):
+        ''' Number message pushed to member's stream (returns its sequence). '''
+        self.sequence += 1
+        self.replay.append((self.sequence, member, message))
+        return self.sequence
+
+    def resume(self, sequence, member=None):
+        ''' Return (sequence, message) of every kept message streamed to
+        member after sequence. '''
+        if sequence >= self.sequence:
+            return []
+        return [(s, m) for s, who, m in self.replay if s > sequence and who == member]
+
+    def gone(self, member):
+        ''' Return whether member left recently (forgetting older departures). '''
+        now = time.monotonic()
+        while self.departed and now - next(iter(self.departed.values())) >= self.DEPARTED_TTL:
+            self.departed.popitem(last=False)
+        return member in self.departed
+
+    def wait(self, member=None):
+        ''' Return future resolved with the entry handed to member (or None
+        if the member leaves first). '''
+        future = tornado.concurrent.Future()
+        if self.gone(member):
+            del self.departed[member]
+            future.set_result(None)
+            return future
+
+        if member not in self.waiters:
+            self.waiters[member] = collections.deque()
+        self.waiters[member].append(future)
+        return future
+
+    def cancel(self, member, future):
+        ''' Forget pending future (of a consumer that went away). '''
+        futures = self.waiters.get(member)
+        if futures is not None and future in futures:
+            futures.remove(future)
+            if not futures:
+                del self.waiters[member]
+
+    def leave(self, member):
+        ''' Release every pending future of member (returns how many). '''
+        futures = self.waiters.pop(member, ())
+        for future in futures:
+            future.set_result(None)
+        if not futures:
+            self.departed.pop(member, None)
+            self.departed[member] = time.monotonic()
+            if len(self.departed) > self.DEPARTED:
+                self.departed.popitem(last=False)
+        return len(futures)
+
+    def dispatch(self, now):
+        ''' Hand entries to pending futures, one per member in turn. '''
+        while self.nonempty and self.waiters:
+            member, futures = next(iter(self.waiters.items()))
+            entry = self.take(now)
+            if not entry:
+                break
+
+            futures.popleft().set_result(entry)
+            if futures:
+                self.waiters.move_to_end(member)
+            else:
+                del self.waiters[member]
+
+    def sweep(self, now, limit):
+        ''' Discard up to limit expired messages from the front of each level. '''
+        for level, entries in enumerate(self.levels):
+            for _ in range(limit):
+                if not entries or entries[0][0] is None or entries[0][0] > now:
+                    break
+                self._remove(1 << level)
+                self.stats.expired += 1
+
+    def _remove(self, bit):
+        level            = bit.bit_length() - 1
+        entry            = self.levels[level].popleft()
+        expires, message = entry
+        if not self.levels[level]:
+            self.nonempty &= ~bit
+        if message.key is not None and self.keys.get((message.topic, message.key)) is entry:
+            del self.keys[(message.topic, message.key)]
+        self.size        -= 1
+        self.stats.depth -= 1
+        self.stats.bytes -= len(message)
+        if self.journal is not None:
+            self.journal.remove(self.name, message)
+        return expires, message
+
+class QueueTable(dict):
+    ''' Queues by name (created on first use with the default policy). '''
+
+    def __init__(self, stats, **policy):
+        dict.__init__(self)
+        self.stats   = stats
+        self.policy  = policy
+        self.journal = None     # Journal given to new queues
+
+    def __missing__(self, name):
+        queue = self[name] = Queue(self.stats.queues[name], name=name, journal=self.journal, **self.policy)
+        if self.journal is not None:
+            self.journal.policy(name, queue)
+        return queue
+
+# Timer Wheel
+
+class TimerWheel(object):
+    ''' Hierarchical timing wheel.
+
+    Level 0 has one slot per tick; each higher level has slots that span a
+    whole revolution of the level below.  A timer is placed in the lowest
+    level whose span covers its remaining delay and moves down a level
+    (cascades) when the wheel below comes around to it.  Scheduling is O(1),
+    and each tick visits one level 0 slot (plus, once per revolution, one
+    slot of the level above), so no per-timer callbacks or coroutines exist.
+    '''
+    TICK = 0.01             # Seconds per tick
+    BITS = (8, 6, 6, 6)     # log2(slots) per level (covers 2^26 ticks ~ 7.7 days)
+
+    def __init__(self, now):
+        self.origin  = now
+        self.current = 0        # Last processed tick
+        self.size    = 0
+        self.levels  = [[[] for _ in range(1 << bits)] for bits in self.BITS]
+
+    def __len__(self):
+        return self.size
+
+    def _insert(self, expires, item):
+        delta = expires - self.current
+        shift = 0
+        for level, bits in enumerate(self.BITS):
+            if delta < (1 << (shift + bits)) or level == len(self.BITS) - 1:
+                # Timers beyond the top level wait in its furthest slot and are
+                # re-examined every time that slot cascades
+                target = min(expires, self.current + (1 << (shift + bits)) - 1)
+                self.levels[level][(target >> shift) & ((1 << bits) - 1)].append((expires, item))
+                return
+            shift += bits
+
+    def schedule(self, when, item):
+        ''' Schedule callable item to be called at monotonic time when. '''
+        expires = int(math.ceil((when - self.origin) / self.TICK))
+        self._insert(max(expires, self.current + 1), item)
+        self.size += 1
+
+    def advance(self, now):
+        ''' Expire every timer due at or before monotonic time now. '''
+        target = int((now - self.origin) / self.TICK)
+        while self.current < target:
+            self.current += 1
+
+            # Cascade (highest level first) every level whose lower levels
+            # have just completed a revolution
+            shifts = []
+            shift  = 0
+            for level in range(1, len(self.BITS)):
+                shift += self.BITS[level - 1]
+                if self.current & ((1 << shift) - 1):
+                    break
+                shifts.append((level, shift))
+
+            for level, shift in reversed(shifts):
+                slot    = (self.current >> shift) & ((1 << self.BITS[level]) - 1)
+                entries = self.levels[level][slot]
+                self.levels[level][slot] = []
+                for expires, item in entries:
+                    self._insert(expires, item)
+
+            slot    = self.current & ((1 << self.BITS[0]) - 1)
+            entries = self.levels[0][slot]
+            self.levels[0][slot] = []
+            for expires, item in entries:
+                self.size -= 1
+                item()
+
+# Deduplication Window
+
+class DedupWindow(object):
+    ''' Message ids published recently (bounded by count and age).
+
+    Ids are kept in an OrderedDict in the order they were first seen, so
+    lookup and insert are O(1) and the oldest id is always at the front:
+    each insert evicts from the front until the window is back within both
+    bounds, so expiry needs no timers or sweeps.
+    '''
+
+    def __init__(self, size, age):
+        self.size = size        # Most ids remembered
+        self.age  = age         # Seconds an id is remembered (0 is unlimited)
+        self.ids  = collections.OrderedDict()
+
+    def __len__(self):
+        return len(self.ids)
+
+    def __contains__(self, message_id):
+        seen = self.ids.get(message_id)
+        return seen is not None and (not self.age or time.monotonic() - seen < self.age)
+
+    def add(self, message_id):
+        now = time.monotonic()
+        self.ids[message_id] = now
+        self.ids.move_to_end(message_id)
+        while len(self.ids) > self.size:
+            self.ids.popitem(last=False)
+        while self.age and self.ids and now - next(iter(self.ids.values())) >= self.age:
+            self.ids.popitem(last=False)
+
+# Persistence
+
+class Journal(object):
+    ''' Append-only log of broker state changes plus periodic snapshots.
+
+    Every change to subscriptions, queue policies and queue contents is
+    appended to the current journal segment as a binary record:
+
+        $OP (1 byte) $LENGTH (4 bytes) $PAYLOAD
+
+    A message body is written once (PUBLISH, numbered) and queues refer to
+    it by number (ADD and REMOVE, or REPLACE for a compacted message taking
+    the place of another).  Leased messages stay in their queue's
+    record until acknowledged, so they are redelivered after a restart.
+
+    Snapshots are written by a forked child from its copy-on-write image of
+    the broker, so the event loop never stops for them.  A snapshot is the
+    same kind of records describing only the current state, followed by the
+    number of the journal segment started at the fork.  At startup the
+    latest snapshot is mapped and loaded and only the segments after it
+    are replayed.  A snapshot is taken every interval, or sooner once the
+    journal since the last one exceeds max_bytes, which bounds replay.
+    '''
+    MAGIC   = b'MQSNAP01'
+    HEADER  = struct.Struct('<BI')
+    PUBLISH, ADD, REMOVE, SUBSCRIBE, UNSUBSCRIBE, POLICY, DROP, CURSOR, COMPACT, REPLACE = range(1, 11)
+    FLUSH_INTERVAL = 0.1    # Seconds between journal flushes (and snapshot checks)
+
+    def __init__(self, application, directory, interval, max_bytes):
+        self.application = application
+        self.directory   = directory
+        self.interval    = interval         # Seconds between snapshots
+        self.max_bytes   = max_bytes        # Journal bytes that force a snapshot
+        self.sequence    = 0                # Number of last message written
+        self.segment     = 0                # Number of segment being written
+        self.file        = None
+        self.written     = 0                # Journal bytes since last snapshot
+        self.snapshotted = time.monotonic()
+        self.child       = None             # (pid, segment) of running snapshot
+
+        os.makedirs(directory, exist_ok=True)
+
+    # Records
+
+    @staticmethod
+    def pack_string(value):
+        data = value.encode() if isinstance(value, str) else value
+        return struct.pack('<I', len(data)) + data
+
+    @staticmethod
+    def unpack_string(payload, offset):
+        length, = struct.unpack_from('<I', payload, offset)
+        offset += 4
+        return bytes(payload[offset:offset + length]), offset + length
+
+    def write(self, output, op, payload):
+        output.write(self.HEADER.pack(op, len(payload)))
+        output.write(payload)
+        return self.HEADER.size + len(payload)
+
+    def record(self, op, payload):
+        if self.file is not None:
+            self.written += self.write(self.file, op, payload)
+
+    def encode_message(self, message):
+        return struct.pack('<QBdd', message.sequence, message.priority, message.timestamp,
+                           -1.0 if message.ttl is None else message.ttl) + \
+               self.pack_string(message.topic or '') + self.pack_string(bytes(message.body)) + \
+               self.pack_string(message.key or '')
+
+    def encode_entry(self, name, entry, now, wall):
+        expires, message = entry
+        return self.pack_string(name) + struct.pack('<Qd', message.sequence, 0.0 if expires is None else wall + expires - now)
+
+    def encode_policy(self, name, queue):
+        return self.pack_string(name) + struct.pack('<dqq',
+            queue.ttl or 0.0,
+            -1 if queue.max_length is None else queue.max_length,
+            -1 if queue.max_bytes is None else queue.max_bytes,
+        ) + self.pack_string(queue.overflow)
+
+    # Changes
+
+    def publish(self, message, republish=False):
+        ''' Write message unless it already was (or again when it may only be
+        in a segment a snapshot since replaced). '''
+        if message.sequence is None:
+            self.sequence   += 1
+            message.sequence = self.sequence
+            republish        = True
+        if republish:
+            self.record(self.PUBLISH, self.encode_message(message))
+
+    def add(self, name, entry, republish=False):
+        ''' Record that entry is in queue (writing its message first). '''
+        self.publish(entry[1], republish)
+        self.record(self.ADD, self.encode_entry(name, entry, time.monotonic(), time.time()))
+
+    def remove(self, name, message):
+        self.record(self.REMOVE, self.pack_string(name) + struct.pack('<Q', message.sequence or 0))
+
+    def replace(self, name, replaced, entry):
+        ''' Record that entry took the place of replaced in queue. '''
+        expires, message = entry
+        now, wall        = time.monotonic(), time.time()
+        self.publish(message)
+        self.record(self.REPLACE, self.pack_string(name) + struct.pack('<QQd', replaced.sequence or 0,
+                    message.sequence, 0.0 if expires is None else wall + expires - now))
+
+    def subscribe(self, name, topic):
+        self.record(self.SUBSCRIBE, self.pack_string(name) + self.pack_string(topic))
+
+    def unsubscribe(self, name, topic):
+        self.record(self.UNSUBSCRIBE, self.pack_string(name) + self.pack_string(topic))
+
+    def policy(self, name, queue):
+        self.record(self.POLICY, self.encode_policy(name, queue))
+
+    def drop(self, name):
+        self.record(self.DROP, self.pack_string(name))
+
+    def compact(self, topic, enabled):
+        self.record(self.COMPACT, self.pack_string(topic) + struct.pack('<B', enabled))
+
+    # Segments and snapshots
+
+    def path(self, segment=None):
+        if segment is None:
+            return os.path.join(self.directory, 'snapshot')
+        return os.path.join(self.directory, 'journal.{:08d}'.format(segment))
+
+    def segments(self):
+        return sorted(int(name.split('.')[1]) for name in os.listdir(self.directory)
+                      if name.startswith('journal.') and name.split('.')[1].isdigit())
+
+    def rotate(self):
+        ''' Start writing a new journal segment. '''
+        if self.file is not None:
+            self.file.close()
+        self.segment += 1
+        self.file     = open(self.path(self.segment), 'ab', buffering=1 << 20)
+
+    def flush(self):
+        if self.file is not None:
+            self.file.flush()
+
+    def check(self):
+        ''' Flush journal, reap finished snapshot, and start one when due. '''
+        self.flush()
+
+        if self.child is not None:
+            pid, segment = self.child
+            done, status = os.waitpid(pid, os.WNOHANG)
+            if not done:
+                return
+            self.child = None
+            if status:
+                self.application.logger.error('Snapshot failed (status {})'.format(status))
+            else:
+                for old in self.segments():
+                    if old < segment:
+                        os.unlink(self.path(old))
+
+        if self.written and (time.monotonic() - self.snapshotted >= self.interval or self.written >= self.max_bytes):
+            self.snapshot()
+
+    def snapshot(self):
+        ''' Write snapshot of current state in a forked child. '''
+        self.rotate()
+        self.snapshotted = time.monotonic()
+        self.written     = 0
+
+        pid = os.fork()
+        if pid:
+            self.child = (pid, self.segment)
+            return
+
+        status = 1
+        try:
+            self.write_snapshot(self.segment)
+            status = 0
+        finally:
+            os._exit(status)
+
+    def write_snapshot(self, segment):
+        now, wall = time.monotonic(), time.time()
+        path      = self.path()
+        written   = set()
+
+        with open(path + '.tmp', 'wb', buffering=1 << 20) as output:
+            output.write(self.MAGIC)
+            for topic in self.application.compacted:
+                self.write(output, self.COMPACT, self.pack_string(topic) + struct.pack('<B', True))
+            for name, topics in self.application.subscriptions.items():
+                for topic in topics:
+                    self.write(output, self.SUBSCRIBE, self.pack_string(name) + self.pack_string(topic))
+
+            for name, queue in self.application.queues.items():
+                self.write(output, self.POLICY, self.encode_policy(name, queue))
+                self.write(output, self.CURSOR, self.pack_string(name) + struct.pack('<Q', queue.sequence))
+                for entries in queue.levels + [list(queue.leases.values())]:
+                    for entry in entries:
+                        message = entry[1]
+                        if message.sequence is None:
+                            continue
+                        if message.sequence not in written:
+                            written.add(message.sequence)
+                            self.write(output, self.PUBLISH, self.encode_message(message))
+                        self.write(output, self.ADD, self.encode_entry(name, entry, now, wall))
+
+            output.write(struct.pack('<QQ', segment, self.sequence))
+            output.flush()
+            os.fsync(output.fileno())
+        os.rename(path + '.tmp', path)
+
+    # Restore
+
+    def restore(self):
+        ''' Load latest snapshot and replay journal after it (returns stats). '''
+        started  = time.monotonic()
+        messages = {}                                           # Message by sequence
+        queues   = collections.OrderedDict()                    # Entries by queue
+        order    = itertools.count()                            # Positions of entries
+        policies = {}
+        cursors  = {}
+        subscriptions = collections.defaultdict(set)
+        compacted = {}                                          # Whether topic is compacted
+        stats    = {'snapshot_records': 0, 'journal_records': 0}
+        first    = 1
+
+        try:
+            with open(self.path(), 'rb') as stream:
+                with mmap.mmap(stream.fileno(), 0, access=mmap.ACCESS_READ) as mapped:
+                    view = memoryview(mapped)
+                    try:
+                        if bytes(view[:len(self.MAGIC)]) == self.MAGIC:
+                            first, self.sequence = struct.unpack_from('<QQ', view, len(view) - 16)
+                            stats['snapshot_records'] = self.replay(
+                                view[len(self.MAGIC):len(view) - 16], messages, queues, order, policies, cursors, subscriptions, compacted)
+                    finally:
+                        view.release()
+        except FileNotFoundError:
+            pass
+        stats['snapshot_seconds'] = time.monotonic() - started
+
+        for segment in self.segments():
+            if segment >= first:
+                with open(self.path(segment), 'rb') as stream:
+                    stats['journal_records'] += self.replay(
+                        stream.read(), messages, queues, order, policies, cursors, subscriptions, compacted)
+            self.segment = max(self.segment, segment)
+
+        for topic, enabled in compacted.items():
+            if enabled:
+                self.application.compacted.add(topic)
+
+        now, wall = time.monotonic(), time.time()
+        restored  = 0
+        for name, entries in queues.items():
+            queue = self.application.queues[name]
+            if name in policies:
+                queue.ttl, queue.max_length, queue.max_bytes, queue.overflow = policies[name]
+            queue.sequence = cursors.get(name, 0)
+            for sequence, (_, expires) in sorted(entries.items(), key=lambda item: item[1][0]):
+                if sequence in messages:
+                    message = messages[sequence]
+                    queue.restore((None if not expires else now + expires - wall, message),
+                                  message.topic in self.application.compacted)
+                    restored += 1
+        for name, topics in subscriptions.items():
+            self.application.subscriptions[name] |= topics
+
+        stats['queues']   = len(queues)
+        stats['messages'] = restored
+        stats['seconds']  = time.monotonic() - started
+        self.rotate()
+        return stats
+
+    def replay(self, buffer, messages, queues, order, policies, cursors, subscriptions, compacted):
+        ''' Apply records of buffer (up to any torn one at the end) to the
+        state being restored (returns number of records).  Entries are kept
+        with their position from order, which a replacement inherits. '''
+        offset, count = 0, 0
+        while offset + self.HEADER.size <= len(buffer):
+            op, length = self.HEADER.unpack_from(buffer, offset)
+            start = offset + self.HEADER.size
+            if start + length > len(buffer):
+                break
+            payload = buffer[start:start + length]
+            offset  = start + length
+            count  += 1
+
+            if op == self.PUBLISH:
+                sequence, priority, timestamp, ttl = struct.unpack_from('<QBdd', payload)
+                topic, next_offset = self.unpack_string(payload, 25)
+                body, next_offset = self.unpack_string(payload, next_offset)
+                key = self.unpack_string(payload, next_offset)[0].decode() if next_offset < len(payload) else ''
+                message = Message(self.application.spool(body), priority, None if ttl < 0 else ttl, topic.decode() or None, (), timestamp, key or None)
+                message.sequence   = sequence
+                messages[sequence] = message
+                self.sequence      = max(self.sequence, sequence)
+                continue
+
+            name, next_offset = self.unpack_string(payload, 0)
+            name = name.decode()
+            if op == self.COMPACT:
+                compacted[name], = struct.unpack_from('<B', payload, next_offset)
+            elif op == self.ADD:
+                sequence, expires = struct.unpack_from('<Qd', payload, next_offset)
+                queues.setdefault(name, collections.OrderedDict()).setdefault(sequence, (next(order), expires))
+            elif op == self.REPLACE:
+                replaced, sequence, expires = struct.unpack_from('<QQd', payload, next_offset)
+                entries  = queues.setdefault(name, collections.OrderedDict())
+                position = entries.pop(replaced, (next(order), None))[0]
+                entries[sequence] = (position, expires)
+            elif op == self.REMOVE:
+                sequence, = struct.unpack_from('<Q', payload, next_offset)
+                queues.get(name, {}).pop(sequence, None)
+            elif op == self.SUBSCRIBE:
+                topic, _ = self.unpack_string(payload, next_offset)
+                subscriptions[name].add(topic.decode())
+                queues.setdefault(name, collections.OrderedDict())
+            elif op == self.UNSUBSCRIBE:
+                topic, _ = self.unpack_string(payload, next_offset)
+                subscriptions[name].discard(topic.decode())
+            elif op == self.POLICY:
+                ttl, max_length, max_bytes = struct.unpack_from('<dqq', payload, next_offset)
+                overflow, _ = self.unpack_string(payload, next_offset + 24)
+                policies[name] = (ttl or None, None if max_length < 0 else max_length,
+                                  None if max_bytes < 0 else max_bytes, overflow.decode())
+                queues.setdefault(name, collections.OrderedDict())
+            elif op == self.CURSOR:
+                cursors[name], = struct.unpack_from('<Q', payload, next_offset)
+            elif op == self.DROP:
+                for table in (queues, policies, cursors, subscriptions):
+                    table.pop(name, None)
+        return count
+
+# Federation
+
+class FederationLink(object):
+    ''' Mirror topics of an upstream broker into this one.
+
+    The link subscribes a queue named after this broker to each topic on the
+    upstream and leases batches of messages from it over one persistent
+    connection, republishing them here before acknowledging the batch (in
+    the same write as the request for the next one), so a dropped connection
+    loses nothing.  Messages carry the brokers they passed through and the
+    upstream withholds those that already passed through us, so links in
+    both directions, or around a ring, do not loop.
+    '''
+    BATCH  = 256    # Messages per batch
+    LINGER = 0.005  # Seconds the upstream waits for a batch to fill
+    LEASE  = 30.0   # Seconds before an unacknowledged batch is redelivered
+    RETRY  = 1.0    # Seconds between connection attempts
+
+    def __init__(self, application, upstream):
+        host, _, port = upstream.rpartition(':')
+        self.application = application
+        self.upstream    = upstream
+        self.host        = host
+        self.port        = int(port)
+        self.queue       = urllib.parse.quote('_federation.' + application.identity, safe='')
+        self.topics      = set()
+        self.stats       = application.stats.federation[upstream]
+        self.stream      = None
+        self.running     = False
+
+    def add(self, topic):
+        ''' Start mirroring topic (connecting if this is the first one). '''
+        self.topics.add(topic)
+        if not self.running:
+            self.running = True
+            self.application.ioloop.spawn_callback(self.run)
+        else:
+            self.control('PUT', topic)
+
+    def remove(self, topic):
+        ''' Stop mirroring topic (disconnecting if it was the last one). '''
+        self.topics.discard(topic)
+        self.control('DELETE', topic)
+        if not self.topics and self.stream:
+            self.stream.close()
+
+    @tornado.gen.coroutine
+    def control(self, method, topic):
+        ''' Change upstream subscription without disturbing the batch in flight. '''
+        url = 'http://{}/subscription/{}/{}'.format(self.upstream, self.queue, urllib.parse.quote(topic, safe=''))
+        try:
+            yield tornado.httpclient.AsyncHTTPClient().fetch(
+                url, method=method, body=b'' if method == 'PUT' else None, raise_error=False,
+            )
+        except (OSError, tornado.iostream.StreamClosedError) as e:
+            self.application.logger.warning('Unable to update federation ({}): {}'.format(self.upstream, e))
+
+    @tornado.gen.coroutine
+    def run(self):
+        while self.topics:
+            try:
+                self.stream = yield tornado.tcpclient.TCPClient().connect(self.host, self.port)
+                for topic in list(self.topics):
+                    self.send('PUT', '/subscription/{}/{}'.format(self.queue, urllib.parse.quote(topic, safe='')))
+                    yield self.receive()
+                self.stats.connected = True
+
+                uri  = '/queue/{}?lease={}&prefetch={}&linger={}&via={}'.format(
+                    self.queue, self.LEASE, self.BATCH, self.LINGER,
+                    urllib.parse.quote(self.application.identity, safe=''),
+                )
+                acks = None
+                while self.topics:
+                    if acks:
+                        self.send('PUT', '/ack/' + self.queue, acks)
+                    self.send('GET', uri)
+                    if acks:
+                        yield self.receive()
+                    status, body = yield self.receive()
+                    acks = self.forward(body) if status == 200 else None
+            except (OSError, KeyError, ValueError, tornado.iostream.StreamClosedError) as e:
+                if self.topics:
+                    self.application.logger.warning('Federation link ({}) failed: {}'.format(self.upstream, e))
+            finally:
+                self.stats.connected = False
+                if self.stream:
+                    self.stream.close()
+                    self.stream = None
+
+            if self.topics:
+                yield tornado.gen.sleep(self.RETRY)
+        self.running = False
+
+    def send(self, method, uri, body=b''):
+        self.stream.write('{} {} HTTP/1.1\r\nHost: {}\r\nAccept-Encoding: deflate\r\nContent-Length: {}\r\n\r\n'.format(
+            method, uri, self.upstream, len(body),
+        ).encode() + body)
+
+    @tornado.gen.coroutine
+    def receive(self):
+        ''' Read one response (returns status and decompressed body). '''
+        head    = yield self.stream.read_until(b'\r\n\r\n', max_bytes=65536)
+        lines   = head.decode('latin-1').split('\r\n')
+        status  = int(lines[0].split()[1])
+        headers = {}
+        for line in lines[1:]:
+            name, _, value = line.partition(':')
+            headers[name.strip().lower()] = value.strip()
+
+        body = yield self.stream.read_bytes(int(headers.get('content-length', 0)))
+        if headers.get('content-type') == 'application/x-mq-frames':
+            self.stats.wire_bytes += len(body)
+        if headers.get('content-encoding') == 'deflate':
+            body = zlib.decompress(body)
+        return status, body
+
+    def forward(self, body):
+        ''' Republish batch of frames here (returns lease ids to acknowledge). '''
+        acks   = []
+        now    = time.time()
+        lag    = 0.0
+        offset = 0
+        while offset < len(body):
+            eol      = body.index(b'\r\n', offset)
+            fields   = body[offset:eol].decode().split()
+            length   = int(fields[1])
+            options  = dict(field.split('=', 1) for field in fields[2:])
+            message  = Message(
+                body[eol + 2:eol + 2 + length],
+                int(options.get('priority', 0)),
+                topic     = urllib.parse.unquote(options['topic']),
+                path      = tuple(urllib.parse.unquote(broker) for broker in options['path'].split(',')),
+                timestamp = float(options['at']),
+                key       = urllib.parse.unquote(options['key']) if 'key' in options else None,
+            )
+            offset = eol + 2 + length
+
+            if self.application.publish(message.topic, message) is not None:
+                acks.append(fields[0])      # Rejected ones are redelivered later
+            lag = max(lag, now - message.timestamp)
+
+        self.stats.batches   += 1
+        self.stats.forwarded += len(acks)
+        self.stats.bytes     += len(body)
+        self.stats.lag        = lag
+        self.stats.lag_max    = max(self.stats.lag_max, lag)
+        return ' '.join(acks).encode()
+
+# Shared Memory
+
+def eventfd():
+    ''' Create non-blocking eventfd (through libc before Python 3.10). '''
+    if hasattr(os, 'eventfd'):
+        return os.eventfd(0, os.EFD_CLOEXEC | os.EFD_NONBLOCK)
+
+    import ctypes
+    libc = ctypes.CDLL(None, use_errno=True)
+    fd   = libc.eventfd(0, os.O_CLOEXEC | os.O_NONBLOCK)    # EFD_* share these values
+    if fd < 0:
+        raise OSError(ctypes.get_errno(), 'eventfd failed')
+    return fd
+
+class ShmRing(object):
+    ''' One direction of a shared memory session: a ring of records
+
+        $LENGTH (4 bytes) $OP (1 byte) (3 bytes padding) $PAYLOAD
+
+    each padded to 8 bytes, written by one side and read by the other.  The
+    writer advances head and the reader tail (each on its own cache line),
+    and a record that would not fit before the end of the ring is preceded
+    by PAD up to the end.  Either side reads the other's counter with plain
+    loads, which is only safe where stores are not reordered (x86-64, the
+    only architecture the client enables the transport on).
+    '''
+    HEAD, TAIL, SIGNALED, DATA = 0, 64, 128, 192    # Offsets in ring
+    RECORD = struct.Struct('<IB3x')
+    COUNTER = struct.Struct('<Q')
+    FLAG    = struct.Struct('<I')
+
+    def __init__(self, memory, offset, capacity):
+        self.memory   = memory
+        self.offset   = offset
+        self.capacity = capacity
+        self.data     = offset + self.DATA
+
+    def load(self, field):
+        return self.COUNTER.unpack_from(self.memory, self.offset + field)[0]
+
+    def store(self, field, value):
+        self.COUNTER.pack_into(self.memory, self.offset + field, value)
+
+    def clear(self):
+        ''' Let the writer signal again (reader is about to drain). '''
+        self.FLAG.pack_into(self.memory, self.offset + self.SIGNALED, 0)
+
+    def put(self, op, header, *strings):
+        ''' Append record (returns False if there is no room for it). '''
+        length   = self.RECORD.size + len(header) + sum(len(string) for string in strings)
+        size     = (length + 7) & ~7
+        head     = self.load(self.HEAD)
+        position = head % self.capacity
+        pad      = self.capacity - position if position + size > self.capacity else 0
+        if head + pad + size - self.load(self.TAIL) > self.capacity:
+            return False
+
+        if pad:
+            self.RECORD.pack_into(self.memory, self.data + position, pad, ShmSession.PAD)
+            position = 0
+        offset = self.data + position
+        self.RECORD.pack_into(self.memory, offset, size, op)
+        offset += self.RECORD.size
+        for part in (header,) + strings:
+            self.memory[offset:offset + len(part)] = part
+            offset += len(part)
+        self.store(self.HEAD, head + pad + size)
+        return True
+
+    def records(self):
+        ''' Read records written so far as (op, payload) pairs. '''
+        tail, head = self.load(self.TAIL), self.load(self.HEAD)
+        records    = []
+        while tail < head:
+            offset     = self.data + tail % self.capacity
+            size, op   = self.RECORD.unpack_from(self.memory, offset)
+            if op != ShmSession.PAD:
+                records.append((op, self.memory[offset + self.RECORD.size:offset + size]))
+            tail += size
+        self.store(self.TAIL, tail)
+        return records
+
+class ShmSession(object):
+    ''' Shared memory transport of one client on this host.
+
+    The client sends "HELLO\n" on the broker's unix socket and receives
+    "OK $CAPACITY\n" along with a memfd holding two rings of $CAPACITY
+    bytes (client to broker, then broker to client) and two eventfds
+    (signalled by the client and by the broker).  The client writes
+    PUBLISH, SUBSCRIBE and UNSUBSCRIBE records, which are applied in order,
+    and the broker answers publishes that carry a ticket with CONFIRM
+    records.  After a CONSUME record, the broker pushes the messages of its
+    queue as DELIVER records (like a stream), until the client closes the
+    socket.  Bodies too large for the ring (and those spooled to disk) are
+    not copied: the DELIVER record has the FILE flag and the file itself is
+    passed on the socket, in the same order.
+
+    The client signals only when the broker has cleared its flag since the
+    last signal, so a busy broker drains many publishes per wakeup, and the
+    broker signals once per batch it writes.  A full ring makes the broker
+    hold back (messages stay in the queue).
+    '''
+    PAD, PUBLISH, CONFIRM, DELIVER, SUBSCRIBE, UNSUBSCRIBE, CONSUME = range(7)
+    PUBLISH_HEADER = struct.Struct('<QIIIIB7x')     # ticket, lengths of topic query id body, priority
+    CONFIRM_HEADER = struct.Struct('<QI4x')         # ticket, status
+    DELIVER_HEADER = struct.Struct('<IIBB6x')       # lengths of topic body, priority, flags
+    QUEUE_HEADER   = struct.Struct('<II')           # lengths of queue and topic (or member)
+    FILE           = 0x1                            # DELIVER flag: body is in file passed on socket
+    BATCH  = 256        # Most messages delivered per signal
+    RETRY  = 0.001      # Seconds before retrying to write to a full ring
+    SIGNAL = struct.pack('<Q', 1)
+
+    def __init__(self, application, stream, capacity):
+        self.application = application
+        self.stream      = stream
+        self.consuming   = False
+        self.pending     = collections.deque()      # Records waiting for room
+        self.retrying    = False
+
+        size   = 2 * (ShmRing.DATA + capacity)
+        memfd  = os.memfd_create('mq', os.MFD_CLOEXEC)
+        try:
+            os.ftruncate(memfd, size)
+            self.memory   = mmap.mmap(memfd, size)
+            self.incoming = ShmRing(self.memory, 0, capacity)
+            self.outgoing = ShmRing(self.memory, ShmRing.DATA + capacity, capacity)
+            self.wakeup   = eventfd()               # Signalled by client
+            self.notify   = eventfd()               # Signalled by broker
+            stream.socket.sendmsg(
+                ['OK {}\n'.format(capacity).encode()],
+                [(socket.SOL_SOCKET, socket.SCM_RIGHTS, array.array('i', (memfd, self.wakeup, self.notify)))],
+            )
+        finally:
+            os.close(memfd)
+
+    @tornado.gen.coroutine
+    def run(self):
+        ''' Serve client until it closes its socket. '''
+        ioloop = self.application.ioloop
+        ioloop.add_handler(self.wakeup, self.on_wakeup, tornado.ioloop.IOLoop.READ)
+        self.application.stats.shm_sessions += 1
+        try:
+            yield self.stream.read_until_close()
+        except tornado.iostream.StreamClosedError:
+            pass
+        finally:
+            self.application.stats.shm_sessions -= 1
+            ioloop.remove_handler(self.wakeup)
+            os.close(self.wakeup)
+            os.close(self.notify)
+
+    def on_wakeup(self, fd, events):
+        ''' Apply what the client wrote (confirming publishes that ask for it). '''
+        self.incoming.clear()
+        try:
+            os.read(fd, 8)
+        except BlockingIOError:
+            pass
+
+        accept  = self.application.accept
+        records = self.incoming.records()
+        while records:
+            for op, payload in records:
+                if op != self.PUBLISH:
+                    self.control(op, payload)
+                    continue
+                ticket, topic, query, message_id, body, priority = self.PUBLISH_HEADER.unpack_from(payload)
+                offset = self.PUBLISH_HEADER.size
+                topic, query, message_id, body = (
+                    payload[offset:offset + topic].decode(),
+                    payload[offset + topic:offset + topic + query].decode(),
+                    payload[offset + topic + query:offset + topic + query + message_id].decode(),
+                    payload[offset + topic + query + message_id:offset + topic + query + message_id + body],
+                )
+                ttl, delay, key = None, 0, None
+                if query:
+                    arguments = urllib.parse.parse_qs(query)
+                    key       = arguments.get('key', [None])[0]
+                    try:
+                        ttl = float(arguments['ttl'][0]) if 'ttl' in arguments else None
+                        if 'at' in arguments:
+                            delay = float(arguments['at'][0]) - time.time()
+                        else:
+                            delay = float(arguments.get('delay', [0])[0])
+                    except ValueError:
+                        self.confirm(ticket, 400)
+                        continue
+                status, _ = accept(topic, body, priority, ttl, delay, message_id or None, key)
+                self.confirm(ticket, status)
+            records = self.incoming.records()
+        self.signal()
+
+    def control(self, op, payload):
+        queue, name = self.QUEUE_HEADER.unpack_from(payload)
+        offset      = self.QUEUE_HEADER.size
+        queue, name = payload[offset:offset + queue].decode(), payload[offset + queue:offset + queue + name].decode()
+        if op == self.SUBSCRIBE:
+            self.application.subscribe(queue, name)
+        elif op == self.UNSUBSCRIBE:
+            self.application.unsubscribe(queue, name)
+        elif op == self.CONSUME and not self.consuming:
+            self.consuming = True
+            self.application.ioloop.spawn_callback(self.push, queue, name or None)
+
+    def confirm(self, ticket, status):
+        if ticket:
+            self.send(self.CONFIRM, self.CONFIRM_HEADER.pack(ticket, status))
+
+    def send(self, op, header, *strings):
+        if self.pending or not self.outgoing.put(op, header, *strings):
+            self.pending.append((op, header) + strings)
+            self.retry()
+
+    def send_file(self, topic, message):
+        ''' Deliver body by passing its file (spooling it first if need be). '''
+        body = message.body
+        if not isinstance(body, Blob):
+            body = Blob(self.application.spool_dir)
+            body.append(message.body)
+        try:
+            self.stream.socket.sendmsg(
+                [b'F'], [(socket.SOL_SOCKET, socket.SCM_RIGHTS, array.array('i', (body.fileno(),)))],
+            )
+        except (AttributeError, OSError) as e:      # Socket is gone once the stream closed
+            self.application.logger.warning('Unable to pass message file: {}'.format(e))
+            self.stream.close()
+            return False
+
+        self.send(self.DELIVER, self.DELIVER_HEADER.pack(len(topic), len(body), message.priority, self.FILE), topic)
+        return True
+
+    def signal(self):
+        if not self.stream.closed():
+            os.write(self.notify, self.SIGNAL)
+
+    def retry(self):
+        ''' Write held back records once the client made room for them. '''
+        if self.retrying:
+            return
+        self.retrying = True
+
+        def flush():
+            self.retrying = False
+            while self.pending and self.outgoing.put(*self.pending[0]):
+                self.pending.popleft()
+            self.signal()
+            if self.pending and not self.stream.closed():
+                self.retry()
+        self.application.ioloop.call_later(self.RETRY, flush)
+
+    @tornado.gen.coroutine
+    def push(self, queue, member):
+        ''' Deliver messages of queue as they arrive (like a stream). '''
+        messages = self.application.queues[queue]
+        stats    = messages.stats
+
+        stats.consumers += 1
+        try:
+            while not self.stream.closed():
+                if self.pending:                    # Client is behind
+                    yield tornado.gen.sleep(self.RETRY)
+                    continue
+
+                entry = None
+                if not messages.waiters and not messages.gone(member):
+                    entry = messages.take(time.monotonic())
+
+                if not entry:
+                    waiter = messages.wait(member)
+                    while not waiter.done() and not self.stream.closed():
+                        try:
+                            yield tornado.gen.with_timeout(self.application.ioloop.time() + 1, waiter)
+                        except tornado.gen.TimeoutError:
+                            pass
+
+                    if not waiter.done():
+                        messages.cancel(member, waiter)
+                        break
+                    entry = waiter.result()
+                    if entry is None:               # Member left
+                        break
+                    if self.stream.closed():
+                        messages.stats.dequeued -= 1
+                        messages.requeue(entry)
+                        break
+
+                now     = time.monotonic()
+                entries = [entry]
+                while len(entries) < self.BATCH and not messages.waiters:
+                    entry = messages.take(now)
+                    if not entry:
+                        break
+                    entries.append(entry)
+
+                for entry in entries:
+                    message = entry[1]
+                    topic   = (message.topic or '').encode()
+                    if not isinstance(message.body, Blob) and len(message) <= self.outgoing.capacity // 4:
+                        self.send(self.DELIVER, self.DELIVER_HEADER.pack(len(topic), len(message), message.priority, 0),
+                                  topic, message.body)
+                    elif not self.send_file(topic, message):
+                        messages.stats.dequeued -= 1
+                        messages.requeue(entry)
+                messages.active = now
+                stats.last_get  = now
+                self.signal()
+        finally:
+            stats.consumers -= 1
+
+class ShmServer(tornado.tcpserver.TCPServer):
+    ''' Set up shared memory sessions for clients on this host. '''
+
+    def __init__(self, application, capacity):
+        tornado.tcpserver.TCPServer.__init__(self)
+        self.application = application
+        self.capacity    = capacity
+
+    @tornado.gen.coroutine
+    def handle_stream(self, stream, address):
+        try:
+            hello = yield stream.read_until(b'\n', max_bytes=4096)
+        except tornado.iostream.StreamClosedError:
+            return
+
+        if hello.strip() != b'HELLO':
+            stream.close()
+            return
+
+        try:
+            session = ShmSession(self.application, stream, self.capacity)
+        except OSError as e:
+            self.application.logger.error('Unable to set up shared memory: {}'.format(e))
+            stream.close()
+            return
+        yield session.run()
+
+# Statistics
+
+class QueueStatistics(object):
+    ''' Counters for one queue (updated on every enqueue and dequeue). '''
+
+    def __init__(self):
+        self.depth      = 0     # Messages currently queued
+        self.bytes      = 0     # Bytes currently queued
+        self.enqueued   = 0     # Messages ever enqueued
+        self.dequeued   = 0     # Messages ever dequeued
+        self.expired    = 0     # Messages discarded after their TTL
+        self.dropped    = 0     # Messages discarded by overflow policy
+        self.rejected   = 0     # Publishes refused by overflow policy
+        self.compacted  = 0     # Queued messages replaced by newer ones with their key
+        self.leased     = 0     # Messages delivered but not yet acknowledged
+        self.redelivered = 0    # Leases that expired without acknowledgement
+        self.consumers  = 0     # Pending GET requests
+        self.wait_total = 0.0   # Sum of consumer wait times (seconds)
+        self.wait_max   = 0.0   # Longest consumer wait time (seconds)
+        self.last_get   = None  # Time of last delivery (monotonic)
+
+class FederationStatistics(object):
+    ''' Counters for one federation link (updated on every batch). '''
+
+    def __init__(self):
+        self.connected  = False # Whether the upstream connection is up
+        self.batches    = 0     # Batches received
+        self.forwarded  = 0     # Messages republished here
+        self.bytes      = 0     # Frame bytes received (uncompressed)
+        self.wire_bytes = 0     # Bytes received on the connection
+        self.lag        = 0.0   # Oldest publish to republish delay of last batch
+        self.lag_max    = 0.0   # Largest lag observed
+
+class TopicStatistics(object):
+    ''' Counters for one topic (updated on every publish). '''
+
+    def __init__(self):
+        self.published  = 0     # Messages published
+        self.bytes      = 0     # Bytes published
+        self.fanout     = 0     # Copies delivered to subscriber queues
+        self.rate       = 0.0   # Publish rate (messages / second, EWMA)
+        self.last_count = 0     # Published count at last rate update
+
+class Statistics(object):
+    ''' Broker statistics.
+
+    Every counter is maintained incrementally: Queue updates its
+    QueueStatistics as messages are pushed, taken, leased and dropped, and
+    publish() and wait() update the topic and wait counters, so a scrape
+    costs O(queues + topics) and never walks the stored messages.
+    '''
+    RATE_INTERVAL = 1.0     # Seconds between publish rate updates
+    RATE_ALPHA    = 0.2     # Smoothing factor for publish rate EWMA
+    LAG_INTERVAL  = 0.1     # Seconds between event loop lag probes
+
+    def __init__(self):
+        self.started   = time.time()
+        self.queues    = collections.defaultdict(QueueStatistics)
+        self.topics    = collections.defaultdict(TopicStatistics)
+        self.federation = collections.defaultdict(FederationStatistics)
+        self.scheduled = 0      # Messages waiting for delayed delivery
+        self.looped    = 0      # Messages withheld from the broker they came from
+        self.duplicates = 0     # Publishes ignored because their id was seen
+        self.shm_sessions = 0   # Clients connected through shared memory
+        self.restore   = None   # What was loaded from the journal at startup
+        self.serving   = None   # Seconds from process start to serving
+        self.lag       = 0.0    # Last observed event loop lag (seconds)
+        self.lag_max   = 0.0    # Largest observed event loop lag (seconds)
+
+    def publish(self, topic, message, subscribers):
+        stats = self.topics[topic]
+        stats.published += 1
+        stats.bytes     += len(message)
+        stats.fanout    += subscribers
+
+    def wait(self, queue, seconds):
+        stats = self.queues[queue]
+        stats.wait_total += seconds
+        stats.wait_max    = max(stats.wait_max, seconds)
+        stats.last_get    = time.monotonic()
+
+    def update_rates(self):
+        for stats in self.topics.values():
+            delta            = stats.published - stats.last_count
+            stats.last_count = stats.published
+            stats.rate       = self.RATE_ALPHA * (delta / self.RATE_INTERVAL) + \
+                               (1.0 - self.RATE_ALPHA) * stats.rate
+
+    def update_lag(self, lag):
+        self.lag     = max(lag, 0.0)
+        self.lag_max = max(self.lag_max, self.lag)
+
+    def as_dict(self):
+        now = time.monotonic()
+        return {
+            'uptime'   : time.time() - self.started,
+            'scheduled': self.scheduled,
+            'looped'   : self.looped,
+            'duplicates': self.duplicates,
+            'shm_sessions': self.shm_sessions,
+            'restore'  : self.restore,
+            'serving'  : self.serving,
+            'loop'     : {'lag': self.lag, 'lag_max': self.lag_max},
+            'queues': {
+                name: {
+                    'depth'    : s.depth,
+                    'bytes'    : s.bytes,
+                    'enqueued' : s.enqueued,
+                    'dequeued' : s.dequeued,
+                    'expired'  : s.expired,
+                    'dropped'  : s.dropped,
+                    'rejected' : s.rejected,
+                    'compacted': s.compacted,
+                    'leased'   : s.leased,
+                    'redelivered': s.redelivered,
+                    'consumers': s.consumers,
+                    'wait_avg' : s.wait_total / s.dequeued if s.dequeued else 0.0,
+                    'wait_max' : s.wait_max,
+                    'idle'     : now - s.last_get if s.last_get else None,
+                } for name, s in self.queues.items()
+            },
+            'topics': {
+                name: {
+                    'published': s.published,
+                    'bytes'    : s.bytes,
+                    'fanout'   : s.fanout,
+                    'rate'     : s.rate,
+                } for name, s in self.topics.items()
+            },
+            'federation': {
+                upstream: {
+                    'connected' : s.connected,
+                    'batches'   : s.batches,
+                    'forwarded' : s.forwarded,
+                    'bytes'     : s.bytes,
+                    'wire_bytes': s.wire_bytes,
+                    'lag'       : s.lag,
+                    'lag_max'   : s.lag_max,
+                } for upstream, s in self.federation.items()
+            },
+        }
+
+    def as_prometheus(self):
+        lines = [
+            '# TYPE mq_uptime_seconds gauge',
+            'mq_uptime_seconds {:.3f}'.format(time.time() - self.started),
+            '# TYPE mq_scheduled_messages gauge',
+            'mq_scheduled_messages {}'.format(self.scheduled),
+            '# TYPE mq_federation_looped_total counter',
+            'mq_federation_looped_total {}'.format(self.looped),
+            '# TYPE mq_duplicates_total counter',
+            'mq_duplicates_total {}'.format(self.duplicates),
+            '# TYPE mq_shm_sessions gauge',
+            'mq_shm_sessions {}'.format(self.shm_sessions),
+            '# TYPE mq_loop_lag_seconds gauge',
+            'mq_loop_lag_seconds {:.6f}'.format(self.lag),
+            '# TYPE mq_loop_lag_max_seconds gauge',
+            'mq_loop_lag_max_seconds {:.6f}'.format(self.lag_max),
+        ]
+
+        metrics = (
+            ('mq_queue_depth'              , 'gauge'  , self.queues, lambda s: s.depth),
+            ('mq_queue_bytes'              , 'gauge'  , self.queues, lambda s: s.bytes),
+            ('mq_queue_enqueued_total'     , 'counter', self.queues, lambda s: s.enqueued),
+            ('mq_queue_dequeued_total'     , 'counter', self.queues, lambda s: s.dequeued),
+            ('mq_queue_expired_total'      , 'counter', self.queues, lambda s: s.expired),
+            ('mq_queue_dropped_total'      , 'counter', self.queues, lambda s: s.dropped),
+            ('mq_queue_rejected_total'     , 'counter', self.queues, lambda s: s.rejected),
+            ('mq_queue_compacted_total'    , 'counter', self.queues, lambda s: s.compacted),
+            ('mq_queue_leased'             , 'gauge'  , self.queues, lambda s: s.leased),
+            ('mq_queue_redelivered_total'  , 'counter', self.queues, lambda s: s.redelivered),
+            ('mq_queue_consumers'          , 'gauge'  , self.queues, lambda s: s.consumers),
+            ('mq_queue_wait_seconds_total' , 'counter', self.queues, lambda s: s.wait_total),
+            ('mq_queue_wait_seconds_max'   , 'gauge'  , self.queues, lambda s: s.wait_max),
+            ('mq_topic_published_total'    , 'counter', self.topics, lambda s: s.published),
+            ('mq_topic_bytes_total'        , 'counter', self.topics, lambda s: s.bytes),
+            ('mq_topic_fanout_total'       , 'counter', self.topics, lambda s: s.fanout),
+            ('mq_topic_publish_rate'       , 'gauge'  , self.topics, lambda s: s.rate),
+            ('mq_federation_connected'     , 'gauge'  , self.federation, lambda s: int(s.connected)),
+            ('mq_federation_batches_total' , 'counter', self.federation, lambda s: s.batches),
+            ('mq_federation_forwarded_total', 'counter', self.federation, lambda s: s.forwarded),
+            ('mq_federation_bytes_total'   , 'counter', self.federation, lambda s: s.bytes),
+            ('mq_federation_wire_bytes_total', 'counter', self.federation, lambda s: s.wire_bytes),
+            ('mq_federation_lag_seconds'   , 'gauge'  , self.federation, lambda s: s.lag),
+            ('mq_federation_lag_seconds_max', 'gauge' , self.federation, lambda s: s.lag_max),
+        )
+
+        for name, kind, table, value in metrics:
+            label = 'queue' if table is self.queues else 'topic' if table is self.topics else 'upstream'
+            lines.append('# TYPE {} {}'.format(name, kind))
+            for key, stats in table.items():
+                lines.append('{}{{{}="{}"}} {}'.format(
+                    name, label, key.replace('\\', '\\\\').replace('"', '\\"'), value(stats)
+                ))
+
+        return '\n'.join(lines) + '\n'
+
 # Base Handler
 
 class BaseHandler(tornado.web.RequestHandler):
@@ -37,31 +1589,79 @@ class BaseHandler(tornado.web.RequestHandler):
         self.application.logger.info(message.rstrip())
         self.write(message)
 
+    @tornado.gen.coroutine
+    def write_blob(self, blob):
+        ''' Write body kept out of line, flushing each chunk before reading
+        the next (returns False if the client went away). '''
+        for chunk in blob.chunks():
+            self.write(chunk)
+            try:
+                yield self.flush()
+            except tornado.iostream.StreamClosedError:
+                return False
+        return True
+
 # Topic Handler
 
+@tornado.web.stream_request_body
 class TopicHandler(BaseHandler):
+    def prepare(self):
+        ''' Take the body as it arrives, moving it to a spool file once it
+        turns out to be large (instead of holding it in memory whole). '''
+        self.request.connection.set_max_body_size(self.application.max_message_size)
+        self.chunks   = []
+        self.blob     = None
+        self.received = 0
+
+    def data_received(self, chunk):
+        self.received += len(chunk)
+        if self.blob is not None:
+            self.blob.append(chunk)
+            return
+
+        self.chunks.append(chunk)
+        if self.application.spool_size and self.received >= self.application.spool_size:
+            self.blob = Blob(self.application.spool_dir)
+            for chunk in self.chunks:
+                self.blob.append(chunk)
+            self.chunks = None
+
     def put(self, topic):
         ''' Publish message (request body) to each queue that is subscribed to topic. '''
-        message     = self.request.body
-        subscribers = 0
-
-        for queue, topics in self.application.subscriptions.items():
-            if topic in topics:
-                self.application.queues[queue].append(message)
-                subscribers += 1
-
-        if subscribers:
-            self.write('Published message ({} bytes) to {} subscribers of {}\n'.format(
-                len(message),
-                subscribers,
-                topic,
-            ))
-        else:
-            raise tornado.web.HTTPError(404, 'There are no subscribers for topic: {}'.format(topic))
+        try:
+            priority = int(self.request.headers.get('X-Priority', 0))
+        except ValueError:
+            raise tornado.web.HTTPError(400, 'Invalid priority: {}'.format(self.request.headers['X-Priority']))
+
+        try:
+            ttl = float(self.get_argument('ttl')) if 'ttl' in self.request.arguments else None
+        except ValueError:
+            raise tornado.web.HTTPError(400, 'Invalid ttl')
+
+        try:
+            if 'at' in self.request.arguments:
+                delay = float(self.get_argument('at')) - time.time()
+            else:
+                delay = float(self.get_argument('delay', 0))
+        except ValueError:
+            raise tornado.web.HTTPError(400, 'Invalid delivery time')
+
+        body = self.blob if self.blob is not None else b''.join(self.chunks)
+        status, text = self.application.accept(
+            topic, body, priority, ttl, delay, self.request.headers.get('X-Message-Id'), self.get_argument('key', None),
+        )
+        if status >= 400:
+            raise tornado.web.HTTPError(status, text)
+        self.set_status(status)
+        self.write(text + '\n')
 
 # Queue Handler
 
 class QueueHandler(BaseHandler):
+    COMPRESS_MIN   = 512    # Smallest batch of frames worth compressing (bytes)
+    COMPRESS_LEVEL = 1      # Favour event loop latency over ratio
+    LINGER_MAX     = 1.0    # Longest a lease request may wait to fill its batch
+
     @tornado.gen.coroutine
     def get(self, queue):
         ''' Retrieve one message from queue (wait until one is available). '''
@@ -69,42 +1669,382 @@ class QueueHandler(BaseHandler):
         if queue not in self.application.queues:
             raise tornado.web.HTTPError(404, 'There is no queue named: {}'.format(queue))
 
-        while not self.application.queues[queue] and not self.request.connection.stream.closed():
-            yield tornado.gen.sleep(1)
+        try:
+            prefetch = max(int(self.get_argument('prefetch', 1)), 1)
+            lease    = float(self.get_argument('lease')) if 'lease' in self.request.arguments else None
+            linger   = min(float(self.get_argument('linger', 0)), self.LINGER_MAX)
+        except ValueError:
+            raise tornado.web.HTTPError(400, 'Invalid prefetch, lease or linger')
 
-        if self.application.queues[queue]:
-            self.write_response(self.application.queues[queue].pop(0))
-        else:
+        member   = self.get_argument('member', None)
+        messages = self.application.queues[queue]
+        stats    = messages.stats
+        started  = time.monotonic()
+        entry    = None
+
+        # Take a message directly only if nobody is queued ahead of us
+        if not messages.waiters and not messages.gone(member):
+            entry = messages.take(started)
+
+        # Otherwise wait for our turn (re-checking for a closed connection
+        # every second)
+        if not entry:
+            waiter = messages.wait(member)
+            stats.consumers += 1
+            try:
+                while not waiter.done() and not self.request.connection.stream.closed():
+                    try:
+                        yield tornado.gen.with_timeout(self.application.ioloop.time() + 1, waiter)
+                    except tornado.gen.TimeoutError:
+                        pass
+            finally:
+                stats.consumers -= 1
+                messages.active  = time.monotonic()
+
+            if waiter.done():
+                entry = waiter.result()
+            else:
+                messages.cancel(member, waiter)
+
+            if entry and self.request.connection.stream.closed():
+                messages.stats.dequeued -= 1
+                messages.requeue(entry)
+                entry = None
+
+        if not entry:
             raise tornado.web.HTTPError(404, 'There are no messages for queue: {}'.format(queue))
 
+        self.application.stats.wait(queue, time.monotonic() - started)
+        if lease is not None:
+            if linger and len(messages) < prefetch - 1:   # Let the batch fill up
+                yield tornado.gen.sleep(linger)
+                if self.request.connection.stream.closed():
+                    messages.stats.dequeued -= 1
+                    messages.requeue(entry)
+                    return
+            yield self.write_leases(messages, entry, prefetch, lease, self.get_argument('via', None))
+            return
+
+        message = entry[1]
+        if message.priority:
+            self.set_header('X-Priority', message.priority)
+        if message.topic is not None:
+            self.set_header('X-Topic', urllib.parse.quote(message.topic, safe=''))
+        if isinstance(message.body, Blob):
+            self.set_header('Content-Length', len(message))
+            yield self.write_blob(message.body)
+        else:
+            self.write_response(message.body)
+
+    @tornado.gen.coroutine
+    def write_leases(self, messages, entry, prefetch, lease, via=None):
+        ''' Lease entry and up to prefetch - 1 more (as many as max_timers
+        leaves timers for) and write them as frames:
+
+            $ID $LENGTH priority=$PRIORITY topic=$TOPIC\r\n
+            $BODY
+
+        Federated brokers identify themselves with via, get the path, publish
+        time and key of each message as well, and never get messages that
+        already passed through them.  Batches are deflate compressed for
+        clients that accept it, unless they hold bodies kept out of line,
+        which are written a chunk at a time.
+        '''
+        now     = time.monotonic()
+        room    = self.application.max_timers - len(self.application.timers)
+        if room <= 0:                               # No timer to redeliver it
+            messages.stats.dequeued -= 1
+            messages.requeue(entry)
+            raise tornado.web.HTTPError(503, 'Too many pending leases and scheduled messages')
+
+        entries = [entry]
+        while len(entries) < min(prefetch, room):
+            entry = messages.take(now)
+            if not entry:
+                break
+            entries.append(entry)
+
+        frames = []
+        for expires, message in entries:
+            if via is not None:
+                path = message.path + (self.application.identity,)
+                if via in path:
+                    self.application.stats.looped += 1
+                    continue
+
+            lease_id = messages.lease((expires, message))
+            self.application.timer(now + lease, functools.partial(messages.release, lease_id))
+            header = '{} {} priority={} topic={}'.format(
+                lease_id, len(message), message.priority, urllib.parse.quote(message.topic or '', safe=''),
+            )
+            if via is not None:
+                header += ' path={} at={:.6f}'.format(
+                    ','.join(urllib.parse.quote(broker, safe='') for broker in path),
+                    message.timestamp,
+                )
+                if message.key is not None:
+                    header += ' key={}'.format(urllib.parse.quote(message.key, safe=''))
+            frames.append(header.encode() + b'\r\n')
+            frames.append(message.body)
+
+        if any(isinstance(frame, Blob) for frame in frames):
+            self.set_header('Content-Type', 'application/x-mq-frames')
+            self.set_header('Content-Length', sum(len(frame) for frame in frames))
+            for frame in frames:
+                if isinstance(frame, Blob):
+                    yield self.write_blob(frame)
+                else:
+                    self.write(frame)
+            return
+
+        payload = b''.join(frames)
+        if len(payload) >= self.COMPRESS_MIN and 'deflate' in self.request.headers.get('Accept-Encoding', ''):
+            payload = zlib.compress(payload, self.COMPRESS_LEVEL)
+            self.set_header('Content-Encoding', 'deflate')
+
+        self.set_header('Content-Type', 'application/x-mq-frames')
+        self.write(payload)
+
+    def put(self, queue):
+        ''' Set expiry and length limits of queue (creating it if necessary). '''
+        policy = {}
+        try:
+            for name, kind in (('ttl', float), ('max_length', int), ('max_bytes', int)):
+                if name in self.request.arguments:
+                    value = kind(self.get_argument(name))
+                    policy[name] = value if value > 0 else None
+        except ValueError:
+            raise tornado.web.HTTPError(400, 'Invalid value for: {}'.format(name))
+
+        overflow = self.get_argument('overflow', None)
+        if overflow is not None:
+            if overflow not in Queue.OVERFLOWS:
+                raise tornado.web.HTTPError(400, 'Invalid overflow policy: {}'.format(overflow))
+            policy['overflow'] = overflow
+
+        messages = self.application.queues[queue]
+        for name, value in policy.items():
+            setattr(messages, name, value)
+        messages.active = time.monotonic()
+        if self.application.journal is not None:
+            self.application.journal.policy(queue, messages)
+
+        self.write_response('Updated queue ({}): ttl={} max_length={} max_bytes={} overflow={}\n'.format(
+            queue, messages.ttl, messages.max_length, messages.max_bytes, messages.overflow,
+        ))
+
+    def delete(self, queue):
+        ''' Release pending retrievals of a consumer group member. '''
+        if queue not in self.application.queues:
+            raise tornado.web.HTTPError(404, 'There is no queue named: {}'.format(queue))
+
+        member = self.get_argument('member', None)
+        if member is None:
+            raise tornado.web.HTTPError(400, 'Missing member')
+
+        released = self.application.queues[queue].leave(member)
+        self.write_response('Member ({}) left queue ({}) releasing {} requests\n'.format(member, queue, released))
+
+# Stream Handler
+
+class StreamHandler(BaseHandler):
+    BATCH = 256             # Most frames written per flush
+
+    @tornado.gen.coroutine
+    def get(self, queue):
+        ''' Push messages of queue as frames until the client goes away:
+
+            $SEQUENCE $LENGTH priority=$PRIORITY topic=$TOPIC\r\n
+            $BODY
+
+        Frames are written as soon as messages are enqueued (along with any
+        others already waiting, up to BATCH per flush).  Group members are
+        served in turn with everyone else waiting on the queue, and a
+        member's stream ends when it leaves.
+        '''
+        if queue not in self.application.queues:
+            raise tornado.web.HTTPError(404, 'There is no queue named: {}'.format(queue))
+
+        try:
+            resume = int(self.get_argument('resume')) if 'resume' in self.request.arguments else None
+        except ValueError:
+            raise tornado.web.HTTPError(400, 'Invalid resume point')
+
+        member   = self.get_argument('member', None)
+        messages = self.application.queues[queue]
+        stats    = messages.stats
+        stream   = self.request.connection.stream
+
+        # A new stream starts after the last message streamed so far
+        self.set_header('Content-Type', 'application/x-mq-frames')
+        self.set_header('X-Sequence', messages.sequence)
+        if resume is not None:
+            for sequence, message in messages.resume(resume, member):
+                self.write_frame(sequence, message)
+                if isinstance(message.body, Blob):
+                    yield self.write_blob(message.body)
+        yield self.flush()
+
+        stats.consumers += 1
+        try:
+            while not stream.closed():
+                entry = None
+                if not messages.waiters and not messages.gone(member):
+                    entry = messages.take(time.monotonic())
+
+                if not entry:
+                    waiter = messages.wait(member)
+                    while not waiter.done() and not stream.closed():
+                        try:
+                            yield tornado.gen.with_timeout(self.application.ioloop.time() + 1, waiter)
+                        except tornado.gen.TimeoutError:
+                            pass
+
+                    if not waiter.done():
+                        messages.cancel(member, waiter)
+                        break
+                    entry = waiter.result()
+                    if entry is None:               # Member left
+                        break
+                    if stream.closed():
+                        messages.stats.dequeued -= 1
+                        messages.requeue(entry)
+                        break
+
+                # Frames lost along with the connection are resent on resume
+                now     = time.monotonic()
+                entries = [entry]
+                while len(entries) < self.BATCH and not messages.waiters:
+                    entry = messages.take(now)
+                    if not entry:
+                        break
+                    entries.append(entry)
+
+                for _, message in entries:
+                    self.write_frame(messages.stream(message, member), message)
+                    if isinstance(message.body, Blob):
+                        yield self.write_blob(message.body)
+                messages.active = now
+                stats.last_get  = now
+                try:
+                    yield self.flush()
+                except tornado.iostream.StreamClosedError:
+                    break
+        finally:
+            stats.consumers -= 1
+
+    def write_frame(self, sequence, message):
+        ''' Write frame (but only the header of a body kept out of line). '''
+        self.write('{} {} priority={} topic={}\r\n'.format(
+            sequence, len(message), message.priority, urllib.parse.quote(message.topic or '', safe=''),
+        ).encode())
+        if not isinstance(message.body, Blob):
+            self.write(message.body)
+
+# Ack Handler
+
+class AckHandler(BaseHandler):
+    def put(self, queue):
+        ''' Acknowledge leased messages (whitespace separated lease ids in body). '''
+        if queue not in self.application.queues:
+            raise tornado.web.HTTPError(404, 'There is no queue named: {}'.format(queue))
+
+        messages = self.application.queues[queue]
+        try:
+            acked = sum(messages.ack(int(lease)) for lease in self.request.body.split())
+        except ValueError:
+            raise tornado.web.HTTPError(400, 'Invalid lease id')
+
+        self.write('Acknowledged {} messages in queue ({})\n'.format(acked, queue))
+
 # Subscription Handler
 
 class SubscriptionHandler(BaseHandler):
     def put(self, queue, topic):
         ''' Subscribe queue to topic. '''
-        try:
-            self.application.subscriptions[queue].add(topic)
-            if queue not in self.application.queues:
-                self.application.queues[queue]
-        except KeyError:
+        if not self.application.subscribe(queue, topic):
             raise tornado.web.HTTPError(404, 'There is no queue named: {}'.format(queue))
 
         self.write_response('Subscribed queue ({}) to topic ({})\n'.format(queue, topic))
 
     def delete(self, queue, topic):
         ''' Unsubscribe queue from topic. '''
-        try:
-            self.application.subscriptions[queue].remove(topic)
-        except KeyError:
+        if not self.application.unsubscribe(queue, topic):
             raise tornado.web.HTTPError(404, 'There is no queue named: {}'.format(queue))
 
         self.write_response('Unsubscribed queue ({}) from topic ({})\n'.format(queue, topic))
 
+# Compaction Handler
+
+class CompactionHandler(BaseHandler):
+    def put(self, topic):
+        ''' Keep only the latest message per key of topic in each queue. '''
+        self.application.compact(topic, True)
+        self.write_response('Compacting topic ({})\n'.format(topic))
+
+    def delete(self, topic):
+        ''' Keep every message of topic again. '''
+        if not self.application.compact(topic, False):
+            raise tornado.web.HTTPError(404, 'Topic is not compacted: {}'.format(topic))
+
+        self.write_response('Stopped compacting topic ({})\n'.format(topic))
+
+# Federation Handler
+
+class FederationHandler(BaseHandler):
+    def put(self, upstream, topic):
+        ''' Mirror topic from upstream broker (host:port). '''
+        try:
+            self.application.federate(upstream, topic)
+        except ValueError:
+            raise tornado.web.HTTPError(400, 'Invalid upstream: {}'.format(upstream))
+
+        self.write_response('Federating topic ({}) from upstream ({})\n'.format(topic, upstream))
+
+    def delete(self, upstream, topic):
+        ''' Stop mirroring topic from upstream broker. '''
+        link = self.application.federation.get(upstream)
+        if link is None or topic not in link.topics:
+            raise tornado.web.HTTPError(404, 'Topic ({}) is not federated from: {}'.format(topic, upstream))
+
+        link.remove(topic)
+        self.write_response('Stopped federating topic ({}) from upstream ({})\n'.format(topic, upstream))
+
+# Stats Handler
+
+class StatsHandler(BaseHandler):
+    def get(self):
+        ''' Report broker statistics as JSON (or Prometheus text with ?format=prometheus). '''
+        if self.get_argument('format', 'json') == 'prometheus':
+            self.set_header('Content-Type', 'text/plain; version=0.0.4')
+            self.write(self.application.stats.as_prometheus())
+        else:
+            self.set_header('Content-Type', 'application/json')
+            self.write(json.dumps(self.application.stats.as_dict()) + '\n')
+
+class MetricsHandler(BaseHandler):
+    def get(self):
+        ''' Report broker statistics in Prometheus text format. '''
+        self.set_header('Content-Type', 'text/plain; version=0.0.4')
+        self.write(self.application.stats.as_prometheus())
+
 # Message Queue
 
 class MessageQueue(tornado.web.Application):
-    DEFAULT_ADDRESS = '0.0.0.0'
-    DEFAULT_PORT    = 9620
+    DEFAULT_ADDRESS    = '0.0.0.0'
+    DEFAULT_PORT       = 9620
+    DEFAULT_MAX_TIMERS = 10000000
+    DEFAULT_IDLE       = 3600.0     # Seconds before an unused queue is removed
+    DEFAULT_DEDUP_SIZE = 100000     # Message ids remembered for deduplication
+    DEFAULT_DEDUP_AGE  = 60.0       # Seconds message ids are remembered
+    DEFAULT_SNAPSHOT_INTERVAL = 60.0        # Seconds between snapshots
+    DEFAULT_SNAPSHOT_BYTES    = 64 << 20    # Journal bytes that force a snapshot
+    DEFAULT_SHM_SOCKET        = '/tmp/mq.{port}.sock'   # Where local clients set up shared memory
+    DEFAULT_SHM_RING_SIZE     = 4 << 20     # Bytes per direction of a shared memory session
+    DEFAULT_SPOOL_SIZE        = 1 << 20     # Bodies at least this large are kept on disk
+    DEFAULT_MAX_MESSAGE_SIZE  = 1 << 30     # Largest body accepted
+    SWEEP_INTERVAL     = 1.0        # Seconds between expiry sweeps
+    SWEEP_LIMIT        = 64         # Expired messages removed per level per sweep
 
     def __init__(self, **settings):
         tornado.web.Application.__init__(self, **settings)
@@ -113,30 +2053,273 @@ class MessageQueue(tornado.web.Application):
         self.address       = settings.get('address', self.DEFAULT_ADDRESS)
         self.port          = settings.get('port'   , self.DEFAULT_PORT)
         self.ioloop        = tornado.ioloop.IOLoop.instance()
-        self.queues        = collections.defaultdict(list)
         self.subscriptions = collections.defaultdict(set)
+        self.compacted     = set(settings.get('compact') or ())    # Topics keeping one message per key
+        self.stats         = Statistics()
+        self.idle_timeout  = settings.get('queue_idle_timeout', self.DEFAULT_IDLE)
+        self.queues        = QueueTable(self.stats,
+            ttl        = settings.get('queue_ttl') or None,
+            max_length = settings.get('queue_max_length') or None,
+            max_bytes  = settings.get('queue_max_bytes') or None,
+            overflow   = settings.get('queue_overflow', 'drop-oldest'),
+        )
+        self.max_timers    = settings.get('max_timers', self.DEFAULT_MAX_TIMERS)
+        self.timers        = TimerWheel(time.monotonic())
+        self.identity      = settings.get('broker_id') or '{}:{}'.format(socket.gethostname(), self.port)
+        self.federation    = {}     # FederationLink by upstream
+        dedup_size         = settings.get('dedup_size', self.DEFAULT_DEDUP_SIZE)
+        self.dedup         = DedupWindow(dedup_size, settings.get('dedup_age', self.DEFAULT_DEDUP_AGE)) if dedup_size else None
+        self.journal       = None   # Journal of state changes (None without data_dir)
+        self.spool_dir     = settings.get('spool_dir') or None
+        self.spool_size    = settings.get('spool_size', self.DEFAULT_SPOOL_SIZE)
+        self.max_message_size = settings.get('max_message_size', self.DEFAULT_MAX_MESSAGE_SIZE)
+        if settings.get('data_dir'):
+            self.journal = Journal(self, settings['data_dir'],
+                settings.get('snapshot_interval', self.DEFAULT_SNAPSHOT_INTERVAL),
+                settings.get('snapshot_bytes', self.DEFAULT_SNAPSHOT_BYTES),
+            )
 
         self.add_handlers('.*', (
             ('.*/topic/(.*)'            , TopicHandler),
             ('.*/queue/(.*)'            , QueueHandler),
+            ('.*/stream/(.*)'           , StreamHandler),
+            ('.*/ack/(.*)'              , AckHandler),
             ('.*/subscription/(.*)/(.*)', SubscriptionHandler),
+            ('.*/compaction/(.*)'       , CompactionHandler),
+            ('.*/federation/(.*)/(.*)'  , FederationHandler),
+            ('.*/stats'                 , StatsHandler),
+            ('.*/metrics'               , MetricsHandler),
         ))
 
+    def accept(self, topic, body, priority=0, ttl=None, delay=0, message_id=None, key=None):
+        ''' Publish body to topic now, or schedule it after delay seconds.
+
+        Returns the HTTP status and description of the outcome, which every
+        transport reports back to the publisher.
+        '''
+        message = Message(self.spool(body), min(max(priority, 0), Queue.PRIORITIES - 1), ttl, topic, key=key or None)
+        dedup   = self.dedup
+
+        # A repeat (e.g. resent after its response was lost) was already
+        # accepted, so answer as if it had been accepted again
+        if message_id and dedup is not None and message_id in dedup:
+            self.stats.duplicates += 1
+            return 200, 'Ignored duplicate message ({}) to {}'.format(message_id, topic)
+
+        if any(self.queues[queue].oversize(message)
+               for queue, topics in self.subscriptions.items() if topic in topics):
+            return 413, 'Message ({} bytes) exceeds the byte limit of a subscriber queue of {}'.format(len(message), topic)
+
+        if delay > 0:
+            if not self.schedule(time.monotonic() + delay, topic, message):
+                return 503, 'Too many scheduled messages'
+
+            if message_id and dedup is not None:
+                dedup.add(message_id)
+            return 202, 'Scheduled message ({} bytes) for {} in {:.3f} seconds'.format(len(message), topic, delay)
+
+        subscribers = self.publish(topic, message)
+        if subscribers is None:
+            return 503, 'A subscriber queue of topic is full: {}'.format(topic)
+        if not subscribers:
+            return 404, 'There are no subscribers for topic: {}'.format(topic)
+
+        if message_id and dedup is not None:
+            dedup.add(message_id)
+        return 200, 'Published message ({} bytes) to {} subscribers of {}'.format(len(message), subscribers, topic)
+
+    def spool(self, body):
+        ''' Keep body out of line if it is large (returns what to store). '''
+        if isinstance(body, Blob) or not self.spool_size or len(body) < self.spool_size:
+            return body
+        blob = Blob(self.spool_dir)
+        blob.append(body)
+        return blob
+
+    def publish(self, topic, message):
+        ''' Deliver message to each queue subscribed to topic.
+
+        Returns the number of subscribers, or None if a subscriber queue with
+        the reject policy is full (in which case no queue receives it).
+        '''
+        queues  = [self.queues[queue] for queue, topics in self.subscriptions.items() if topic in topics]
+        compact = message.key is not None and topic in self.compacted
+
+        for queue in queues:
+            if queue.overflow == 'reject' and queue.overflows(message, compact):
+                queue.stats.rejected += 1
+                return None
+
+        now = time.monotonic()
+        for queue in queues:
+            queue.push(message, now, compact)
+
+        self.stats.publish(topic, message, len(queues))
+        return len(queues)
+
+    def subscribe(self, queue, topic):
+        ''' Subscribe queue to topic (creating queue). '''
+        self.subscriptions[queue].add(topic)
+        self.queues[queue].active = time.monotonic()
+        if self.journal is not None:
+            self.journal.subscribe(queue, topic)
+        return True
+
+    def unsubscribe(self, queue, topic):
+        ''' Unsubscribe queue from topic (returns False if it was not). '''
+        if topic not in self.subscriptions.get(queue, ()):
+            return False
+        self.subscriptions[queue].remove(topic)
+        if self.journal is not None:
+            self.journal.unsubscribe(queue, topic)
+        return True
+
+    def compact(self, topic, enabled):
+        ''' Turn compaction of topic on or off (returns False if it already was).
+
+        Messages queued before compaction was turned on are not indexed, so
+        only those published since are replaced.
+        '''
+        if (topic in self.compacted) == enabled:
+            return False
+        if enabled:
+            self.compacted.add(topic)
+        else:
+            self.compacted.discard(topic)
+            for queue in self.queues.values():
+                for index in [index for index in queue.keys if index[0] == topic]:
+                    del queue.keys[index]
+        if self.journal is not None:
+            self.journal.compact(topic, enabled)
+        return True
+
+    def federate(self, upstream, topic):
+        ''' Mirror topic from upstream broker (host:port). '''
+        link = self.federation.get(upstream)
+        if link is None:
+            link = self.federation[upstream] = FederationLink(self, upstream)
+        link.add(topic)
+
+    def timer(self, when, callback):
+        ''' Call callback at monotonic time when, unless max_timers timers
+        (scheduled messages and leases alike) are pending already (returns
+        whether it was scheduled).  A lease's timer stays pending until the
+        lease would have expired, even if it is acknowledged sooner. '''
+        if len(self.timers) >= self.max_timers:
+            return False
+
+        self.timers.schedule(when, callback)
+        return True
+
+    def schedule(self, when, topic, message):
+        ''' Publish message to topic at monotonic time when. '''
+        if not self.timer(when, functools.partial(self.deliver, topic, message)):
+            return False
+
+        self.stats.scheduled += 1
+        return True
+
+    def deliver(self, topic, message):
+        ''' Publish scheduled message whose delivery time has come. '''
+        self.stats.scheduled -= 1
+        self.publish(topic, message)
+
+    def sweep(self):
+        ''' Discard expired messages and remove queues idle for too long. '''
+        now = time.monotonic()
+        for name, queue in list(self.queues.items()):
+            queue.sweep(now, self.SWEEP_LIMIT)
+
+            if self.idle_timeout and not queue.stats.consumers and now - queue.active > self.idle_timeout:
+                self.logger.info('Removing idle queue ({})'.format(name))
+                del self.queues[name]
+                self.subscriptions.pop(name, None)
+                self.stats.queues.pop(name, None)
+                if self.journal is not None:
+                    self.journal.drop(name)
+
+    def probe_lag(self, expected=None):
+        ''' Measure how late the event loop runs a scheduled callback. '''
+        now = self.ioloop.time()
+        if expected is not None:
+            self.stats.update_lag(now - expected)
+
+        expected = now + Statistics.LAG_INTERVAL
+        self.ioloop.call_at(expected, self.probe_lag, expected)
+
     def run(self):
+        if self.journal is not None:
+            restored = self.stats.restore = self.journal.restore()
+            self.queues.journal = self.journal
+            for queue in self.queues.values():
+                queue.journal = self.journal
+            tornado.ioloop.PeriodicCallback(
+                self.journal.check, Journal.FLUSH_INTERVAL * 1000
+            ).start()
+            self.logger.info('Restored {} messages in {} queues in {:.3f} seconds (snapshot {} records in {:.3f} seconds, journal {} records)'.format(
+                restored['messages'], restored['queues'], restored['seconds'],
+                restored['snapshot_records'], restored['snapshot_seconds'], restored['journal_records'],
+            ))
+
         try:
             self.listen(self.port, self.address)
         except socket.error as e:
             self.logger.fatal('Unable to listen on {}:{} = {}'.format(self.address, self.port, e))
             sys.exit(1)
 
+        shm_socket = self.settings.get('shm_socket', self.DEFAULT_SHM_SOCKET)
+        if shm_socket:
+            path = shm_socket.format(port=self.port)
+            size = max(self.settings.get('shm_ring_size', self.DEFAULT_SHM_RING_SIZE), 1 << 16) & ~7
+            try:
+                ShmServer(self, size).add_socket(tornado.netutil.bind_unix_socket(path))
+            except OSError as e:
+                self.logger.warning('Unable to listen on {} = {} (no shared memory transport)'.format(path, e))
+
+        tornado.ioloop.PeriodicCallback(
+            self.stats.update_rates, Statistics.RATE_INTERVAL * 1000
+        ).start()
+        tornado.ioloop.PeriodicCallback(
+            lambda: self.timers.advance(time.monotonic()), TimerWheel.TICK * 1000
+        ).start()
+        tornado.ioloop.PeriodicCallback(
+            self.sweep, self.SWEEP_INTERVAL * 1000
+        ).start()
+        self.probe_lag()
+
+        for entry in self.settings.get('federate') or []:
+            upstream, _, topic = entry.partition('/')
+            self.federate(upstream, topic)
+
+        self.stats.serving = time.monotonic() - STARTED
+        self.logger.info('Serving after {:.3f} seconds'.format(self.stats.serving))
         self.ioloop.start()
 
 # Main execution
 
 if __name__ == '__main__':
-    tornado.options.define('debug'  , default=False, help='Enable debugging mode')
-    tornado.options.define('address', default=MessageQueue.DEFAULT_ADDRESS, help='Address to listen on.')
-    tornado.options.define('port'   , default=MessageQueue.DEFAULT_PORT   , help='Port to listen on.')
+    tornado.options.define('debug'     , default=False, help='Enable debugging mode')
+    tornado.options.define('address'   , default=MessageQueue.DEFAULT_ADDRESS   , help='Address to listen on.')
+    tornado.options.define('port'      , default=MessageQueue.DEFAULT_PORT      , help='Port to listen on.')
+    tornado.options.define('max_timers', default=MessageQueue.DEFAULT_MAX_TIMERS, help='Maximum number of pending timers (scheduled messages and leases).')
+    tornado.options.define('broker_id' , default='', help='Name of this broker in federation paths (default is host:port).')
+    tornado.options.define('federate'  , default=[], multiple=True, help='Topics to mirror from upstream brokers (host:port/topic,...).')
+    tornado.options.define('compact'   , default=[], multiple=True, help='Topics keeping only the latest message per key (topic,...).')
+    tornado.options.define('dedup_size', default=MessageQueue.DEFAULT_DEDUP_SIZE, help='Message ids remembered to ignore repeated publishes (0 disables).')
+    tornado.options.define('dedup_age' , default=MessageQueue.DEFAULT_DEDUP_AGE , help='Seconds message ids are remembered (0 is unlimited).')
+    tornado.options.define('data_dir'          , default='', help='Directory of journal and snapshots (empty for no persistence).')
+    tornado.options.define('snapshot_interval' , default=MessageQueue.DEFAULT_SNAPSHOT_INTERVAL, help='Seconds between snapshots.')
+    tornado.options.define('snapshot_bytes'    , default=MessageQueue.DEFAULT_SNAPSHOT_BYTES   , help='Journal bytes that force a snapshot (bounds replay at startup).')
+    tornado.options.define('shm_socket'        , default=MessageQueue.DEFAULT_SHM_SOCKET, help='Unix socket local clients set up shared memory on ({port} is replaced, empty disables).')
+    tornado.options.define('shm_ring_size'     , default=MessageQueue.DEFAULT_SHM_RING_SIZE, help='Bytes per direction of a shared memory session.')
+    tornado.options.define('spool_dir'         , default='', help='Directory of message bodies kept on disk (default is the temporary directory).')
+    tornado.options.define('spool_size'        , default=MessageQueue.DEFAULT_SPOOL_SIZE, help='Bodies at least this large are kept on disk (0 keeps all in memory).')
+    tornado.options.define('max_message_size'  , default=MessageQueue.DEFAULT_MAX_MESSAGE_SIZE, help='Largest message body accepted (bytes).')
+    tornado.options.define('queue_ttl'         , default=0.0, help='Default seconds a message may wait in a queue (0 is unlimited).')
+    tornado.options.define('queue_max_length'  , default=0  , help='Default maximum messages per queue (0 is unlimited).')
+    tornado.options.define('queue_max_bytes'   , default=0  , help='Default maximum bytes per queue (0 is unlimited).')
+    tornado.options.define('queue_overflow'    , default='drop-oldest', help='Default overflow policy (drop-oldest, drop-newest, reject).')
+    tornado.options.define('queue_idle_timeout', default=MessageQueue.DEFAULT_IDLE, help='Seconds before an unused queue is removed (0 is never).')
     tornado.options.parse_command_line()
 
     signal.signal(signal.SIGTERM, lambda s, e: sys.exit(0))
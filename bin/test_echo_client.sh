@@ -21,7 +21,7 @@ find_port() {
 
 cleanup() {
     STATUS=${1:-$FAILURES}
-    kill $SERVERPID
+    kill $SERVERPID $CLUSTERPID
     rm -fr $WORKSPACE
     exit $STATUS
 }
@@ -44,9 +44,42 @@ PORT=$(find_port)
 ./bin/mq_server.py --port=$PORT > /dev/null 2>&1 &
 SERVERPID=$!
 
-valgrind --leak-check=full bin/$FUNCTIONAL localhost $PORT &> $WORKSPACE/test
+valgrind --leak-check=full bin/$FUNCTIONAL localhost $PORT tcp &> $WORKSPACE/test
 if [ $? -ne 0 ] || [ $(awk '/ERROR SUMMARY:/ {print $4}' $WORKSPACE/test) -ne 0 ]; then
     error "Failure"
 else
     echo "Success"
 fi
+
+printf "%-40s  ... " "Testing $FUNCTIONAL (shm)"
+
+valgrind --leak-check=full bin/$FUNCTIONAL localhost $PORT shm &> $WORKSPACE/test
+if [ $? -ne 0 ] || [ $(awk '/ERROR SUMMARY:/ {print $4}' $WORKSPACE/test) -ne 0 ]; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "%-40s  ... " "Testing $FUNCTIONAL (cluster)"
+
+CLUSTERPORT=$((PORT + 1))
+./bin/mq_server.py --port=$CLUSTERPORT > /dev/null 2>&1 &
+CLUSTERPID=$!
+sleep 1
+
+valgrind --leak-check=full bin/$FUNCTIONAL localhost:$PORT,localhost:$CLUSTERPORT &> $WORKSPACE/test
+if [ $? -ne 0 ] || [ $(awk '/ERROR SUMMARY:/ {print $4}' $WORKSPACE/test) -ne 0 ]; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+printf "%-40s  ... " "Testing $FUNCTIONAL (io_uring)"
+
+# Valgrind does not see the kernel fill buffers through io_uring
+bin/$FUNCTIONAL localhost $PORT tcp uring &> $WORKSPACE/test
+if [ $? -ne 0 ]; then
+    error "Failure"
+else
+    echo "Success"
+fi
@@ -1,5 +1,16 @@
 #!/usr/bin/env python3
 
+import array
+import mmap
+import os
+import select
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
 import unittest
 import requests
 
@@ -51,6 +62,523 @@ class ServerTestCase(unittest.TestCase):
 
         self.test_00_publish_without_subscribers()
 
+    def test_07_stats(self):
+        r = requests.get(self.URL + '/stats')
+        self.assertEqual(r.status_code, 200)
+
+        stats = r.json()
+        self.assertEqual(stats['queues']['_queue']['depth'], 0)
+        self.assertEqual(stats['queues']['_queue']['bytes'], 0)
+        self.assertGreaterEqual(stats['queues']['_queue']['dequeued'], 2)
+        self.assertGreaterEqual(stats['topics']['_topic']['fanout'], 2)
+        self.assertIn('lag', stats['loop'])
+
+    def test_08_metrics(self):
+        r = requests.get(self.URL + '/metrics')
+        self.assertEqual(r.status_code, 200)
+        self.assertIn('mq_queue_depth{queue="_queue"} 0', r.text)
+        self.assertIn('mq_topic_published_total{topic="_topic"}', r.text)
+
+    def test_09_priority(self):
+        r = requests.put(self.URL + '/subscription/_queue/_priority')
+        self.assertEqual(r.status_code, 200)
+
+        for priority in (0, 7, 3):
+            r = requests.put(self.URL + '/topic/_priority', data=str(priority), headers={'X-Priority': str(priority)})
+            self.assertEqual(r.status_code, 200)
+
+        for priority in (7, 3, 0):
+            r = requests.get(self.URL + '/queue/_queue')
+            self.assertEqual(r.status_code, 200)
+            self.assertEqual(r.text, str(priority))
+
+        r = requests.delete(self.URL + '/subscription/_queue/_priority')
+        self.assertEqual(r.status_code, 200)
+
+    def test_10_delayed(self):
+        r = requests.put(self.URL + '/subscription/_queue/_delayed')
+        self.assertEqual(r.status_code, 200)
+
+        r = requests.put(self.URL + '/topic/_delayed?delay=1.5', data='later')
+        self.assertEqual(r.status_code, 202)
+        r = requests.put(self.URL + '/topic/_delayed?at={}'.format(time.time() + 0.5), data='sooner')
+        self.assertEqual(r.status_code, 202)
+
+        started = time.time()
+        for body in ('sooner', 'later'):
+            r = requests.get(self.URL + '/queue/_queue')
+            self.assertEqual(r.status_code, 200)
+            self.assertEqual(r.text, body)
+        self.assertGreaterEqual(time.time() - started, 1.4)
+
+        r = requests.delete(self.URL + '/subscription/_queue/_delayed')
+        self.assertEqual(r.status_code, 200)
+
+    def test_11_ttl(self):
+        r = requests.put(self.URL + '/subscription/_queue/_ttl')
+        self.assertEqual(r.status_code, 200)
+
+        r = requests.put(self.URL + '/topic/_ttl?ttl=0.5', data='expired')
+        self.assertEqual(r.status_code, 200)
+        r = requests.put(self.URL + '/topic/_ttl', data='kept')
+        self.assertEqual(r.status_code, 200)
+
+        time.sleep(1)
+        r = requests.get(self.URL + '/queue/_queue')
+        self.assertEqual(r.text, 'kept')
+
+        r = requests.get(self.URL + '/stats')
+        self.assertGreaterEqual(r.json()['queues']['_queue']['expired'], 1)
+
+    def test_12_overflow(self):
+        r = requests.put(self.URL + '/queue/_queue?max_length=2&overflow=drop-oldest')
+        self.assertEqual(r.status_code, 200)
+
+        for body in ('1', '2', '3'):
+            r = requests.put(self.URL + '/topic/_ttl', data=body)
+            self.assertEqual(r.status_code, 200)
+
+        for body in ('2', '3'):
+            r = requests.get(self.URL + '/queue/_queue')
+            self.assertEqual(r.text, body)
+
+        r = requests.put(self.URL + '/queue/_queue?max_length=1&overflow=reject')
+        self.assertEqual(r.status_code, 200)
+
+        r = requests.put(self.URL + '/topic/_ttl', data='1')
+        self.assertEqual(r.status_code, 200)
+        r = requests.put(self.URL + '/topic/_ttl', data='2')
+        self.assertEqual(r.status_code, 503)
+
+        r = requests.get(self.URL + '/queue/_queue')
+        self.assertEqual(r.text, '1')
+
+        # A message larger than the byte limit is refused without evicting
+        r = requests.put(self.URL + '/queue/_queue?max_length=0&max_bytes=4&overflow=drop-oldest')
+        self.assertEqual(r.status_code, 200)
+        r = requests.put(self.URL + '/topic/_ttl', data='12')
+        self.assertEqual(r.status_code, 200)
+        r = requests.put(self.URL + '/topic/_ttl', data='123456')
+        self.assertEqual(r.status_code, 413)
+        r = requests.get(self.URL + '/queue/_queue', timeout=5)
+        self.assertEqual(r.text, '12')
+
+        r = requests.put(self.URL + '/queue/_queue?max_length=0&max_bytes=0&overflow=drop-oldest')
+        self.assertEqual(r.status_code, 200)
+        r = requests.delete(self.URL + '/subscription/_queue/_ttl')
+        self.assertEqual(r.status_code, 200)
+
+    def test_13_lease(self):
+        r = requests.put(self.URL + '/subscription/_queue/_lease')
+        self.assertEqual(r.status_code, 200)
+
+        for body in ('a', 'b'):
+            r = requests.put(self.URL + '/topic/_lease', data=body)
+            self.assertEqual(r.status_code, 200)
+
+        r = requests.get(self.URL + '/queue/_queue?lease=0.5&prefetch=2')
+        self.assertEqual(r.status_code, 200)
+        self.assertEqual(r.headers['Content-Type'], 'application/x-mq-frames')
+
+        header, rest = r.content.split(b'\r\n', 1)
+        lease, length = header.split()[:2]
+        self.assertEqual(rest[:int(length)], b'a')
+
+        r = requests.put(self.URL + '/ack/_queue', data=lease)
+        self.assertEqual(r.text.rstrip(), 'Acknowledged 1 messages in queue (_queue)')
+
+        time.sleep(1)
+        r = requests.get(self.URL + '/queue/_queue')
+        self.assertEqual(r.text, 'b')
+
+        r = requests.get(self.URL + '/stats')
+        self.assertGreaterEqual(r.json()['queues']['_queue']['redelivered'], 1)
+
+        r = requests.delete(self.URL + '/subscription/_queue/_lease')
+        self.assertEqual(r.status_code, 200)
+
+    def test_14_group(self):
+        r = requests.put(self.URL + '/subscription/_group/_jobs')
+        self.assertEqual(r.status_code, 200)
+
+        # Two requests of member a are pending before b's: members take turns
+        received = {}
+        def consume(member):
+            r = requests.get(self.URL + '/queue/_group?member=' + member, timeout=5)
+            received.setdefault(member, []).append(r.text)
+
+        threads = []
+        for member in ('a', 'a', 'b'):
+            threads.append(threading.Thread(target=consume, args=(member,)))
+            threads[-1].start()
+            time.sleep(0.2)
+
+        for body in ('1', '2'):
+            r = requests.put(self.URL + '/topic/_jobs', data=body)
+            self.assertEqual(r.status_code, 200)
+
+        time.sleep(0.5)
+        self.assertEqual(received, {'a': ['1'], 'b': ['2']})
+
+        r = requests.delete(self.URL + '/queue/_group?member=a')
+        self.assertEqual(r.text.rstrip(), 'Member (a) left queue (_group) releasing 1 requests')
+        for thread in threads:
+            thread.join()
+        self.assertEqual(received['a'][1], 'There are no messages for queue: _group\n')
+
+        # Leaving with nothing pending releases one retrieval still on its way
+        r = requests.delete(self.URL + '/queue/_group?member=c')
+        self.assertEqual(r.text.rstrip(), 'Member (c) left queue (_group) releasing 0 requests')
+        r = requests.get(self.URL + '/queue/_group?member=c', timeout=2)
+        self.assertEqual(r.status_code, 404)
+        with self.assertRaises(requests.exceptions.ReadTimeout):
+            requests.get(self.URL + '/queue/_group?member=c', timeout=2)
+
+        r = requests.delete(self.URL + '/subscription/_group/_jobs')
+        self.assertEqual(r.status_code, 200)
+
+    def test_15_federation(self):
+        # Mirror _fed in both directions between this broker and another one
+        port     = int(self.URL.rsplit(':', 1)[1]) + 1
+        upstream = self.URL.rsplit('/', 1)[1]
+        remote   = 'http://localhost:{}'.format(port)
+        server   = subprocess.Popen(
+            [sys.executable, os.path.join(os.path.dirname(__file__), 'mq_server.py'), '--port={}'.format(port)],
+            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL,
+        )
+        try:
+            time.sleep(1)
+            r = requests.put(remote + '/federation/{}/_fed'.format(upstream))
+            self.assertEqual(r.status_code, 200)
+            r = requests.put(self.URL + '/federation/localhost:{}/_fed'.format(port))
+            self.assertEqual(r.status_code, 200)
+
+            for url, queue in ((self.URL, '_queue'), (remote, '_mirror')):
+                r = requests.put(url + '/subscription/{}/_fed'.format(queue))
+                self.assertEqual(r.status_code, 200)
+            time.sleep(1)
+
+            r = requests.put(self.URL + '/topic/_fed', data=self.BODY)
+            self.assertEqual(r.status_code, 200)
+
+            r = requests.get(remote + '/queue/_mirror', timeout=5)
+            self.assertEqual(r.text, self.BODY)
+            r = requests.get(self.URL + '/queue/_queue', timeout=5)
+            self.assertEqual(r.text, self.BODY)
+
+            # Nothing comes back around the loop
+            with self.assertRaises(requests.exceptions.ReadTimeout):
+                requests.get(self.URL + '/queue/_queue', timeout=2)
+
+            stats = requests.get(remote + '/stats').json()
+            self.assertEqual(stats['federation'][upstream]['forwarded'], 1)
+            self.assertTrue(stats['federation'][upstream]['connected'])
+            self.assertGreaterEqual(stats['looped'], 1)
+
+            r = requests.delete(self.URL + '/federation/localhost:{}/_fed'.format(port))
+            self.assertEqual(r.status_code, 200)
+            r = requests.delete(self.URL + '/subscription/_queue/_fed')
+            self.assertEqual(r.status_code, 200)
+        finally:
+            server.terminate()
+            server.wait()
+
+    def test_16_dedup(self):
+        r = requests.put(self.URL + '/subscription/_queue/_dedup')
+        self.assertEqual(r.status_code, 200)
+
+        headers    = {'X-Message-Id': '_dedup-{}'.format(time.time())}
+        duplicates = requests.get(self.URL + '/stats').json()['duplicates']
+        for _ in range(3):
+            r = requests.put(self.URL + '/topic/_dedup', data=self.BODY, headers=headers)
+            self.assertEqual(r.status_code, 200)
+
+        r = requests.get(self.URL + '/queue/_queue', timeout=5)
+        self.assertEqual(r.text, self.BODY)
+        with self.assertRaises(requests.exceptions.ReadTimeout):
+            requests.get(self.URL + '/queue/_queue', timeout=2)
+
+        stats = requests.get(self.URL + '/stats').json()
+        self.assertEqual(stats['duplicates'], duplicates + 2)
+
+        r = requests.delete(self.URL + '/subscription/_queue/_dedup')
+        self.assertEqual(r.status_code, 200)
+
+    def open_stream(self, query=''):
+        host, port = self.URL.rsplit('/', 1)[1].split(':')
+        connection = socket.create_connection((host, int(port)), timeout=5)
+        connection.sendall('GET /stream/_queue{} HTTP/1.0\r\n\r\n'.format(query).encode())
+        stream  = connection.makefile('rb')
+        status  = stream.readline().split()[1]
+        headers = {}
+        for line in iter(stream.readline, b'\r\n'):
+            name, _, value = line.decode().partition(':')
+            headers[name.strip().lower()] = value.strip()
+        self.assertEqual(status, b'200')
+        return connection, stream, int(headers['x-sequence'])
+
+    def read_frame(self, stream):
+        sequence, length, priority, topic = stream.readline().split()
+        return int(sequence), stream.read(int(length)).decode()
+
+    def test_17_stream(self):
+        r = requests.put(self.URL + '/subscription/_queue/_stream')
+        self.assertEqual(r.status_code, 200)
+
+        connection, stream, sequence = self.open_stream()
+        for body in ('1', '2'):
+            r = requests.put(self.URL + '/topic/_stream', data=body)
+            self.assertEqual(r.status_code, 200)
+        self.assertEqual(self.read_frame(stream), (sequence + 1, '1'))
+        self.assertEqual(self.read_frame(stream), (sequence + 2, '2'))
+        connection.close()
+
+        # Resuming after the first frame resends the second one
+        connection, stream, _ = self.open_stream('?resume={}'.format(sequence + 1))
+        self.assertEqual(self.read_frame(stream), (sequence + 2, '2'))
+        connection.close()
+
+        r = requests.delete(self.URL + '/subscription/_queue/_stream')
+        self.assertEqual(r.status_code, 200)
+
+    def test_18_restart(self):
+        # Contents and subscriptions survive a crash (from snapshot plus journal)
+        port      = int(self.URL.rsplit(':', 1)[1]) + 2
+        remote    = 'http://localhost:{}'.format(port)
+        directory = tempfile.mkdtemp()
+        command   = [sys.executable, os.path.join(os.path.dirname(__file__), 'mq_server.py'),
+                     '--port={}'.format(port), '--data_dir={}'.format(directory), '--snapshot_interval=1']
+
+        server = subprocess.Popen(command, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            time.sleep(1)
+            r = requests.put(remote + '/subscription/_durable/_restart')
+            self.assertEqual(r.status_code, 200)
+            for body in ('1', '2', '3'):
+                r = requests.put(remote + '/topic/_restart', data=body)
+                self.assertEqual(r.status_code, 200)
+            time.sleep(1.5)                             # Snapshot
+            r = requests.get(remote + '/queue/_durable')
+            self.assertEqual(r.text, '1')
+            r = requests.put(remote + '/topic/_restart', data='4')
+            self.assertEqual(r.status_code, 200)
+            time.sleep(0.5)                             # Journal flush
+        finally:
+            server.kill()
+            server.wait()
+
+        server = subprocess.Popen(command, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            time.sleep(1)
+            for body in ('2', '3', '4'):
+                r = requests.get(remote + '/queue/_durable', timeout=5)
+                self.assertEqual(r.text, body)
+            r = requests.put(remote + '/topic/_restart', data='5')
+            self.assertEqual(r.status_code, 200)
+
+            stats = requests.get(remote + '/stats').json()
+            self.assertEqual(stats['restore']['messages'], 3)
+            self.assertGreater(stats['restore']['snapshot_records'], 0)
+        finally:
+            server.terminate()
+            server.wait()
+
+    def test_19_shm(self):
+        # Records on the shared memory rings are applied in order and answered
+        from mq_server import ShmRing, ShmSession
+
+        port       = self.URL.rsplit(':', 1)[1]
+        connection = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        connection.settimeout(5)
+        connection.connect('/tmp/mq.{}.sock'.format(port))
+        connection.sendall(b'HELLO\n')
+
+        fds = array.array('i')
+        hello, control, _, _ = connection.recvmsg(64, socket.CMSG_SPACE(3 * fds.itemsize))
+        for level, kind, data in control:
+            if level == socket.SOL_SOCKET and kind == socket.SCM_RIGHTS:
+                fds.frombytes(data[:len(data) - len(data) % fds.itemsize])
+        self.assertTrue(hello.startswith(b'OK '))
+        self.assertEqual(len(fds), 3)
+
+        memfd, wakeup, notify = fds
+        capacity = int(hello.split()[1])
+        memory   = mmap.mmap(memfd, 2 * (ShmRing.DATA + capacity))
+        outgoing = ShmRing(memory, 0, capacity)
+        incoming = ShmRing(memory, ShmRing.DATA + capacity, capacity)
+
+        queue, topic = b'_shm_queue', b'_shm'
+        outgoing.put(ShmSession.SUBSCRIBE, ShmSession.QUEUE_HEADER.pack(len(queue), len(topic)), queue, topic)
+        outgoing.put(ShmSession.PUBLISH, ShmSession.PUBLISH_HEADER.pack(7, len(topic), 0, 0, len(self.BODY), 0),
+                     topic, self.BODY.encode())
+        outgoing.put(ShmSession.CONSUME, ShmSession.QUEUE_HEADER.pack(len(queue), 0), queue)
+        os.write(wakeup, struct.pack('Q', 1))
+
+        records = []
+        while len(records) < 2:
+            self.assertTrue(select.select([notify], [], [], 5)[0])
+            os.read(notify, 8)
+            incoming.clear()
+            records.extend(incoming.records())
+
+        (confirm, payload), (deliver, message) = records
+        self.assertEqual(confirm, ShmSession.CONFIRM)
+        self.assertEqual(ShmSession.CONFIRM_HEADER.unpack_from(payload), (7, 200))
+        self.assertEqual(deliver, ShmSession.DELIVER)
+        self.assertEqual(ShmSession.DELIVER_HEADER.unpack_from(message), (len(topic), len(self.BODY), 0, 0))
+        self.assertEqual(bytes(message[ShmSession.DELIVER_HEADER.size:]).rstrip(b'\0'), topic + self.BODY.encode())
+
+        connection.close()
+        memory.close()
+        for fd in fds:
+            os.close(fd)
+
+        r = requests.delete(self.URL + '/subscription/_shm_queue/_shm')
+        self.assertEqual(r.status_code, 200)
+
+    def test_20_spool(self):
+        # Large bodies are kept on disk and come back whole however retrieved
+        body = os.urandom(3 << 20)
+        r = requests.put(self.URL + '/subscription/_queue/_spool')
+        self.assertEqual(r.status_code, 200)
+
+        for _ in range(2):
+            r = requests.put(self.URL + '/topic/_spool', data=body)
+            self.assertEqual(r.status_code, 200)
+
+        r = requests.get(self.URL + '/queue/_queue', timeout=5)
+        self.assertEqual(r.status_code, 200)
+        self.assertEqual(r.content, body)
+
+        r = requests.get(self.URL + '/queue/_queue?lease=5&prefetch=2', timeout=5)
+        self.assertEqual(r.status_code, 200)
+        header, _, rest = r.content.partition(b'\r\n')
+        lease, length = header.decode().split()[:2]
+        self.assertEqual(int(length), len(body))
+        self.assertEqual(rest, body)
+
+        r = requests.put(self.URL + '/ack/_queue', data=lease)
+        self.assertEqual(r.status_code, 200)
+        r = requests.delete(self.URL + '/subscription/_queue/_spool')
+        self.assertEqual(r.status_code, 200)
+
+    def test_21_compaction(self):
+        # Newer messages replace queued ones with their key (in their place)
+        r = requests.put(self.URL + '/compaction/_compact')
+        self.assertEqual(r.status_code, 200)
+        r = requests.put(self.URL + '/subscription/_compacted/_compact')
+        self.assertEqual(r.status_code, 200)
+
+        for key, body in (('a', 'a1'), ('b', 'b1'), ('a', 'a2'), (None, 'x'), ('a', 'a3'), ('b', 'b2')):
+            r = requests.put(self.URL + '/topic/_compact', params={'key': key} if key else None, data=body)
+            self.assertEqual(r.status_code, 200)
+
+        stats = requests.get(self.URL + '/stats').json()['queues']['_compacted']
+        self.assertEqual(stats['depth'], 3)
+        self.assertEqual(stats['compacted'], 3)
+
+        for body in ('a3', 'b2', 'x'):
+            r = requests.get(self.URL + '/queue/_compacted', timeout=5)
+            self.assertEqual(r.text, body)
+
+        # Once retrieved, a key is queued anew
+        r = requests.put(self.URL + '/topic/_compact?key=a', data='a4')
+        self.assertEqual(r.status_code, 200)
+        r = requests.get(self.URL + '/queue/_compacted', timeout=5)
+        self.assertEqual(r.text, 'a4')
+
+        # A replacement with another priority moves to the back of that level
+        for key, body, priority in (('c', 'c1', 0), ('d', 'd1', 0), ('c', 'c2', 5), ('e', 'e1', 5)):
+            r = requests.put(self.URL + '/topic/_compact?key=' + key, data=body, headers={'X-Priority': str(priority)})
+            self.assertEqual(r.status_code, 200)
+        for body in ('c2', 'e1', 'd1'):
+            r = requests.get(self.URL + '/queue/_compacted', timeout=5)
+            self.assertEqual(r.text, body)
+
+        # Only the growth of a replacement counts towards the byte limit
+        r = requests.put(self.URL + '/queue/_compacted?max_bytes=6&overflow=reject')
+        self.assertEqual(r.status_code, 200)
+        for key, body, status in (('a', 'aa', 200), ('b', 'bb', 200), ('a', 'aaaa', 200), ('a', 'aaaaa', 503)):
+            r = requests.put(self.URL + '/topic/_compact?key=' + key, data=body)
+            self.assertEqual(r.status_code, status)
+        for body in ('aaaa', 'bb'):
+            r = requests.get(self.URL + '/queue/_compacted', timeout=5)
+            self.assertEqual(r.text, body)
+        r = requests.put(self.URL + '/queue/_compacted?max_bytes=0&overflow=drop-oldest')
+        self.assertEqual(r.status_code, 200)
+
+        r = requests.delete(self.URL + '/compaction/_compact')
+        self.assertEqual(r.status_code, 200)
+        r = requests.delete(self.URL + '/compaction/_compact')
+        self.assertEqual(r.status_code, 404)
+        r = requests.delete(self.URL + '/subscription/_compacted/_compact')
+        self.assertEqual(r.status_code, 200)
+
+    def test_22_compaction_restart(self):
+        # A replacement keeps its position when the journal is replayed
+        port      = int(self.URL.rsplit(':', 1)[1]) + 3
+        remote    = 'http://localhost:{}'.format(port)
+        directory = tempfile.mkdtemp()
+        command   = [sys.executable, os.path.join(os.path.dirname(__file__), 'mq_server.py'),
+                     '--port={}'.format(port), '--data_dir={}'.format(directory)]
+
+        server = subprocess.Popen(command, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            time.sleep(1)
+            r = requests.put(remote + '/compaction/_compact')
+            self.assertEqual(r.status_code, 200)
+            r = requests.put(remote + '/subscription/_compacted/_compact')
+            self.assertEqual(r.status_code, 200)
+            for key, body in (('a', 'a1'), ('b', 'b1'), ('a', 'a2')):
+                r = requests.put(remote + '/topic/_compact?key=' + key, data=body)
+                self.assertEqual(r.status_code, 200)
+            time.sleep(0.5)                             # Journal flush
+        finally:
+            server.kill()
+            server.wait()
+
+        server = subprocess.Popen(command, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            time.sleep(1)
+            for body in ('a2', 'b1'):
+                r = requests.get(remote + '/queue/_compacted', timeout=5)
+                self.assertEqual(r.text, body)
+        finally:
+            server.terminate()
+            server.wait()
+
+    def test_23_timer_limit(self):
+        # Leases take timers from the same limit as scheduled messages
+        port    = int(self.URL.rsplit(':', 1)[1]) + 4
+        remote  = 'http://localhost:{}'.format(port)
+        command = [sys.executable, os.path.join(os.path.dirname(__file__), 'mq_server.py'),
+                   '--port={}'.format(port), '--max_timers=2']
+
+        server = subprocess.Popen(command, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            time.sleep(1)
+            r = requests.put(remote + '/subscription/_limited/_timers')
+            self.assertEqual(r.status_code, 200)
+            for body in ('a', 'b', 'c'):
+                r = requests.put(remote + '/topic/_timers', data=body)
+                self.assertEqual(r.status_code, 200)
+
+            r = requests.get(remote + '/queue/_limited?lease=30&prefetch=3', timeout=5)
+            self.assertEqual(r.status_code, 200)
+            self.assertEqual(r.content.count(b'\r\n'), 2)
+
+            r = requests.get(remote + '/queue/_limited?lease=30', timeout=5)
+            self.assertEqual(r.status_code, 503)
+            r = requests.put(remote + '/topic/_timers?delay=1', data='d')
+            self.assertEqual(r.status_code, 503)
+
+            # The message that found no timer is still queued
+            r = requests.get(remote + '/queue/_limited', timeout=5)
+            self.assertEqual(r.text, 'c')
+        finally:
+            server.terminate()
+            server.wait()
+
 # Main execution
 
 if __name__ == '__main__':
@@ -0,0 +1,50 @@
+/* breaker.h: Reconnect policy (backoff with jitter and circuit breaking) */
+
+#ifndef BREAKER_H
+#define BREAKER_H
+
+#include "mq/thread.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Constants */
+
+#define BREAKER_BASE_DEFAULT    100     // Milliseconds before first retry
+#define BREAKER_MAX_DEFAULT     10000   // Milliseconds between retries at most
+
+/* States */
+
+#define BREAKER_CLOSED          0       // Connecting works, every thread may try
+#define BREAKER_OPEN            1       // Connecting failed, nobody tries until retry
+#define BREAKER_HALF_OPEN       2       // One thread probes, the others wait for it
+
+/* Structures */
+
+/* Shared by every thread connecting to one server */
+typedef struct Breaker Breaker;
+struct Breaker {
+    Mutex           lock;
+    Cond            changed;    // Broadcast when state changes (or on breaker_wake)
+    int             state;      // BREAKER_* state
+    unsigned        failures;   // Consecutive failed attempts
+    unsigned long   base;       // Milliseconds before first retry
+    unsigned long   max;        // Milliseconds between retries at most
+    unsigned long   delay;      // Milliseconds of last delay
+    struct timespec retry;      // When the circuit half-opens (CLOCK_MONOTONIC)
+    uint64_t        seed;       // State of jitter generator
+};
+
+/* Functions */
+
+void            breaker_init(Breaker *b, uint64_t seed);
+bool            breaker_wait(Breaker *b, const bool *cancel);
+unsigned        breaker_success(Breaker *b);
+unsigned long   breaker_failure(Breaker *b);
+void            breaker_wake(Breaker *b);
+int             breaker_state(Breaker *b, unsigned *failures, unsigned long *retry);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -3,40 +3,224 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
+#include "mq/breaker.h"
+#include "mq/dispatch.h"
 #include "mq/queue.h"
+#include "mq/ring.h"
+#include "mq/router.h"
+#include "mq/shm.h"
+#include "mq/uring.h"
 
 #include <netdb.h>
 #include <stdbool.h>
+#include <time.h>
+
+/* Constants */
+
+#define MQ_WINDOW_DEFAULT   32      // Requests in flight per pusher connection
+#define MQ_PUSHERS_MAX      16      // Maximum number of pusher connections
+#define MQ_LEASE_DEFAULT    30000   // Milliseconds before unacked messages are redelivered
+#define MQ_BROKERS_MAX      RING_NODES_MAX  // Maximum number of broker endpoints
+#define MQ_SPOOL_MIN        (1 << 20)   // Received bodies this large go to temporary files
+#define MQ_DRAIN_DEFAULT    5000    // Milliseconds mq_stop waits for queued requests to be sent
+#define MQ_SOCKETS          (MQ_PUSHERS_MAX + 2)    // Connections per server (pushers, sender, puller)
+
+/* Flags (mq_create_flags) */
+
+#define MQ_TRANSPORT_URING  0x1     // Send and receive through io_uring (built with URING=1)
+#define MQ_TRANSPORT_TCP    0x2     // Never use shared memory with servers on this host
+
+/* Health of a server (mq_health) */
+
+#define MQ_HEALTH_UP        BREAKER_CLOSED      // Reachable
+#define MQ_HEALTH_DOWN      BREAKER_OPEN        // Unreachable, waiting to retry
+#define MQ_HEALTH_PROBING   BREAKER_HALF_OPEN   // Trying to reach it again
 
 /* Structures */
 
+typedef struct MQLease MQLease;
+struct MQLease {
+    uint64_t        id;         // Lease id of received message
+    struct timespec deadline;   // When the server will redeliver it
+};
+
 typedef struct MessageQueue MessageQueue;
-struct MessageQueue {
-    char    name[NI_MAXHOST];	// Name of message queue
+
+typedef void (*MQCallback)(MessageQueue *mq, const char *topic, const char *body, void *ctx);
+
+typedef struct MQConfirm MQConfirm;
+struct MQConfirm {
+    uint64_t    ticket;		// Ticket returned by mq_publish_async
+    int         status;		// HTTP status from server (404 if topic had no subscribers,
+				// -1 if it was lost with a shared memory session
+				// or given up by mq_stop)
+};
+
+typedef void (*MQConfirmCallback)(MessageQueue *mq, const MQConfirm *confirms, size_t n, void *ctx);
+
+typedef bool (*MQChunkCallback)(const char *data, size_t n, void *ctx);
+
+typedef struct MQHealth MQHealth;
+struct MQHealth {
+    const char *host;		// Host of server
+    const char *port;		// Port of server
+    int         state;		// MQ_HEALTH_* state
+    unsigned    failures;	// Consecutive failed attempts to reach it
+    unsigned long retry;	// Milliseconds until it is tried again (when down)
+};
+
+typedef struct MQSubscription MQSubscription;
+struct MQSubscription {
+    char *      topic;		// Topic subscribed to
+    int         sources;	// Sources holding the subscription (MQ_SOURCE_* in client.c)
+    MQSubscription *next;
+};
+
+typedef struct MQHandler MQHandler;
+struct MQHandler {
+    MessageQueue *mq;		// Client the handler is registered with
+    char *      topic;		// Topic handled
+    MQCallback  callback;	// Called with each message of its topic
+    void *      ctx;		// Passed to callback
+    MQHandler * next;
+};
+
+typedef struct MQBroker MQBroker;
+
+typedef struct MQTopic MQTopic;
+struct MQTopic {
+    MessageQueue *mq;		// Client the topic was opened on
+    MQBroker *  broker;		// Server the topic is partitioned to
+    char *      topic;		// Name of topic
+    char *      prefix;		// Encoded request line and headers (up to the
+				// sequence number of the message id)
+    MQTopic *   next;
+};
+
+struct MQBroker {
+    MessageQueue *mq;		// Client this broker belongs to
     char    host[NI_MAXHOST];	// Host of server
     char    port[NI_MAXSERV];	// Port of server
 
     Queue*  outgoing;		// Requests to be sent to server
+    Queue*  bulk;		// Publishes with bodies in files (see mq_publish_fd)
+    Request *ack;		// Queued acknowledgement that can still grow
+    size_t  nleases;		// Leases held from this server (at most prefetch)
+
+    Shm *   shm;		// Shared memory session (NULL if server is reached over TCP)
+    Breaker breaker;		// When the threads below may (re)connect
+    int     sockets[MQ_SOCKETS];	// Connections of the threads below (-1 if none),
+				// shut down by mq_stop to end blocked reads
+    size_t  slots;		// Socket slots taken by pushers so far
+
+    Thread pushers[MQ_PUSHERS_MAX];
+    Thread sender;		// Sends bulk publishes on a connection of its own
+    Thread puller;		// Runs unless shared memory delivers messages
+    Thread reader;		// Runs with shared memory session
+};
+
+struct MessageQueue {
+    char    name[NI_MAXHOST];	// Name of message queue
+    char    group[NI_MAXHOST];	// Consumer group sharing one queue (empty if none)
+    char    member[NI_MAXHOST + 24];	// Member id in group (name and nonce, so
+				// clients sharing a name stay apart)
+
+    MQBroker brokers[MQ_BROKERS_MAX];	// Servers topics are partitioned across
+    size_t  nbrokers;		// Number of servers
+    Ring    ring;		// Consistent hash of topics to servers
+
     Queue*  incoming;		// Requests received from server
-    bool    shutdown;		// Whether or not to shutdown
+    bool    shutdown;		// Whether or not to shutdown (read atomically)
+    bool    aborted;		// Whether mq_stop gave up draining (read atomically)
+    unsigned long drain;	// Milliseconds mq_stop waits for queued requests
+    size_t  nsending;		// Pushers and senders still running
+    size_t  nreading;		// Shared memory readers still running
+    Cond    drained;		// Signalled when one of them exits
+
+    size_t  window;		// Maximum requests in flight per pusher
+    size_t  npushers;		// Number of pusher connections
+
+    size_t  prefetch;		// Maximum unacknowledged messages per server (0 disables acks)
+    unsigned long lease;	// Milliseconds before unacked messages are redelivered
+    MQLease *leases;		// Leases received but not yet acknowledged
+    size_t  nleases;		// Number of leases held (from all servers)
+    Cond    acked;		// Signalled when a lease is acknowledged
+
+    Dispatcher *dispatcher;	// Runs callbacks (NULL until mq_on_message)
+    size_t  ndispatchers;	// Number of callback threads (0 for one per CPU)
+    MQHandler *handlers;	// Registered callbacks
+    Router *router;		// Shares messages among local consumers (NULL until
+				// mq_consumer_create)
+    MQTopic *topics;		// Opened topic handles (freed by mq_delete)
+    MQSubscription *subscriptions;	// Topics subscribed to and by what
+    Mutex   subscribing;	// Orders subscription changes sent to servers
+
+    MQConfirmCallback confirm;	// Called with batches of publish confirms (NULL if none)
+    void *  confirm_ctx;	// Passed to confirm
+    uint64_t tickets;		// Last ticket handed out by mq_publish_async
+    uint64_t confirmed;		// Every ticket up to this one has been confirmed
+    uint64_t *early;		// Min-heap of tickets confirmed above confirmed
+    size_t  nearly;		// Number of tickets in early
+    size_t  early_capacity;	// Allocated size of early
+    Cond    flushed;		// Signalled when tickets are confirmed
+
+    uint64_t nonce;		// Random prefix of message ids (per client instance)
+    uint64_t published;		// Sequence number of last message id
+
+    int     flags;		// MQ_* flags given to mq_create_flags
+    Uring * uring;		// Shared by every connection (NULL for blocking sockets)
 
     /* TODO: Add any necessary thread and synchronization primitives */
     Mutex lock;
-    Thread pusher;
-    Thread puller;
 };
 
 MessageQueue *	mq_create(const char *name, const char *host, const char *port);
+MessageQueue *	mq_create_flags(const char *name, const char *host, const char *port, int flags);
 void		mq_delete(MessageQueue *mq);
 
 void		mq_publish(MessageQueue *mq, const char *topic, const char *body);
+void		mq_publish_prio(MessageQueue *mq, const char *topic, const char *body, int priority);
+void		mq_publish_ttl(MessageQueue *mq, const char *topic, const char *body, unsigned long ttl);
+void		mq_publish_at(MessageQueue *mq, const char *topic, const char *body, const struct timespec *when);
+void		mq_publish_after(MessageQueue *mq, const char *topic, const char *body, unsigned long delay);
+void		mq_publish_key(MessageQueue *mq, const char *topic, const char *key, const char *body);
+uint64_t	mq_publish_async(MessageQueue *mq, const char *topic, const char *body);
+MQTopic *	mq_topic_open(MessageQueue *mq, const char *topic);
+void		mq_publish_to(MQTopic *t, const char *body);
+uint64_t	mq_publish_fd(MessageQueue *mq, const char *topic, int fd, size_t length);
+void		mq_set_confirm(MessageQueue *mq, MQConfirmCallback callback, void *ctx);
+void		mq_flush(MessageQueue *mq);
 char *		mq_retrieve(MessageQueue *mq);
+char *		mq_retrieve_id(MessageQueue *mq, uint64_t *id);
+ssize_t		mq_retrieve_fd(MessageQueue *mq, int fd, uint64_t *id);
+ssize_t		mq_retrieve_chunks(MessageQueue *mq, MQChunkCallback callback, void *ctx, uint64_t *id);
+
+void		mq_set_prefetch(MessageQueue *mq, size_t prefetch, unsigned long lease);
+void		mq_ack(MessageQueue *mq, uint64_t id);
+void		mq_ack_batch(MessageQueue *mq, const uint64_t *ids, size_t n);
+
+void		mq_set_group(MessageQueue *mq, const char *group);
+
+void		mq_on_message(MessageQueue *mq, const char *topic, MQCallback callback, void *ctx);
+void		mq_set_dispatchers(MessageQueue *mq, size_t dispatchers);
+
+Consumer *	mq_consumer_create(MessageQueue *mq, const char *topic);
+void		mq_consumer_delete(Consumer *c);
+Delivery *	mq_consume(Consumer *c);
+void		mq_release(Delivery *d);
 
 void		mq_subscribe(MessageQueue *mq, const char *topic);
 void		mq_unsubscribe(MessageQueue *mq, const char *topic);
 
+void		mq_set_window(MessageQueue *mq, size_t window);
+void		mq_set_pushers(MessageQueue *mq, size_t pushers);
+void		mq_set_backoff(MessageQueue *mq, unsigned long base, unsigned long max);
+
+size_t		mq_health(MessageQueue *mq, MQHealth *health, size_t n);
+
 void		mq_start(MessageQueue *mq);
 void		mq_stop(MessageQueue *mq);
+void		mq_set_drain(MessageQueue *mq, unsigned long timeout);
 
 bool		mq_shutdown(MessageQueue *mq);
 
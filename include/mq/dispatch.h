@@ -0,0 +1,78 @@
+/* dispatch.h: Work-stealing dispatch pool with per-key ordering */
+
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include "mq/request.h"
+#include "mq/thread.h"
+
+#include <stdbool.h>
+
+/* Constants */
+
+#define DISPATCH_WORKERS_MAX    64      // Maximum number of worker threads
+#define DISPATCH_BUCKETS        64      // Strand hash table size (power of two)
+
+/* Structures */
+
+typedef void (*DispatchHandler)(Request *r, void *ctx);
+
+/* Requests of one key, handled in order by at most one worker at a time */
+typedef struct Strand Strand;
+struct Strand {
+    char *          key;        // Key (topic) handled by strand
+    DispatchHandler handler;    // Called with each Request (which it owns)
+    void *          ctx;        // Passed to handler
+
+    Mutex           lock;       // Protects head, tail and scheduled
+    Request *       head;       // Requests waiting to be handled
+    Request *       tail;
+    bool            scheduled;  // Whether strand is in a deque or running
+
+    Strand *        next;       // Next strand in hash chain
+};
+
+/* Strands ready to run: the owner works at the bottom, thieves at the top */
+typedef struct Deque Deque;
+struct Deque {
+    Mutex           lock;
+    Strand **       items;      // Ring buffer of capacity entries
+    size_t          capacity;   // Power of two (at least number of strands)
+    size_t          top;        // Next to steal
+    size_t          bottom;     // Next free slot
+};
+
+typedef struct Dispatcher Dispatcher;
+
+typedef struct DispatchWorker DispatchWorker;
+struct DispatchWorker {
+    Dispatcher *    dispatcher;
+    Thread          thread;
+    Deque           deque;      // Strands this worker runs next
+};
+
+struct Dispatcher {
+    DispatchWorker  workers[DISPATCH_WORKERS_MAX];
+    size_t          nworkers;
+
+    Strand *        strands[DISPATCH_BUCKETS];      // Strands by key hash
+    size_t          nstrands;
+
+    Mutex           lock;       // Protects ready, next, stopping (and registration)
+    Cond            wake;       // Signalled when a strand becomes ready
+    size_t          ready;      // Strands waiting in deques
+    size_t          next;       // Deque for next submission from outside
+    bool            stopping;   // Exit once nothing is ready
+};
+
+/* Functions */
+
+Dispatcher *    dispatcher_create(size_t workers);
+void            dispatcher_delete(Dispatcher *d);
+
+bool            dispatcher_register(Dispatcher *d, const char *key, DispatchHandler handler, void *ctx);
+bool            dispatcher_submit(Dispatcher *d, const char *key, Request *r);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -3,24 +3,72 @@
 #ifndef LOGGING_H
 #define LOGGING_H
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <pthread.h>
 
+/* Levels */
+
+#define LOG_LEVEL_DEBUG     0
+#define LOG_LEVEL_INFO      1
+#define LOG_LEVEL_ERROR     2
+#define LOG_LEVEL_NONE      3
+
+/* Messages below LOG_LEVEL are compiled out entirely */
+
+#ifndef LOG_LEVEL
 #ifndef NDEBUG
+#define LOG_LEVEL           LOG_LEVEL_DEBUG
+#else
+#define LOG_LEVEL           LOG_LEVEL_INFO
+#endif
+#endif
+
+/* Rate limiting (per call site): at most LOG_LIMIT_BURST messages per second */
+
+#define LOG_LIMIT_BURST     10
+
+typedef struct LogLimit LogLimit;
+struct LogLimit {
+    uint64_t    window;     // Second of current window
+    uint32_t    count;      // Messages logged in current window
+    uint32_t    suppressed; // Messages dropped since last logged message
+};
+
+/* Functions */
+
+void    log_write(int level, LogLimit *limit, const char *file, int line, const char *func, const char *fmt, ...)
+        __attribute__((format(printf, 6, 7)));
+void    log_flush();
+
+/* Macros */
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
 #define debug(M, ...) \
-    fprintf(stderr, "[%09lu] DEBUG %s:%d:%s: " M "\n", pthread_self(), __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+    log_write(LOG_LEVEL_DEBUG, NULL, __FILE__, __LINE__, __func__, M, ##__VA_ARGS__)
 #else
 #define debug(M, ...)
 #endif
 
+#if LOG_LEVEL <= LOG_LEVEL_INFO
 #define info(M, ...) \
-    fprintf(stderr, "[%09lu] INFO  " M "\n", pthread_self(), ##__VA_ARGS__)
+    log_write(LOG_LEVEL_INFO, NULL, __FILE__, __LINE__, __func__, M, ##__VA_ARGS__)
+#else
+#define info(M, ...)
+#endif
 
+#if LOG_LEVEL <= LOG_LEVEL_ERROR
 #define error(M, ...) \
-    fprintf(stderr, "[%09lu] ERROR " M "\n", pthread_self(), ##__VA_ARGS__)
+    do { \
+        static LogLimit _limit; \
+        log_write(LOG_LEVEL_ERROR, &_limit, __FILE__, __LINE__, __func__, M, ##__VA_ARGS__); \
+    } while (0)
+#else
+#define error(M, ...)
+#endif
 
 #endif
 
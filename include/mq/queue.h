@@ -6,13 +6,23 @@
 #include "mq/request.h"
 #include "mq/thread.h"
 
+#include <stdbool.h>
+#include <stdint.h>
+
 /* Structures */
 
-typedef struct Queue Queue;
-struct Queue {
+typedef struct QueueLevel QueueLevel;
+struct QueueLevel {
     Request *head;
     Request *tail;
-    size_t   size;
+};
+
+typedef struct Queue Queue;
+struct Queue {
+    QueueLevel levels[REQUEST_PRIORITIES];  // One FIFO per priority
+    uint32_t   nonempty;                    // Bitmap of non-empty levels
+    size_t     size;
+    bool       closed;                      // Pops return NULL once empty
 
     /* TODO: Add any necessary thread and synchronization primitives */
     Mutex lock;
@@ -23,9 +33,11 @@ struct Queue {
 
 Queue *	    queue_create();
 void        queue_delete(Queue *q);
+void        queue_close(Queue *q);
 
 void	    queue_push(Queue *q, Request *r);
 Request *   queue_pop(Queue *q);
+Request *   queue_trypop(Queue *q);
 
 #endif
 
@@ -3,7 +3,15 @@
 #ifndef REQUEST_H
 #define REQUEST_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
+
+/* Constants */
+
+#define REQUEST_PRIORITIES  8       // Priority levels (0 is default and lowest)
+#define REQUEST_CHUNK       65536   // Bytes copied at a time for bodies in files
 
 /* Structures */
 
@@ -12,7 +20,18 @@ struct Request {
     char *	method;
     char *	uri;
     char *	body;
-    
+    char *	headers;	// Extra header lines (each ending in \r\n)
+    int		priority;	// Delivery priority (0 to REQUEST_PRIORITIES - 1)
+    uint64_t	id;		// Lease id of delivered message or ticket of confirmed
+				// publish (0 if neither)
+    char *	topic;		// Topic delivered message was published to (NULL if unknown)
+    const char *prefix;		// Encoded request line and headers written instead of
+				// method and uri (shared, not freed with the request)
+    bool	file;		// Whether body is in file fd instead of body
+    int		fd;		// File holding body
+    off_t	offset;		// Where body starts in file
+    size_t	length;		// Bytes of body in file
+
     Request *	next;
 };
 
@@ -20,7 +39,11 @@ struct Request {
 
 Request *   request_create(const char *method, const char *uri, const char *body);
 void	    request_delete(Request *r);
+void        request_header(Request *r, const char *name, const char *value);
 void        request_write(Request *r, FILE *fs);
+bool        request_attach(Request *r, int fd, size_t length);
+bool        request_spool(Request *r, FILE *fs, size_t length);
+bool        request_load(Request *r);
 
 #endif
 
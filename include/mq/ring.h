@@ -0,0 +1,37 @@
+/* ring.h: Consistent hash ring */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Constants */
+
+#define RING_NODES_MAX  16      // Maximum number of nodes
+#define RING_VNODES     64      // Points on the ring per node
+
+/* Structures */
+
+typedef struct RingPoint RingPoint;
+struct RingPoint {
+    uint32_t    hash;           // Position on the ring
+    uint32_t    node;           // Node owning keys up to this position
+};
+
+typedef struct Ring Ring;
+struct Ring {
+    RingPoint   points[RING_NODES_MAX * RING_VNODES];  // Sorted by hash
+    size_t      npoints;
+    size_t      nnodes;
+};
+
+/* Functions */
+
+uint32_t    ring_hash(const char *key);
+int         ring_add(Ring *ring, const char *name);
+size_t      ring_lookup(const Ring *ring, const char *key);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
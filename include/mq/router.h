@@ -0,0 +1,79 @@
+/* router.h: In-process fan-out of messages to local consumers */
+
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include "mq/request.h"
+#include "mq/thread.h"
+
+#include <stdbool.h>
+
+/* Constants */
+
+#define ROUTER_BUCKETS      64      // Topic hash table size (power of two)
+
+/* Structures */
+
+typedef void (*RouterDone)(Request *r, void *ctx);
+typedef void (*RouterChange)(const char *topic, bool consumed, void *ctx);
+
+typedef struct Router Router;
+typedef struct RouterTopic RouterTopic;
+
+/* One message shared by every local consumer of its topic */
+typedef struct Delivery Delivery;
+struct Delivery {
+    Request *       request;    // Message (topic, body in memory and lease id)
+    size_t          refs;       // Consumers that have not released it yet
+    Router *        router;
+};
+
+/* Messages of one topic waiting for one local consumer */
+typedef struct Consumer Consumer;
+struct Consumer {
+    Router *        router;
+    RouterTopic *   topic;
+
+    Mutex           lock;       // Protects items, head, size
+    Cond            ready;      // Signalled when a delivery arrives (or on close)
+    Delivery **     items;      // Ring buffer of capacity deliveries
+    size_t          capacity;   // Power of two
+    size_t          head;       // Next to receive
+    size_t          size;
+
+    Consumer *      next;       // Next consumer of topic
+};
+
+struct RouterTopic {
+    char *          name;
+    Consumer *      consumers;
+    size_t          nconsumers;
+    RouterTopic *   next;       // Next topic in hash chain
+};
+
+struct Router {
+    Mutex           lock;       // Protects topics and their consumer lists
+    RouterTopic *   topics[ROUTER_BUCKETS];     // Topics by name hash
+    RouterDone      done;       // Called with each request once fully released
+    RouterChange    changed;    // Called (with lock held) when a topic gains its
+                                // first or loses its last consumer (NULL if none)
+    void *          ctx;        // Passed to done and changed
+    bool            closed;     // Receivers return NULL once drained
+};
+
+/* Functions */
+
+Router *    router_create(RouterDone done, void *ctx);
+void        router_delete(Router *router);
+void        router_close(Router *router);
+
+Consumer *  router_subscribe(Router *router, const char *topic, bool *first);
+bool        router_unsubscribe(Consumer *c);
+
+bool        router_deliver(Router *router, Request *r);
+Delivery *  router_receive(Consumer *c);
+void        router_release(Delivery *d);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
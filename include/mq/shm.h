@@ -0,0 +1,40 @@
+/* shm.h: Shared memory transport */
+
+#ifndef SHM_H
+#define SHM_H
+
+#include "mq/request.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Constants */
+
+#define SHM_SOCKET          "/tmp/mq.%s.sock"   // Broker's unix socket (by port)
+
+/* Results of shm_receive */
+
+#define SHM_CLOSED          -1      // Broker went away
+#define SHM_IDLE            0       // Nothing left to read (or woken by shm_wake)
+#define SHM_CONFIRM         2       // Status of ticketed publish
+#define SHM_DELIVER         3       // Message of client's queue
+
+/* Structures */
+
+typedef struct Shm Shm;             // Session with broker on this host
+
+/* Functions */
+
+Shm *       shm_connect(const char *path);
+void        shm_delete(Shm *s);
+bool        shm_publish(Shm *s, const char *topic, const char *query, const char *id, const char *body, int priority, uint64_t ticket);
+bool        shm_subscribe(Shm *s, const char *queue, const char *topic, bool subscribe);
+bool        shm_consume(Shm *s, const char *queue, const char *member);
+int         shm_receive(Shm *s, Request **message, uint64_t *ticket, int *status);
+void        shm_wake(Shm *s);
+size_t      shm_pending(Shm *s);
+size_t      shm_lost(Shm *s, uint64_t **tickets);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -7,6 +7,7 @@
 
 /* Functions */
 
+int     socket_dial(const char *host, const char *port);
 FILE *  socket_connect(const char *host, const char *port);
 
 #endif
@@ -5,6 +5,7 @@
 
 #include "mq/logging.h"
 
+#include <errno.h>
 #include <pthread.h>
 
 /* Macros */
@@ -38,6 +39,15 @@ typedef pthread_cond_t              Cond;
 #define cond_init(c, a)             PTHREAD_CHECK(pthread_cond_init(c, a))
 #define cond_wait(c, l)             PTHREAD_CHECK(pthread_cond_wait(c, l))
 #define cond_signal(c)              PTHREAD_CHECK(pthread_cond_signal(c))
+#define cond_broadcast(c)           PTHREAD_CHECK(pthread_cond_broadcast(c))
+#define cond_timedwait(c, l, t) \
+    do { \
+        int _rc = pthread_cond_timedwait(c, l, t); \
+        if (_rc != 0 && _rc != ETIMEDOUT) { \
+            error("%s", strerror(_rc)); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
 
 #endif
 
@@ -0,0 +1,27 @@
+/* uring.h: io_uring transport */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Constants */
+
+#define URING_ENTRIES       64      // Submission queue entries
+#define URING_BUFFER_SIZE   16384   // Bytes per registered buffer (one per stream)
+
+/* Structures */
+
+typedef struct Uring Uring;         // Shared by every stream of one client
+
+/* Functions */
+
+Uring *     uring_create(unsigned entries, size_t buffers);
+void        uring_delete(Uring *u);
+FILE *      uring_fdopen(Uring *u, int fd, const char *mode);
+void        uring_stats(Uring *u, uint64_t *ops, uint64_t *calls);
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
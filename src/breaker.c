@@ -0,0 +1,184 @@
+/* breaker.c: Reconnect policy (backoff with jitter and circuit breaking) */
+
+#include "mq/breaker.h"
+
+/* Internal Functions */
+
+static void breaker_now(struct timespec *ts) {
+    clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static bool breaker_due(const struct timespec *now, const struct timespec *when) {
+    return now->tv_sec > when->tv_sec ||
+           (now->tv_sec == when->tv_sec && now->tv_nsec >= when->tv_nsec);
+}
+
+/**
+ * Next number from jitter generator (splitmix64).
+ * @param   b           Breaker structure.
+ * @return  Pseudo random 64-bit number.
+ */
+static uint64_t breaker_random(Breaker *b) {
+    uint64_t z = (b->seed += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* External Functions */
+
+/**
+ * Initialize breaker as closed with default delays.
+ * @param   b           Breaker structure.
+ * @param   seed        Seed of jitter generator (different for every client,
+ *                      so that clients losing a server together do not come
+ *                      back to it together).
+ */
+void breaker_init(Breaker *b, uint64_t seed) {
+    pthread_condattr_t attr;
+    PTHREAD_CHECK(pthread_condattr_init(&attr));
+    PTHREAD_CHECK(pthread_condattr_setclock(&attr, CLOCK_MONOTONIC));
+
+    mutex_init(&b->lock, NULL);
+    cond_init(&b->changed, &attr);
+    pthread_condattr_destroy(&attr);
+
+    b->state    = BREAKER_CLOSED;
+    b->failures = 0;
+    b->base     = BREAKER_BASE_DEFAULT;
+    b->max      = BREAKER_MAX_DEFAULT;
+    b->delay    = 0;
+    b->seed     = seed;
+}
+
+/**
+ * Wait until caller may try to connect.  While the circuit is closed anyone
+ * may; once open, nobody may until the retry time, when exactly one caller
+ * is let through to probe the server (the circuit is half-open) while the
+ * others wait for its outcome.
+ * @param   b           Breaker structure.
+ * @param   cancel      Flag that ends the wait when set (NULL to wait for
+ *                      as long as it takes); see breaker_wake.
+ * @return  Whether caller may connect (false if cancelled).
+ */
+bool breaker_wait(Breaker *b, const bool *cancel) {
+    bool allowed = false;
+
+    mutex_lock(&b->lock);
+    while (!(cancel && __atomic_load_n(cancel, __ATOMIC_ACQUIRE))) {
+        if (b->state == BREAKER_CLOSED) {
+            allowed = true;
+            break;
+        }
+
+        if (b->state == BREAKER_OPEN) {
+            struct timespec now;
+            breaker_now(&now);
+            if (breaker_due(&now, &b->retry)) {
+                b->state = BREAKER_HALF_OPEN;
+                allowed  = true;
+                break;
+            }
+            cond_timedwait(&b->changed, &b->lock, &b->retry);
+        } else {
+            cond_wait(&b->changed, &b->lock);
+        }
+    }
+    mutex_unlock(&b->lock);
+    return allowed;
+}
+
+/**
+ * Record that connecting worked, which closes the circuit and releases
+ * everyone waiting.
+ * @param   b           Breaker structure.
+ * @return  Number of consecutive failures this ends (0 if there were none).
+ */
+unsigned breaker_success(Breaker *b) {
+    mutex_lock(&b->lock);
+    unsigned failures = b->failures;
+    if (b->state != BREAKER_CLOSED) {
+        b->state = BREAKER_CLOSED;
+        cond_broadcast(&b->changed);
+    }
+    b->failures = 0;
+    b->delay    = 0;
+    mutex_unlock(&b->lock);
+    return failures;
+}
+
+/**
+ * Record that connecting failed (or a connection was lost), which opens the
+ * circuit for a while.  Delays grow with decorrelated jitter: each is drawn
+ * uniformly between base and three times the previous one (capped at max),
+ * which backs off about as fast as doubling but spreads clients out.
+ * Failures of attempts started before the circuit opened are not counted
+ * again.
+ * @param   b           Breaker structure.
+ * @return  Milliseconds until the next attempt.
+ */
+unsigned long breaker_failure(Breaker *b) {
+    struct timespec now;
+    breaker_now(&now);
+
+    mutex_lock(&b->lock);
+    if (b->state != BREAKER_OPEN) {
+        unsigned long high = b->delay ? b->delay * 3 : b->base;
+        if (high > b->max)
+            high = b->max;
+        if (high < b->base)
+            high = b->base;
+
+        b->delay = b->base + breaker_random(b) % (high - b->base + 1);
+        b->failures++;
+        b->state = BREAKER_OPEN;
+
+        b->retry.tv_sec  = now.tv_sec + b->delay / 1000;
+        b->retry.tv_nsec = now.tv_nsec + (b->delay % 1000) * 1000000;
+        if (b->retry.tv_nsec >= 1000000000) {
+            b->retry.tv_sec++;
+            b->retry.tv_nsec -= 1000000000;
+        }
+        cond_broadcast(&b->changed);
+    }
+
+    long remaining = (b->retry.tv_sec - now.tv_sec) * 1000 + (b->retry.tv_nsec - now.tv_nsec) / 1000000;
+    mutex_unlock(&b->lock);
+    return remaining > 0 ? remaining : 0;
+}
+
+/**
+ * Wake everyone waiting so that they check their cancel flags.
+ * @param   b           Breaker structure.
+ */
+void breaker_wake(Breaker *b) {
+    mutex_lock(&b->lock);
+    cond_broadcast(&b->changed);
+    mutex_unlock(&b->lock);
+}
+
+/**
+ * Report state of breaker.
+ * @param   b           Breaker structure.
+ * @param   failures    Where to store number of consecutive failures (or NULL).
+ * @param   retry       Where to store milliseconds until the circuit
+ *                      half-opens (or NULL); 0 unless it is open.
+ * @return  BREAKER_* state.
+ */
+int breaker_state(Breaker *b, unsigned *failures, unsigned long *retry) {
+    struct timespec now;
+    breaker_now(&now);
+
+    mutex_lock(&b->lock);
+    int state = b->state;
+    if (failures)
+        *failures = b->failures;
+    if (retry) {
+        long remaining = (b->retry.tv_sec - now.tv_sec) * 1000 + (b->retry.tv_nsec - now.tv_nsec) / 1000000;
+        *retry = (state == BREAKER_OPEN && remaining > 0) ? remaining : 0;
+    }
+    mutex_unlock(&b->lock);
+    return state;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
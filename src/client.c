@@ -5,35 +5,171 @@
 #include "mq/socket.h"
 #include "mq/string.h"
 
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <strings.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
 /* Internal Constants */
 
 #define SENTINEL "SHUTDOWN"
 
+#define MQ_SLOT_SENDER  MQ_PUSHERS_MAX          // Socket slots (pushers take 0 on)
+#define MQ_SLOT_PULLER  (MQ_PUSHERS_MAX + 1)
+
+#define MQ_SOURCE_EXPLICIT  0x1                 // Subscribed by mq_subscribe (or mq_on_message)
+#define MQ_SOURCE_ROUTER    0x2                 // Subscribed for local consumers
+
 /* Internal Prototypes */
 
 void * mq_pusher(void *);
 void * mq_puller(void *);
+void * mq_reader(void *);
+void * mq_sender(void *);
+
+Request * mq_request(const char *method, const char *uri, const char *body);
+uint64_t  mq_publish_request(MessageQueue *mq, const char *topic, const char *query, const char *body, int priority, bool confirm);
+int       mq_headers(FILE *fs, Request *r, bool *keepalive, long *length);
+int       mq_response(FILE *fs, Request *r, bool *keepalive);
+void      mq_confirm(MessageQueue *mq, const MQConfirm *confirms, size_t n);
+void      mq_confirmed(MessageQueue *mq, uint64_t ticket);
+Request * mq_frame(const char *header, uint64_t *id, size_t *length);
+bool      mq_frames(MQBroker *b, FILE *fs, size_t length);
+bool      mq_body(Request *m, FILE *fs, size_t size);
+bool      mq_skip(FILE *fs, long length);
+Request * mq_take(MessageQueue *mq);
+void      mq_taken(MessageQueue *mq, Request *r, uint64_t *id);
+bool      mq_chunks(Request *r, MQChunkCallback callback, void *ctx);
+bool      mq_write(const char *data, size_t n, void *ctx);
+void      mq_stream(MQBroker *b, const char *member);
+bool      mq_declare(MQBroker *b, FILE *fs);
+bool      mq_leases_full(MQBroker *b, struct timespec *deadline);
+const char *mq_queue(MessageQueue *mq);
+MQBroker *  mq_broker(MessageQueue *mq, const char *topic);
+void      mq_deliver(MessageQueue *mq, Request *r);
+void      mq_handle(Request *r, void *ctx);
+void      mq_routed(Request *r, void *ctx);
+void      mq_rerouted(const char *topic, bool consumed, void *ctx);
+void      mq_subscription(MessageQueue *mq, const char *topic, int source, bool subscribe);
+void      mq_subscribe_request(MessageQueue *mq, const char *topic, bool subscribe);
+char *    mq_unquote(const char *s, size_t n);
+FILE *    mq_connect(MessageQueue *mq, MQBroker *b, FILE **out, int slot);
+void      mq_reached(MQBroker *b);
+void      mq_disconnect(MessageQueue *mq, MQBroker *b, int slot, FILE *fs, FILE *out);
+void      mq_track(MessageQueue *mq, MQBroker *b, int slot, int fd);
+void      mq_interrupt(MessageQueue *mq, bool receiving);
+bool      mq_aborted(MessageQueue *mq);
+void      mq_exited(MessageQueue *mq, size_t *running);
+bool      mq_drain(MessageQueue *mq, size_t *running, const struct timespec *deadline);
+size_t    mq_drop(MessageQueue *mq, Request *head);
+bool      mq_local(const char *host);
 
 /* External Functions */
 
 /**
- * Create Message Queue withs specified name, host, and port.
+ * Create Message Queue withs specified name, host, and port.  The host may
+ * also be a comma separated list of host[:port] endpoints, in which case
+ * topics are partitioned across those servers by consistent hashing.
  * @param   name        Name of client's queue.
- * @param   host        Address of server.
- * @param   port        Port of server.
+ * @param   host        Address of server (or list of endpoints).
+ * @param   port        Port of server (for endpoints without one).
  * @return  Newly allocated Message Queue structure.
  */
 MessageQueue * mq_create(const char *name, const char *host, const char *port) {
+    return mq_create_flags(name, host, port, 0);
+}
+
+/**
+ * Create Message Queue with transport options.  With MQ_TRANSPORT_URING,
+ * every connection sends and receives through one io_uring shared by the
+ * pushers and pullers, falling back to blocking sockets if the library was
+ * built without it (URING=1) or the kernel does not allow it.  Unless
+ * MQ_TRANSPORT_TCP is given, messages are published to and received from
+ * servers on this host through shared memory where the server offers it.
+ * @param   name        Name of client's queue.
+ * @param   host        Address of server (or list of endpoints).
+ * @param   port        Port of server (for endpoints without one).
+ * @param   flags       Bitwise OR of MQ_* flags.
+ * @return  Newly allocated Message Queue structure.
+ */
+MessageQueue * mq_create_flags(const char *name, const char *host, const char *port, int flags) {
     MessageQueue *mq = calloc(1, sizeof(MessageQueue));
     if (mq) {
+        char  endpoints[BUFSIZ];
+        char *saveptr;
+        snprintf(endpoints, sizeof(endpoints), "%s", host);
+
+        for (char *e = strtok_r(endpoints, ",", &saveptr); e; e = strtok_r(NULL, ",", &saveptr)) {
+            char *colon = strchr(e, ':');                 // host:port (not IPv6)
+            if (colon && colon == strrchr(e, ':'))
+                *colon = '\0';
+            else
+                colon = NULL;
+
+            if (mq->nbrokers == MQ_BROKERS_MAX) {
+                error("Too many servers (at most %d)", MQ_BROKERS_MAX);
+                mq_delete(mq);
+                return NULL;
+            }
+
+            MQBroker *b = &mq->brokers[mq->nbrokers];
+            char node[NI_MAXHOST + NI_MAXSERV + 1];
+            snprintf(b->host, sizeof(b->host), "%s", e);
+            snprintf(b->port, sizeof(b->port), "%s", colon ? colon + 1 : port);
+            snprintf(node, sizeof(node), "%s:%s", b->host, b->port);
+            ring_add(&mq->ring, node);                    // as many nodes as brokers
+
+            b->mq       = mq;
+            b->outgoing = queue_create();
+            b->bulk     = queue_create();
+            for (size_t s = 0; s < MQ_SOCKETS; s++)
+                b->sockets[s] = -1;
+            mq->nbrokers++;
+        }
+
+        if (!mq->nbrokers) {
+            mq_delete(mq);
+            return NULL;
+        }
+
         strcpy(mq->name, (char *) name);
-        strcpy(mq->host, (char *) host);
-        strcpy(mq->port, (char *) port);
-        mq->outgoing = queue_create();
         mq->incoming = queue_create();
         mq->shutdown = false;
+        mq->window   = MQ_WINDOW_DEFAULT;
+        mq->npushers = 1;
+        mq->lease    = MQ_LEASE_DEFAULT;
+        mq->drain    = MQ_DRAIN_DEFAULT;
+        mq->flags    = flags;
+
+        struct timespec now;                            // distinct from earlier runs
+        clock_gettime(CLOCK_REALTIME, &now);
+        mq->nonce    = ((uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec) * 0x9E3779B97F4A7C15ULL ^ (uint64_t)getpid();
+        snprintf(mq->member, sizeof(mq->member), "%s-%016" PRIx64, mq->name, mq->nonce);
 
         mutex_init(&mq->lock, NULL);
+        mutex_init(&mq->subscribing, NULL);
+        cond_init(&mq->acked, NULL);
+        cond_init(&mq->flushed, NULL);
+        cond_init(&mq->drained, NULL);
+
+        for (size_t i = 0; i < mq->nbrokers; i++)
+            breaker_init(&mq->brokers[i].breaker, mq->nonce ^ ring_hash(mq->brokers[i].host) ^ i);
+
+        // Servers on this host take publishes and subscription changes (and
+        // push messages unless they are leased) through shared memory
+        for (size_t i = 0; i < mq->nbrokers && !(flags & MQ_TRANSPORT_TCP); i++) {
+            MQBroker *b = &mq->brokers[i];
+            char path[BUFSIZ];
+            if (!mq_local(b->host))
+                continue;
+            snprintf(path, sizeof(path), SHM_SOCKET, b->port);
+            if (!(b->shm = shm_connect(path)))
+                info("Shared memory with %s:%s unavailable (%s), using TCP", b->host, b->port, strerror(errno));
+        }
 
         return mq;
     }
@@ -49,8 +185,35 @@ void mq_delete(MessageQueue *mq) {
         //free(mq->name);
         //free(mq->host);
         //free(mq->port);
-        queue_delete(mq->outgoing);
-        queue_delete(mq->incoming);
+        for (size_t i = 0; i < mq->nbrokers; i++) {
+            queue_delete(mq->brokers[i].outgoing);
+            queue_delete(mq->brokers[i].bulk);
+        }
+        if (mq->incoming)
+            queue_delete(mq->incoming);
+        dispatcher_delete(mq->dispatcher);
+        router_delete(mq->router);
+        for (MQHandler *h = mq->handlers, *next; h; h = next) {
+            next = h->next;
+            free(h->topic);
+            free(h);
+        }
+        for (MQTopic *t = mq->topics, *next; t; t = next) {
+            next = t->next;
+            free(t->topic);
+            free(t->prefix);
+            free(t);
+        }
+        for (MQSubscription *s = mq->subscriptions, *next; s; s = next) {
+            next = s->next;
+            free(s->topic);
+            free(s);
+        }
+        for (size_t i = 0; i < mq->nbrokers; i++)
+            shm_delete(mq->brokers[i].shm);
+        free(mq->leases);
+        free(mq->early);
+        uring_delete(mq->uring);
         free(mq);
     }
 }
@@ -62,180 +225,2064 @@ void mq_delete(MessageQueue *mq) {
  * @param   body    Message body to publish.
  */
 void mq_publish(MessageQueue *mq, const char *topic, const char *body) {
-    char uri[BUFSIZ];
-    sprintf(uri, "/topic/%s", topic);
-    Request *r = request_create("PUT", uri, body);   // build request with the body
-    queue_push(mq->outgoing, r);                       // push request to outgoing    
+    mq_publish_prio(mq, topic, body, 0);
+}
+
+/**
+ * Publish one message to topic with a delivery priority.  Higher priority
+ * messages are sent before, and delivered ahead of, lower priority ones.
+ * @param   mq          Message Queue structure.
+ * @param   topic       Topic to publish to.
+ * @param   body        Message body to publish.
+ * @param   priority    Priority (0 to REQUEST_PRIORITIES - 1; 0 is default).
+ */
+void mq_publish_prio(MessageQueue *mq, const char *topic, const char *body, int priority) {
+    mq_publish_request(mq, topic, NULL, body, priority, false);
+}
+
+/**
+ * Publish one message to topic that expires if it is not retrieved in time.
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic to publish to.
+ * @param   body    Message body to publish.
+ * @param   ttl     Time to live in each subscriber's queue (milliseconds).
+ */
+void mq_publish_ttl(MessageQueue *mq, const char *topic, const char *body, unsigned long ttl) {
+    char query[64];
+    sprintf(query, "ttl=%lu.%03lu", ttl / 1000, ttl % 1000);
+    mq_publish_request(mq, topic, query, body, 0, false);
+}
+
+/**
+ * Publish one message to topic that the server delivers at specified time.
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic to publish to.
+ * @param   body    Message body to publish.
+ * @param   when    Delivery time (CLOCK_REALTIME).
+ */
+void mq_publish_at(MessageQueue *mq, const char *topic, const char *body, const struct timespec *when) {
+    char query[64];
+    sprintf(query, "at=%ld.%09ld", (long)when->tv_sec, (long)when->tv_nsec);
+    mq_publish_request(mq, topic, query, body, 0, false);
+}
+
+/**
+ * Publish one message to topic that the server delivers after a delay
+ * (measured from when the server receives it).
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic to publish to.
+ * @param   body    Message body to publish.
+ * @param   delay   Delivery delay in milliseconds.
+ */
+void mq_publish_after(MessageQueue *mq, const char *topic, const char *body, unsigned long delay) {
+    char query[64];
+    sprintf(query, "delay=%lu.%03lu", delay / 1000, delay % 1000);
+    mq_publish_request(mq, topic, query, body, 0, false);
+}
+
+/**
+ * Publish one message to topic under a key.  On compacted topics, the
+ * server keeps only the latest message of each key waiting in a queue, so
+ * consumers that fall behind skip the values that were superseded.
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic to publish to.
+ * @param   key     Key of message (e.g. the entity whose state it carries).
+ * @param   body    Message body to publish.
+ */
+void mq_publish_key(MessageQueue *mq, const char *topic, const char *key, const char *body) {
+    static const char HEX[] = "0123456789ABCDEF";
+    char   query[BUFSIZ] = "key=";
+    size_t n = strlen(query);
+
+    for (const unsigned char *c = (const unsigned char *)key; *c && n + 4 < sizeof(query); c++) {
+        if (isalnum(*c) || strchr("-._~", *c)) {
+            query[n++] = *c;
+        } else {
+            query[n++] = '%';
+            query[n++] = HEX[*c >> 4];
+            query[n++] = HEX[*c & 0xF];
+        }
+    }
+    query[n] = '\0';
+    mq_publish_request(mq, topic, query, body, 0, false);
+}
+
+/**
+ * Publish one message to topic and have the server's answer reported back.
+ * The publish is pipelined like any other, and once its response arrives the
+ * ticket is passed, along with the response status, to the confirm callback
+ * (see mq_set_confirm).  A status of 200 means the message was queued for
+ * subscribers, 404 that the topic had none, and 503 that a subscriber's
+ * queue was full.
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic to publish to.
+ * @param   body    Message body to publish.
+ * @return  Ticket identifying this publish (increasing from 1).
+ */
+uint64_t mq_publish_async(MessageQueue *mq, const char *topic, const char *body) {
+    return mq_publish_request(mq, topic, NULL, body, 0, true);
+}
+
+/**
+ * Open handle for publishing many messages to one topic.  The handle holds
+ * the topic's server and its request already encoded, so each mq_publish_to
+ * only has to copy the body and number the message id.  Opening the same
+ * topic again returns the same handle, which stays valid until mq_delete.
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic to publish to.
+ * @return  Topic handle (NULL if it could not be allocated).
+ */
+MQTopic * mq_topic_open(MessageQueue *mq, const char *topic) {
+    mutex_lock(&mq->lock);
+    MQTopic *t = mq->topics;
+    while (t && !streq(t->topic, topic))
+        t = t->next;
+
+    if (!t && (t = calloc(1, sizeof(MQTopic)))) {
+        const char *format = "PUT /topic/%s HTTP/1.0\r\nConnection: keep-alive\r\nX-Message-Id: %016" PRIx64 "-";
+        int length = snprintf(NULL, 0, format, topic, mq->nonce);
+        t->mq     = mq;
+        t->broker = mq_broker(mq, topic);
+        t->topic  = strdup(topic);
+        t->prefix = length < 0 ? NULL : malloc(length + 1);
+        if (t->topic && t->prefix) {
+            sprintf(t->prefix, format, topic, mq->nonce);
+            t->next    = mq->topics;
+            mq->topics = t;
+        } else {
+            free(t->topic);
+            free(t->prefix);
+            free(t);
+            t = NULL;
+        }
+    }
+    mutex_unlock(&mq->lock);
+    return t;
+}
+
+/**
+ * Publish one message through topic handle (see mq_topic_open).
+ * @param   t       Topic handle.
+ * @param   body    Message body to publish.
+ */
+void mq_publish_to(MQTopic *t, const char *body) {
+    uint64_t sequence = __atomic_add_fetch(&t->mq->published, 1, __ATOMIC_RELAXED);
+    if (t->broker->shm) {
+        char id[64];
+        sprintf(id, "%016" PRIx64 "-%" PRIu64, t->mq->nonce, sequence);
+        if (shm_publish(t->broker->shm, t->topic, NULL, id, body, 0, 0))
+            return;
+    }
+
+    Request *r = request_create(NULL, NULL, body ? body : "");
+    if (!r)
+        return;
+    r->prefix  = t->prefix;
+    r->headers = malloc(24);                    // rest of X-Message-Id
+    if (!r->headers) {
+        request_delete(r);
+        return;
+    }
+    sprintf(r->headers, "%" PRIu64 "\r\n", sequence);
+    queue_push(t->broker->outgoing, r);
+}
+
+/**
+ * Publish body of length bytes read from file descriptor (from its current
+ * offset on, which moves past them), without holding it in memory.  A
+ * regular file is sent straight from the page cache by sendfile, so the
+ * caller may close fd at once but must not change those bytes until the
+ * publish is confirmed; a pipe or socket is first moved to a temporary
+ * file by splice.  These publishes go out one at a time on a connection of
+ * their own, so a large body never holds up the small publishes queued
+ * behind it, and are confirmed like mq_publish_async.
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic to publish to.
+ * @param   fd      File descriptor holding body.
+ * @param   length  Bytes of body.
+ * @return  Ticket identifying this publish (0 if the body could not be read).
+ */
+uint64_t mq_publish_fd(MessageQueue *mq, const char *topic, int fd, size_t length) {
+    MQBroker *b = mq_broker(mq, topic);
+    char      uri[BUFSIZ];
+    snprintf(uri, BUFSIZ, "/topic/%s", topic);
+
+    Request *r = mq_request("PUT", uri, NULL);
+    if (!r || !request_attach(r, fd, length)) {
+        error("Unable to publish %zu bytes from descriptor %d: %s", length, fd, strerror(errno));
+        if (r)
+            request_delete(r);
+        return 0;
+    }
+
+    char id[64];
+    sprintf(id, "%016" PRIx64 "-%" PRIu64, mq->nonce, __atomic_add_fetch(&mq->published, 1, __ATOMIC_RELAXED));
+    request_header(r, "X-Message-Id", id);
+    r->id = __atomic_add_fetch(&mq->tickets, 1, __ATOMIC_ACQ_REL);
+    queue_push(b->bulk, r);
+    return r->id;
+}
+
+/**
+ * Set callback for publish confirms (before mq_start).  Confirms are handed
+ * over in batches, one per pipelined window of responses, from the pusher
+ * threads (so the callback may run on several threads at once).
+ * @param   mq          Message Queue structure.
+ * @param   callback    Function called with each batch of confirms (NULL
+ *                      to only count them for mq_flush).
+ * @param   ctx         Passed to callback.
+ */
+void mq_set_confirm(MessageQueue *mq, MQConfirmCallback callback, void *ctx) {
+    mq->confirm     = callback;
+    mq->confirm_ctx = ctx;
+}
+
+/**
+ * Wait until every publish from mq_publish_async so far has been confirmed
+ * (confirms of later tickets do not count towards earlier ones).
+ * @param   mq      Message Queue structure.
+ */
+void mq_flush(MessageQueue *mq) {
+    uint64_t tickets = __atomic_load_n(&mq->tickets, __ATOMIC_ACQUIRE);
+
+    mutex_lock(&mq->lock);
+    while (mq->confirmed < tickets)
+        cond_wait(&mq->flushed, &mq->lock);
+    mutex_unlock(&mq->lock);
 }
 
 /**
- * Retrieve one message (by taking Request from incoming queue).
+ * Retrieve one message (by taking Request from incoming queue).  With
+ * acknowledgements enabled, the message is acknowledged immediately.
  * @param   mq      Message Queue structure.
- * @return  Newly allocated message body (must be freed).
+ * @return  Newly allocated message body (must be freed), or NULL once the
+ *          client is stopped and every received message was retrieved.
+ */
+char * mq_retrieve(MessageQueue *mq) {
+    uint64_t id;
+    char *body = mq_retrieve_id(mq, &id);
+    if (id)
+        mq_ack(mq, id);
+    return body;
+}
+
+/**
+ * Retrieve one message along with its lease id.  With acknowledgements
+ * enabled (see mq_set_prefetch), the message is redelivered unless it is
+ * passed to mq_ack or mq_ack_batch before its lease runs out.
+ * @param   mq      Message Queue structure.
+ * @param   id      Where to store lease id (0 if acknowledgements are off).
+ * @return  Newly allocated message body (must be freed), or NULL once the
+ *          client is stopped and every received message was retrieved.
  */
 
 // pop stack
 // check if r->body is null and contains the sentinel value
 // If it does then just return null
-char * mq_retrieve(MessageQueue *mq) {
-    Request *r = queue_pop(mq->incoming);
-    
-    if (r->body != NULL && !streq(r->body, SENTINEL)){
-        char *body = strdup(r->body);
+char * mq_retrieve_id(MessageQueue *mq, uint64_t *id) {
+    Request *r;
+    char *body = NULL;
+
+    // Bodies received into files that cannot be read back are skipped
+    // without acknowledgement, so leased ones are redelivered
+    while ((r = queue_pop(mq->incoming)) && !request_load(r)) {
+        error("Unable to read message body: %s", strerror(errno));
         request_delete(r);
-        return body;
     }
-    else{
-        request_delete(r);
+
+    *id = 0;
+    if (!r)                                             // stopped and drained
         return NULL;
+
+    if (r->body != NULL && !streq(r->body, SENTINEL)){
+        body    = r->body;                              // hand over body
+        r->body = NULL;
+        *id     = r->id;
     }
+    else if (r->id){
+        mq_ack(mq, r->id);
+    }
+
+    request_delete(r);
+    return body;
 }
 
 /**
- * Subscribe to specified topic.
+ * Retrieve one message straight into file descriptor (a file, pipe or
+ * socket), so bodies received into temporary files (MQ_SPOOL_MIN bytes or
+ * more) are never held in memory; those are copied by sendfile where the
+ * kernel allows it.
  * @param   mq      Message Queue structure.
- * @param   topic   Topic string to subscribe to.
- **/
-void mq_subscribe(MessageQueue *mq, const char *topic) {
-    char uri[BUFSIZ];
-    sprintf(uri, "/subscription/%s/%s", mq->name, topic); // create uri
-    Request *r = request_create("PUT", uri, NULL);
-    queue_push(mq->outgoing, r);
+ * @param   fd      File descriptor to write body to.
+ * @param   id      Where to store lease id (NULL to acknowledge at once,
+ *                  like mq_retrieve).
+ * @return  Bytes of body written (-1 once stopped, or if writing failed, in
+ *          which case a leased message is redelivered).
+ */
+ssize_t mq_retrieve_fd(MessageQueue *mq, int fd, uint64_t *id) {
+    Request *r = mq_take(mq);
+    if (!r)
+        return -1;
+
+    size_t length = r->file ? r->length : strlen(r->body);
+    bool   sent   = false;
+    if (r->file) {
+        off_t   offset = r->offset;
+        size_t  left   = r->length;
+        ssize_t n      = 0;
+        while (left > 0 && (n = sendfile(fd, r->fd, &offset, left)) > 0)
+            left -= n;
+        sent = !left;
+        if (!sent && n < 0 && (errno == EINVAL || errno == ENOSYS) && left == r->length)
+            sent = mq_chunks(r, mq_write, &fd);         // fd does not take sendfile
+    } else {
+        sent = mq_chunks(r, mq_write, &fd);
+    }
+
+    if (!sent) {
+        error("Unable to write message body to descriptor %d: %s", fd, strerror(errno));
+        request_delete(r);
+        return -1;
+    }
+    mq_taken(mq, r, id);
+    return length;
+}
+
+/**
+ * Retrieve one message as a series of chunks handed to callback (of at most
+ * REQUEST_CHUNK bytes each for bodies received into temporary files, so
+ * those are never held in memory whole).
+ * @param   mq          Message Queue structure.
+ * @param   callback    Called with each chunk in order (returns false to
+ *                      give up on the message).
+ * @param   ctx         Passed to callback.
+ * @param   id          Where to store lease id (NULL to acknowledge at
+ *                      once, like mq_retrieve).
+ * @return  Bytes of body (-1 once stopped, or if callback gave up, in which
+ *          case a leased message is redelivered).
+ */
+ssize_t mq_retrieve_chunks(MessageQueue *mq, MQChunkCallback callback, void *ctx, uint64_t *id) {
+    Request *r = mq_take(mq);
+    if (!r)
+        return -1;
+
+    size_t length = r->file ? r->length : strlen(r->body);
+    if (!mq_chunks(r, callback, ctx)) {
+        request_delete(r);
+        return -1;
+    }
+    mq_taken(mq, r, id);
+    return length;
+}
+
+/**
+ * Enable acknowledged delivery (before mq_start).  Messages are leased from
+ * each server in batches of up to prefetch, and no more are requested from
+ * it while prefetch of its messages remain unacknowledged.
+ * @param   mq          Message Queue structure.
+ * @param   prefetch    Maximum number of unacknowledged messages (0 disables).
+ * @param   lease       Milliseconds before an unacknowledged message is
+ *                      redelivered (0 for MQ_LEASE_DEFAULT).
+ */
+void mq_set_prefetch(MessageQueue *mq, size_t prefetch, unsigned long lease) {
+    MQLease *leases = realloc(mq->leases, prefetch * mq->nbrokers * sizeof(MQLease));
+    if (prefetch && !leases)
+        return;
+
+    mq->leases   = leases;
+    mq->prefetch = prefetch;
+    mq->lease    = lease ? lease : MQ_LEASE_DEFAULT;
 }
 
 /**
- * Unubscribe to specified topic.
+ * Acknowledge one leased message.
  * @param   mq      Message Queue structure.
- * @param   topic   Topic string to unsubscribe from.
- **/
-void mq_unsubscribe(MessageQueue *mq, const char *topic) {
-    char uri[BUFSIZ];
-    sprintf(uri, "/subscription/%s/%s", mq->name, topic);
-    Request *r = request_create("DELETE", uri, NULL);
-    queue_push(mq->outgoing, r);
+ * @param   id      Lease id from mq_retrieve_id.
+ */
+void mq_ack(MessageQueue *mq, uint64_t id) {
+    mq_ack_batch(mq, &id, 1);
 }
 
 /**
- * Start running the background threads:
- *  1. First thread should continuously send requests from outgoing queue.
- *  2. Second thread should continuously receive reqeusts to incoming queue.
+ * Acknowledge leased messages.  Acknowledgements are appended to the one
+ * still waiting in the outgoing queue of the server that leased them, if
+ * any, so they go out in batches while its pusher is busy and immediately
+ * while it is idle.
  * @param   mq      Message Queue structure.
+ * @param   ids     Lease ids from mq_retrieve_id.
+ * @param   n       Number of lease ids.
  */
+void mq_ack_batch(MessageQueue *mq, const uint64_t *ids, size_t n) {
+    Request *fresh[MQ_BROKERS_MAX] = {NULL};
+    size_t   used[MQ_BROKERS_MAX]  = {0};
+    bool     grown[MQ_BROKERS_MAX] = {false};
 
-void mq_start(MessageQueue *mq) {
-    //mq_subscribe(mq, SENTINEL);
+    mutex_lock(&mq->lock);
+    for (size_t i = 0; i < n; i++)                    // count ids per server
+        used[ids[i] % MQ_BROKERS_MAX]++;
 
-    // Initialize and start threads 
-    thread_create(&mq->pusher, NULL, mq_pusher, mq);
-    thread_create(&mq->puller, NULL, mq_puller, mq);    
+    for (size_t i = 0; i < mq->nbrokers; i++) {       // grow each server's ack
+        MQBroker *b = &mq->brokers[i];
+        if (!used[i])
+            continue;
+        if (!b->ack) {
+            char uri[BUFSIZ];
+            sprintf(uri, "/ack/%s", mq_queue(mq));
+            b->ack = fresh[i] = mq_request("PUT", uri, "");
+        }
+
+        size_t length = strlen(b->ack->body);
+        char  *body   = realloc(b->ack->body, length + used[i] * 21 + 1);
+        if (body)
+            b->ack->body = body;
+        grown[i] = (body != NULL);
+        used[i]  = length;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        size_t    index = ids[i] % MQ_BROKERS_MAX;
+        MQBroker *b     = &mq->brokers[index];
+        if (index >= mq->nbrokers)
+            continue;
+        if (grown[index])
+            used[index] += sprintf(b->ack->body + used[index], "%" PRIu64 " ", ids[i] / MQ_BROKERS_MAX);
+
+        for (size_t l = 0; l < mq->nleases; l++) {    // release window slot
+            if (mq->leases[l].id == ids[i]) {
+                mq->leases[l] = mq->leases[--mq->nleases];
+                b->nleases--;
+                break;
+            }
+        }
+    }
+
+    cond_broadcast(&mq->acked);
+    mutex_unlock(&mq->lock);
 
-    // Subscribe to sentinel
-    mq_subscribe(mq, SENTINEL);
+    for (size_t i = 0; i < mq->nbrokers; i++)
+        if (fresh[i])
+            queue_push(mq->brokers[i].outgoing, fresh[i]);
 }
 
 /**
- * Stop the message queue client by setting shutdown attribute and sending
- * sentinel messages
+ * Join consumer group (before mq_subscribe and mq_start).  Every client in
+ * the group shares one server queue named after the group, and the server
+ * hands each message to only one of them, taking turns between members.
  * @param   mq      Message Queue structure.
+ * @param   group   Name of consumer group (NULL or empty to leave).
  */
+void mq_set_group(MessageQueue *mq, const char *group) {
+    snprintf(mq->group, sizeof(mq->group), "%s", group ? group : "");
+}
 
-void mq_stop(MessageQueue *mq) {
-    mq_publish(mq, SENTINEL, SENTINEL);
+/**
+ * Call callback with each message of topic (and subscribe to it) instead of
+ * returning them from mq_retrieve.  Callbacks run on a pool of dispatch
+ * threads: messages of one topic are handled in order, one at a time, while
+ * different topics are handled in parallel.  With acknowledgements enabled,
+ * each message is acknowledged once its callback returns.
+ * @param   mq          Message Queue structure.
+ * @param   topic       Topic to handle.
+ * @param   callback    Function called with each message (body is only
+ *                      valid until it returns).
+ * @param   ctx         Passed to callback.
+ */
+void mq_on_message(MessageQueue *mq, const char *topic, MQCallback callback, void *ctx) {
+    if (!mq->dispatcher) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        mq->dispatcher = dispatcher_create(mq->ndispatchers ? mq->ndispatchers : (cpus > 0 ? (size_t)cpus : 1));
+        if (!mq->dispatcher)
+            return;
+    }
 
-    // Lock and change the variable
-    mutex_lock(&mq->lock);
-    mq->shutdown = true;
-    mutex_unlock(&mq->lock);
+    MQHandler *h = calloc(1, sizeof(MQHandler));
+    if (!h || !(h->topic = strdup(topic))) {
+        free(h);
+        return;
+    }
+    h->mq       = mq;
+    h->callback = callback;
+    h->ctx      = ctx;
 
-    // TODO join threads pusher and puller
-    thread_join(mq->pusher, NULL);
-    thread_join(mq->puller, NULL);
+    if (!dispatcher_register(mq->dispatcher, topic, mq_handle, h)) {
+        free(h->topic);
+        free(h);
+        return;
+    }
+
+    // A later handler of a topic replaces the earlier one, whose subscription
+    // it keeps (the replaced one stays allocated until mq_delete, since a
+    // callback may still be running with it)
+    bool subscribed = false;
+    for (MQHandler *other = mq->handlers; other && !subscribed; other = other->next)
+        subscribed = streq(other->topic, topic);
+    h->next      = mq->handlers;
+    mq->handlers = h;
+
+    if (!subscribed)
+        mq_subscribe(mq, topic);
 }
 
 /**
- * Returns whether or not the message queue should be shutdown.
- * @param   mq      Message Queue structure.
+ * Set number of threads that run callbacks (before the first mq_on_message).
+ * @param   mq          Message Queue structure.
+ * @param   dispatchers Number of dispatch threads (0 for one per CPU).
  */
-bool mq_shutdown(MessageQueue *mq) {
+void mq_set_dispatchers(MessageQueue *mq, size_t dispatchers) {
+    mq->ndispatchers = dispatchers;
+}
+
+/**
+ * Add local consumer of topic.  However many consumers a topic has in this
+ * process, the client subscribes to it once and the server sends each
+ * message once; every consumer then receives the same shared message (see
+ * mq_consume).  Messages of topics with consumers are neither returned by
+ * mq_retrieve nor passed to mq_on_message callbacks.
+ * @param   mq          Message Queue structure.
+ * @param   topic       Topic to consume.
+ * @return  Newly allocated Consumer structure (NULL on failure).
+ */
+Consumer * mq_consumer_create(MessageQueue *mq, const char *topic) {
     mutex_lock(&mq->lock);
-    bool status = mq->shutdown;
+    if (!mq->router) {                                  // read by pullers unlocked
+        Router *router = router_create(mq_routed, mq);
+        if (router)
+            router->changed = mq_rerouted;
+        __atomic_store_n(&mq->router, router, __ATOMIC_RELEASE);
+    }
+    Router *router = mq->router;
     mutex_unlock(&mq->lock);
-    return (status);
+    if (!router)
+        return NULL;
+
+    bool first;
+    return router_subscribe(router, topic, &first);     // subscribes if first
 }
 
-/* Internal Functions */
+/**
+ * Remove local consumer (once nothing is waiting in mq_consume for it),
+ * unsubscribing from its topic if it was the last one.
+ * @param   c           Consumer structure (deleted).
+ */
+void mq_consumer_delete(Consumer *c) {
+    router_unsubscribe(c);                              // unsubscribes if last
+}
 
 /**
- * Pusher thread takes messages from outgoing queue and sends them to server.
- * @param   arg     Message Queue structure.
+ * Receive next message of consumer's topic.  The message (d->request->topic,
+ * d->request->body) is shared with the other consumers of the topic, so it
+ * must not be modified, and stays valid until released with mq_release.
+ * @param   c           Consumer structure.
+ * @return  Shared message (NULL once the client is stopped and nothing is left).
+ */
+Delivery * mq_consume(Consumer *c) {
+    return router_receive(c);
+}
+
+/**
+ * Release message received with mq_consume.  Once every consumer it was
+ * shared with has released it, the message is acknowledged (if leased) and
+ * freed.
+ * @param   d           Shared message.
+ */
+void mq_release(Delivery *d) {
+    router_release(d);
+}
+
+/**
+ * Subscribe to specified topic (on the server that owns the topic).
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic string to subscribe to.
  **/
+void mq_subscribe(MessageQueue *mq, const char *topic) {
+    mq_subscription(mq, topic, MQ_SOURCE_EXPLICIT, true);
+}
 
-void * mq_pusher(void *arg) {
-    MessageQueue *mq = (MessageQueue *) arg;              // set arg
+/**
+ * Unubscribe to specified topic.  Messages of the topic keep coming while it
+ * has local consumers (see mq_consumer_create).
+ * @param   mq      Message Queue structure.
+ * @param   topic   Topic string to unsubscribe from.
+ **/
+void mq_unsubscribe(MessageQueue *mq, const char *topic) {
+    mq_subscription(mq, topic, MQ_SOURCE_EXPLICIT, false);
+}
 
-    while (!mq_shutdown(mq)){
-        //Request *r = queue_pop(mq->outgoing);             // pop request
-        FILE *fs = socket_connect(mq->host, mq->port);    // connect to server
-        if (!fs)
-            continue;
-        else{
-            Request *r = queue_pop(mq->outgoing);
-            char buffer[BUFSIZ];
-            request_write(r, fs);                             // write request to server
-            while(fgets(buffer, BUFSIZ, fs))                  // read response
-                buffer[strlen(buffer)-1] = '\0';                // set last char to null
-    
-            request_delete(r);
-            fclose(fs);
-        }
+/**
+ * Record that source holds (or let go of) its subscription to topic.  The
+ * server is asked to subscribe when the topic gains its first holder and to
+ * unsubscribe once none is left, so one source letting go does not cut off
+ * the messages another still wants.
+ * @param   mq          Message Queue structure.
+ * @param   topic       Topic.
+ * @param   source      MQ_SOURCE_* subscribing or unsubscribing.
+ * @param   subscribe   Whether to subscribe or unsubscribe.
+ **/
+void mq_subscription(MessageQueue *mq, const char *topic, int source, bool subscribe) {
+    mutex_lock(&mq->subscribing);
+    MQSubscription **s = &mq->subscriptions;
+    while (*s && !streq((*s)->topic, topic))
+        s = &(*s)->next;
+
+    if (!*s && subscribe) {                             // untracked if out of memory
+        MQSubscription *added = calloc(1, sizeof(MQSubscription));
+        if (added && (added->topic = strdup(topic)))
+            *s = added;
+        else
+            free(added);
     }
 
-    return NULL;
+    int before = *s ? (*s)->sources : 0;
+    int after  = subscribe ? before | source : before & ~source;
+    if (*s && !after) {                                 // nothing holds it any more
+        MQSubscription *gone = *s;
+        *s = gone->next;
+        free(gone->topic);
+        free(gone);
+    } else if (*s) {
+        (*s)->sources = after;
+    }
+
+    if (subscribe ? !before : !after)
+        mq_subscribe_request(mq, topic, subscribe);
+    mutex_unlock(&mq->subscribing);
 }
 
 /**
- * Puller thread requests new messages from server and then puts them in
- * incoming queue.
- * @param   arg     Message Queue structure.
+ * Send subscription change to the server that owns the topic.
+ * @param   mq          Message Queue structure.
+ * @param   topic       Topic.
+ * @param   subscribe   Whether to subscribe or unsubscribe.
  **/
+void mq_subscribe_request(MessageQueue *mq, const char *topic, bool subscribe) {
+    MQBroker *b = mq_broker(mq, topic);
+    if (b->shm && shm_subscribe(b->shm, mq_queue(mq), topic, subscribe))
+        return;
 
-// Done
-void * mq_puller(void *arg) {
-    MessageQueue *mq = (MessageQueue *)arg;
+    char uri[BUFSIZ];
+    sprintf(uri, "/subscription/%s/%s", mq_queue(mq), topic); // create uri
+    Request *r = mq_request(subscribe ? "PUT" : "DELETE", uri, NULL);
+    queue_push(b->outgoing, r);
+}
 
-    FILE *fs;
-    while (!mq_shutdown(mq)){
-        char uri[BUFSIZ];
-        sprintf(uri, "/queue/%s", mq->name);
-        Request *r = request_create("GET", uri, NULL);            // make empty request
-        fs = socket_connect(mq->host, mq->port);                 // connect to server
-        if (fs){
-            request_write(r, fs);
-            char buffer[BUFSIZ];            // write request
-            if (fgets(buffer, BUFSIZ, fs) && strstr(buffer, "200 OK")){   
-                int length = 0;                
-                while (fgets(buffer, BUFSIZ, fs) && !streq(buffer, "\r\n"))
-                    sscanf(buffer, "Content-Length:%d", &length);
-                if (length > 0){
-                    r->body = calloc(length + 1, sizeof(char));
-                    fread(r->body, 1, length, fs);
-                }
-                if (r->body)
-                    queue_push(mq->incoming, r);
-                else
-                    request_delete(r);
-            }
-            else{
-                request_delete(r);
-                while(fgets(buffer, BUFSIZ, fs))
-                    continue;
-            }
-            fclose(fs);
-        }
-        else
-            request_delete(r);
+/**
+ * Set maximum number of requests each pusher keeps in flight (before mq_start).
+ * @param   mq      Message Queue structure.
+ * @param   window  Number of unacknowledged requests per connection.
+ */
+void mq_set_window(MessageQueue *mq, size_t window) {
+    mq->window = window ? window : 1;
+}
+
+/**
+ * Set number of parallel pusher connections (before mq_start).  With more
+ * than one pusher, requests are no longer sent in publish order.
+ * @param   mq      Message Queue structure.
+ * @param   pushers Number of pusher threads.
+ */
+void mq_set_pushers(MessageQueue *mq, size_t pushers) {
+    mq->npushers = pushers < 1 ? 1 : (pushers > MQ_PUSHERS_MAX ? MQ_PUSHERS_MAX : pushers);
+}
+
+/**
+ * Set how long threads wait before reconnecting to a server they could not
+ * reach (before mq_start).  Delays start at base and grow with jitter up to
+ * max, so that the clients of a server that went away do not all come back
+ * to it at the same moment.  Until a delay has passed, no thread of this
+ * client tries the server; then one thread tries while the others wait for
+ * it.
+ * @param   mq      Message Queue structure.
+ * @param   base    Milliseconds before first retry.
+ * @param   max     Milliseconds between retries at most.
+ */
+void mq_set_backoff(MessageQueue *mq, unsigned long base, unsigned long max) {
+    for (size_t i = 0; i < mq->nbrokers; i++) {
+        mq->brokers[i].breaker.base = base ? base : 1;
+        mq->brokers[i].breaker.max  = max > base ? max : mq->brokers[i].breaker.base;
+    }
+}
+
+/**
+ * Report health of each server.
+ * @param   mq      Message Queue structure.
+ * @param   health  Array to fill in (one entry per server).
+ * @param   n       Number of entries in array.
+ * @return  Number of servers (entries beyond n are not filled in).
+ */
+size_t mq_health(MessageQueue *mq, MQHealth *health, size_t n) {
+    for (size_t i = 0; i < mq->nbrokers && i < n; i++) {
+        MQBroker *b = &mq->brokers[i];
+        health[i].host  = b->host;
+        health[i].port  = b->port;
+        health[i].state = breaker_state(&b->breaker, &health[i].failures, &health[i].retry);
+    }
+    return mq->nbrokers;
+}
+
+/**
+ * Start running the background threads (for each server):
+ *  1. First thread should continuously send requests from outgoing queue.
+ *  2. Second thread should continuously receive reqeusts to incoming queue.
+ * @param   mq      Message Queue structure.
+ */
+
+void mq_start(MessageQueue *mq) {
+    // Each connection (two per pusher, one per puller) gets a registered buffer
+    if ((mq->flags & MQ_TRANSPORT_URING) && !mq->uring) {
+        mq->uring = uring_create(URING_ENTRIES, mq->nbrokers * (2 * mq->npushers + 1));
+        if (!mq->uring)
+            info("io_uring unavailable (%s), using blocking sockets", strerror(errno));
+    }
+
+    // Our queue is created on every server by subscribing to the sentinel
+    // (groups only create the queue).  Pullers do so themselves on each new
+    // connection ahead of their reads (see mq_declare); without one it is
+    // done here, through shared memory where possible
+    for (size_t i = 0; i < mq->nbrokers; i++) {
+        MQBroker *b = &mq->brokers[i];
+        if (!b->shm || mq->prefetch)
+            continue;
+
+        char uri[BUFSIZ];
+        if (*mq->group)
+            sprintf(uri, "/queue/%s", mq->group);
+        else if (shm_subscribe(b->shm, mq->name, SENTINEL, true))
+            *uri = '\0';
+        else
+            sprintf(uri, "/subscription/%s/%s", mq->name, SENTINEL);
+        if (*uri)
+            queue_push(b->outgoing, mq_request("PUT", uri, NULL));
+
+        shm_consume(b->shm, mq_queue(mq), *mq->group ? mq->member : NULL);
+    }
+
+    // Writing to a connection the server has closed must fail with EPIPE
+    // rather than kill the process, so the threads inherit a mask with
+    // SIGPIPE blocked (the application's own disposition is left alone)
+    sigset_t pipe, mask;
+    sigemptyset(&pipe);
+    sigaddset(&pipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe, &mask);
+
+    // Initialize and start threads 
+    mq->nsending = mq->nbrokers * (mq->npushers + 1);
+    mq->nreading = 0;
+    for (size_t i = 0; i < mq->nbrokers; i++)
+        mq->nreading += mq->brokers[i].shm != NULL;
+    for (size_t i = 0; i < mq->nbrokers; i++) {
+        MQBroker *b = &mq->brokers[i];
+        for (size_t p = 0; p < mq->npushers; p++)
+            thread_create(&b->pushers[p], NULL, mq_pusher, b);
+        thread_create(&b->sender, NULL, mq_sender, b);
+        if (!b->shm || mq->prefetch)
+            thread_create(&b->puller, NULL, mq_puller, b);
+        if (b->shm)
+            thread_create(&b->reader, NULL, mq_reader, b);
+    }
+    pthread_sigmask(SIG_SETMASK, &mask, NULL);
+}
+
+/**
+ * Stop the message queue client.  Receiving stops at once: the pullers are
+ * woken wherever they wait, including reads on their connections, which are
+ * shut down.  Requests already queued for the servers (publishes and acks)
+ * are then drained for up to the drain timeout (see mq_set_drain); whatever
+ * is still unsent after that is given up, and publishes among it are
+ * confirmed with status -1.  Messages received but not yet retrieved are
+ * still returned by mq_retrieve, which returns NULL after them.
+ * @param   mq      Message Queue structure.
+ */
+
+void mq_stop(MessageQueue *mq) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec  += mq->drain / 1000;
+    deadline.tv_nsec += (mq->drain % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    mutex_lock(&mq->lock);
+    __atomic_store_n(&mq->shutdown, true, __ATOMIC_RELEASE);
+    cond_broadcast(&mq->acked);
+    mutex_unlock(&mq->lock);
+
+    for (size_t i = 0; i < mq->nbrokers; i++) {
+        breaker_wake(&mq->brokers[i].breaker);
+        if (mq->brokers[i].shm)
+            shm_wake(mq->brokers[i].shm);
+    }
+    mq_interrupt(mq, true);
+
+    // Group members also release their pending GETs on the servers
+    if (*mq->group) {
+        char uri[BUFSIZ];
+        sprintf(uri, "/queue/%s?member=%s", mq->group, mq->member);
+        for (size_t i = 0; i < mq->nbrokers; i++)
+            queue_push(mq->brokers[i].outgoing, mq_request("DELETE", uri, NULL));
+    }
+
+    // Stop receiving (readers once their shared memory publishes are
+    // confirmed), then finish callbacks (whose acks the pushers still send)
+    for (size_t i = 0; i < mq->nbrokers; i++) {
+        MQBroker *b = &mq->brokers[i];
+        if (!b->shm || mq->prefetch)
+            thread_join(b->puller, NULL);
+    }
+    mq_drain(mq, &mq->nreading, &deadline);
+    for (size_t i = 0; i < mq->nbrokers; i++) {
+        if (mq->brokers[i].shm)
+            thread_join(mq->brokers[i].reader, NULL);
+    }
+    dispatcher_delete(mq->dispatcher);
+    mq->dispatcher = NULL;
+    if (mq->router)
+        router_close(mq->router);
+    queue_close(mq->incoming);
+
+    // Pushers and senders exit once their queues are empty
+    for (size_t i = 0; i < mq->nbrokers; i++) {
+        queue_close(mq->brokers[i].outgoing);
+        queue_close(mq->brokers[i].bulk);
+    }
+    mq_drain(mq, &mq->nsending, &deadline);
+
+    for (size_t i = 0; i < mq->nbrokers; i++) {
+        for (size_t p = 0; p < mq->npushers; p++)
+            thread_join(mq->brokers[i].pushers[p], NULL);
+        thread_join(mq->brokers[i].sender, NULL);
+    }
+
+    size_t dropped = 0;
+    for (size_t i = 0; i < mq->nbrokers; i++) {
+        MQBroker *b = &mq->brokers[i];
+        mutex_lock(&mq->lock);                          // stop mq_ack appending
+        b->ack = NULL;
+        mutex_unlock(&mq->lock);
+
+        Request *head = NULL;
+        Request *tail = NULL;
+        Request *r;
+        while ((r = queue_trypop(b->outgoing)) || (r = queue_trypop(b->bulk))) {
+            r->next = NULL;
+            if (tail)
+                tail->next = r;
+            else
+                head = r;
+            tail = r;
+        }
+        dropped += mq_drop(mq, head);
+
+        shm_delete(b->shm);
+        b->shm = NULL;
+    }
+    if (dropped)
+        error("Gave up %zu queued requests after draining for %lu ms", dropped, mq->drain);
+}
+
+/**
+ * Set how long mq_stop keeps sending requests that are still queued.
+ * @param   mq      Message Queue structure.
+ * @param   timeout Milliseconds to wait (0 gives them up at once).
+ */
+void mq_set_drain(MessageQueue *mq, unsigned long timeout) {
+    mq->drain = timeout;
+}
+
+/**
+ * Returns whether or not the message queue should be shutdown.
+ * @param   mq      Message Queue structure.
+ */
+bool mq_shutdown(MessageQueue *mq) {
+    return __atomic_load_n(&mq->shutdown, __ATOMIC_ACQUIRE);
+}
+
+/* Internal Functions */
+
+/**
+ * Name of server queue this client consumes from.
+ * @param   mq          Message Queue structure.
+ * @return  Consumer group if set, otherwise name of client.
+ */
+const char * mq_queue(MessageQueue *mq) {
+    return *mq->group ? mq->group : mq->name;
+}
+
+/**
+ * Server that owns topic (by consistent hashing of its name).
+ * @param   mq          Message Queue structure.
+ * @param   topic       Topic name.
+ * @return  Broker structure of server.
+ */
+MQBroker * mq_broker(MessageQueue *mq, const char *topic) {
+    return &mq->brokers[ring_lookup(&mq->ring, topic)];
+}
+
+/**
+ * Hand received message to the local consumers of its topic, or else to the
+ * callback registered for it, or queue it for mq_retrieve if there is none.
+ * @param   mq          Message Queue structure.
+ * @param   r           Request holding message.
+ */
+void mq_deliver(MessageQueue *mq, Request *r) {
+    Router *router = __atomic_load_n(&mq->router, __ATOMIC_ACQUIRE);
+    if (router && router_deliver(router, r))
+        return;
+    if (mq->dispatcher && r->topic && dispatcher_submit(mq->dispatcher, r->topic, r))
+        return;
+    queue_push(mq->incoming, r);
+}
+
+/**
+ * Run callback with message on a dispatch thread (then acknowledge it).
+ * @param   r           Request holding message (deleted).
+ * @param   ctx         Handler structure.
+ */
+void mq_handle(Request *r, void *ctx) {
+    MQHandler *h = (MQHandler *)ctx;
+    if (!request_load(r)) {                             // redelivered if leased
+        error("Unable to read message body: %s", strerror(errno));
+        request_delete(r);
+        return;
+    }
+    h->callback(h->mq, r->topic, r->body, h->ctx);
+    if (r->id)
+        mq_ack(h->mq, r->id);
+    request_delete(r);
+}
+
+/**
+ * Finish message shared among local consumers once all of them released it.
+ * @param   r           Request holding message (deleted).
+ * @param   ctx         Message Queue structure.
+ */
+void mq_routed(Request *r, void *ctx) {
+    MessageQueue *mq = (MessageQueue *)ctx;
+    if (r->id)
+        mq_ack(mq, r->id);
+    request_delete(r);
+}
+
+/**
+ * Subscribe to topic once it gains its first local consumer and unsubscribe
+ * once it loses its last one (unless the application subscribed to it with
+ * mq_subscribe or mq_on_message too).  The router calls this with its lock
+ * held, so the requests are queued in the order of the transitions and a
+ * quick delete and create of a topic's only consumer cannot reach the server
+ * as subscribe then unsubscribe.
+ * @param   topic       Topic.
+ * @param   consumed    Whether topic gained its first consumer.
+ * @param   ctx         Message Queue structure.
+ */
+void mq_rerouted(const char *topic, bool consumed, void *ctx) {
+    mq_subscription((MessageQueue *)ctx, topic, MQ_SOURCE_ROUTER, consumed);
+}
+
+/**
+ * Take next message for a retrieve that does not need it in memory.
+ * @param   mq          Message Queue structure.
+ * @return  Request holding message (NULL once stopped and drained).
+ */
+Request * mq_take(MessageQueue *mq) {
+    Request *r = queue_pop(mq->incoming);
+    if (!r)
+        return NULL;
+    if ((r->file || r->body) && !(r->body && streq(r->body, SENTINEL)))
+        return r;
+
+    if (r->id)
+        mq_ack(mq, r->id);
+    request_delete(r);
+    return NULL;
+}
+
+/**
+ * Finish retrieve of message taken by mq_take: hand over its lease id, or
+ * acknowledge it at once if the caller does not want it.
+ * @param   mq          Message Queue structure.
+ * @param   r           Request holding message (deleted).
+ * @param   id          Where to store lease id (NULL to acknowledge).
+ */
+void mq_taken(MessageQueue *mq, Request *r, uint64_t *id) {
+    if (id)
+        *id = r->id;
+    else if (r->id)
+        mq_ack(mq, r->id);
+    request_delete(r);
+}
+
+/**
+ * Hand body of message to callback in chunks (read from its file a chunk at
+ * a time, or all at once if it is in memory).
+ * @param   r           Request holding message.
+ * @param   callback    Called with each chunk (returns false to stop).
+ * @param   ctx         Passed to callback.
+ * @return  Whether or not the whole body was handed over.
+ */
+bool mq_chunks(Request *r, MQChunkCallback callback, void *ctx) {
+    if (!r->file)
+        return callback(r->body, strlen(r->body), ctx);
+
+    char   buffer[REQUEST_CHUNK];
+    size_t done = 0;
+    while (done < r->length) {
+        size_t  want = r->length - done < sizeof(buffer) ? r->length - done : sizeof(buffer);
+        ssize_t n    = pread(r->fd, buffer, want, r->offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0 || !callback(buffer, n, ctx))
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+/**
+ * Chunk callback writing to file descriptor.
+ * @param   data        Chunk of body.
+ * @param   n           Bytes of chunk.
+ * @param   ctx         Pointer to file descriptor.
+ * @return  Whether or not all of it was written.
+ */
+bool mq_write(const char *data, size_t n, void *ctx) {
+    int fd = *(int *)ctx;
+    while (n > 0) {
+        ssize_t w = write(fd, data, n);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return false;
+        data += w;
+        n    -= w;
+    }
+    return true;
+}
+
+/**
+ * Decode %XX escapes of URL encoded string.
+ * @param   s           Encoded string.
+ * @param   n           Length of encoded string.
+ * @return  Newly allocated decoded string.
+ */
+char * mq_unquote(const char *s, size_t n) {
+    char *decoded = malloc(n + 1);
+    char *d       = decoded;
+    if (!decoded)
+        return NULL;
+
+    for (size_t i = 0; i < n; i++) {
+        if (s[i] == '%' && i + 2 < n && isxdigit((unsigned char)s[i + 1]) && isxdigit((unsigned char)s[i + 2])) {
+            char hex[3] = { s[i + 1], s[i + 2], '\0' };
+            *d++ = (char)strtol(hex, NULL, 16);
+            i   += 2;
+        } else {
+            *d++ = s[i];
+        }
+    }
+    *d = '\0';
+    return decoded;
+}
+
+/**
+ * Whether or not host names this host (by its loopback names only).
+ * @param   host        Host of server.
+ * @return  Whether or not the server runs on this host.
+ */
+bool mq_local(const char *host) {
+    return streq(host, "localhost") || strncmp(host, "127.", 4) == 0 || streq(host, "::1");
+}
+
+/**
+ * Connect to server, on the io_uring transport if the client has one.  While
+ * the server is unreachable, this waits as its breaker says (see
+ * mq_set_backoff) instead of trying again right away.  Connecting alone does
+ * not close the breaker; the caller does once a response arrives whole (see
+ * mq_reached).
+ * @param   mq          Message Queue structure.
+ * @param   b           Broker structure of server.
+ * @param   out         Where to store a separate stream for writing (NULL
+ *                      to read and write the returned stream).  Switching
+ *                      one stdio stream from reading to writing discards
+ *                      whatever it has read ahead, i.e. pipelined responses.
+ * @param   slot        Socket slot of calling thread (MQ_SLOT_PULLER for the
+ *                      receiver, which stops at shutdown, otherwise a sender,
+ *                      which stops once mq_stop gives up draining); the
+ *                      connection is tracked there until mq_disconnect.
+ * @return  Socket file stream of connection (NULL on failure).
+ */
+FILE * mq_connect(MessageQueue *mq, MQBroker *b, FILE **out, int slot) {
+    if (!breaker_wait(&b->breaker, slot == MQ_SLOT_PULLER ? &mq->shutdown : &mq->aborted))
+        return NULL;
+
+    int fd = socket_dial(b->host, b->port);
+    if (fd < 0) {
+        breaker_failure(&b->breaker);
+        return NULL;
+    }
+    mq_track(mq, b, slot, fd);
+
+    int wd = out ? dup(fd) : -1;
+    if (out && wd < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    const char *mode = out ? "r" : "r+";
+    FILE *fs = mq->uring ? uring_fdopen(mq->uring, fd, mode) : fdopen(fd, mode);
+    if (!fs) {
+        error("Unable to make file stream: %s", strerror(errno));
+        mq_track(mq, b, slot, -1);
+        close(fd);
+        if (wd >= 0)
+            close(wd);
+        return NULL;
+    }
+
+    if (out && !(*out = mq->uring ? uring_fdopen(mq->uring, wd, "w") : fdopen(wd, "w"))) {
+        error("Unable to make file stream: %s", strerror(errno));
+        close(wd);
+        mq_disconnect(mq, b, slot, fs, NULL);
+        return NULL;
+    }
+    return fs;
+}
+
+/**
+ * Record that server answered a request in full, which closes its breaker.
+ * A server that accepts connections and then drops them keeps its breaker
+ * open, so the clients keep backing off.
+ * @param   b           Broker structure of server.
+ */
+void mq_reached(MQBroker *b) {
+    unsigned failures = breaker_success(&b->breaker);
+    if (failures)
+        info("Reconnected to %s:%s after %u attempts", b->host, b->port, failures);
+}
+
+/**
+ * Close connection made by mq_connect (no longer tracked for mq_stop first,
+ * so it never shuts down a descriptor that was reused).
+ * @param   mq          Message Queue structure.
+ * @param   b           Broker structure of server.
+ * @param   slot        Socket slot given to mq_connect.
+ * @param   fs          Socket file stream of connection.
+ * @param   out         Separate stream for writing (NULL if none).
+ */
+void mq_disconnect(MessageQueue *mq, MQBroker *b, int slot, FILE *fs, FILE *out) {
+    mq_track(mq, b, slot, -1);
+    if (out)
+        fclose(out);
+    fclose(fs);
+}
+
+/**
+ * Record socket of thread's connection, so that mq_stop can end reads and
+ * writes blocked on it.  A connection made after mq_stop already did so is
+ * shut down right away.
+ * @param   mq          Message Queue structure.
+ * @param   b           Broker structure of server.
+ * @param   slot        Socket slot of thread.
+ * @param   fd          Socket file descriptor (-1 once it is being closed).
+ */
+void mq_track(MessageQueue *mq, MQBroker *b, int slot, int fd) {
+    bool *stop = slot == MQ_SLOT_PULLER ? &mq->shutdown : &mq->aborted;
+
+    mutex_lock(&mq->lock);
+    b->sockets[slot] = fd;
+    if (fd >= 0 && __atomic_load_n(stop, __ATOMIC_ACQUIRE))
+        shutdown(fd, SHUT_RDWR);
+    mutex_unlock(&mq->lock);
+}
+
+/**
+ * Shut down tracked connections, which wakes the threads blocked reading or
+ * writing them (they see the connection end and check why).
+ * @param   mq          Message Queue structure.
+ * @param   receiving   Whether to shut down the receiver's connections
+ *                      (otherwise those of pushers and senders).
+ */
+void mq_interrupt(MessageQueue *mq, bool receiving) {
+    mutex_lock(&mq->lock);
+    for (size_t i = 0; i < mq->nbrokers; i++) {
+        for (int s = 0; s < MQ_SOCKETS; s++) {
+            int fd = mq->brokers[i].sockets[s];
+            if (fd >= 0 && (s == MQ_SLOT_PULLER) == receiving)
+                shutdown(fd, SHUT_RDWR);
+        }
+    }
+    mutex_unlock(&mq->lock);
+}
+
+/**
+ * Whether mq_stop gave up draining (pushers and senders drop what they have).
+ * @param   mq          Message Queue structure.
+ */
+bool mq_aborted(MessageQueue *mq) {
+    return __atomic_load_n(&mq->aborted, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Count thread mq_stop drains as finished.
+ * @param   mq          Message Queue structure.
+ * @param   running     Counter of its kind (nsending or nreading).
+ */
+void mq_exited(MessageQueue *mq, size_t *running) {
+    mutex_lock(&mq->lock);
+    if (--*running == 0)
+        cond_broadcast(&mq->drained);
+    mutex_unlock(&mq->lock);
+}
+
+/**
+ * Wait for threads to finish what they have to send, or else give up
+ * draining at the deadline: everything that could still be waiting (on a
+ * breaker, a sender's connection or shared memory) is woken to drop what
+ * it has.
+ * @param   mq          Message Queue structure.
+ * @param   running     Counter of threads (nsending or nreading).
+ * @param   deadline    When to give up (CLOCK_REALTIME).
+ * @return  Whether they all finished in time.
+ */
+bool mq_drain(MessageQueue *mq, size_t *running, const struct timespec *deadline) {
+    bool late = false;
+
+    mutex_lock(&mq->lock);
+    while (*running && !late) {
+        struct timespec now;
+        cond_timedwait(&mq->drained, &mq->lock, deadline);
+        clock_gettime(CLOCK_REALTIME, &now);
+        late = now.tv_sec > deadline->tv_sec ||
+               (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+    }
+    late = *running > 0;
+    if (late)
+        __atomic_store_n(&mq->aborted, true, __ATOMIC_RELEASE);
+    mutex_unlock(&mq->lock);
+
+    if (late) {
+        for (size_t i = 0; i < mq->nbrokers; i++) {
+            breaker_wake(&mq->brokers[i].breaker);
+            if (mq->brokers[i].shm)
+                shm_wake(mq->brokers[i].shm);
+        }
+        mq_interrupt(mq, false);
+    }
+    return !late;
+}
+
+/**
+ * Give up requests that were never answered, confirming publishes among them
+ * with status -1.
+ * @param   mq          Message Queue structure.
+ * @param   head        List of requests (deleted).
+ * @return  Number of requests given up.
+ */
+size_t mq_drop(MessageQueue *mq, Request *head) {
+    size_t n = 0;
+    for (Request *r = head, *next; r; r = next) {
+        next = r->next;
+        if (r->id) {
+            MQConfirm confirm = { r->id, -1 };
+            mq_confirm(mq, &confirm, 1);
+        }
+        request_delete(r);
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Create Request that can be sent on a persistent connection.
+ * @param   method      Request method string.
+ * @param   uri         Request uri string.
+ * @param   body        Request body string.
+ * @return  Newly allocated Request structure.
+ */
+Request * mq_request(const char *method, const char *uri, const char *body) {
+    Request *r = request_create(method, uri, body);
+    if (r)
+        request_header(r, "Connection", "keep-alive");
+    return r;
+}
+
+/**
+ * Queue PUT /topic/$topic request.  Every message carries an X-Message-Id
+ * unique to this client instance, so the server can ignore the copies the
+ * pusher resends after losing a connection.
+ * @param   mq          Message Queue structure.
+ * @param   topic       Topic to publish to.
+ * @param   query       Query string (NULL for none).
+ * @param   body        Message body to publish.
+ * @param   priority    Priority (0 to REQUEST_PRIORITIES - 1).
+ * @param   confirm     Whether or not to report the response status.
+ * @return  Ticket of request (0 if it is not confirmed).
+ */
+uint64_t mq_publish_request(MessageQueue *mq, const char *topic, const char *query, const char *body, int priority, bool confirm) {
+    MQBroker *b      = mq_broker(mq, topic);
+    uint64_t  ticket = confirm ? __atomic_add_fetch(&mq->tickets, 1, __ATOMIC_ACQ_REL) : 0;
+    char      id[64];
+    sprintf(id, "%016" PRIx64 "-%" PRIu64, mq->nonce, __atomic_add_fetch(&mq->published, 1, __ATOMIC_RELAXED));
+    priority = priority < 0 ? 0 : (priority < REQUEST_PRIORITIES ? priority : REQUEST_PRIORITIES - 1);
+
+    if (b->shm && shm_publish(b->shm, topic, query, id, body, priority, ticket))
+        return ticket;
+
+    char uri[BUFSIZ];
+    snprintf(uri, BUFSIZ, "/topic/%s%s%s", topic, query ? "?" : "", query ? query : "");
+    Request *r = mq_request("PUT", uri, body);       // build request with the body
+    if (priority > 0) {
+        char value[16];
+        r->priority = priority;
+        sprintf(value, "%d", r->priority);
+        request_header(r, "X-Priority", value);
+    }
+    request_header(r, "X-Message-Id", id);
+    r->id = ticket;
+    queue_push(b->outgoing, r);                      // push request to outgoing of topic's server
+    return ticket;
+}
+
+/**
+ * Report batch of publish confirms to the confirm callback and mq_flush.
+ * @param   mq          Message Queue structure.
+ * @param   confirms    Tickets and their response status.
+ * @param   n           Number of confirms.
+ */
+void mq_confirm(MessageQueue *mq, const MQConfirm *confirms, size_t n) {
+    if (mq->confirm)
+        mq->confirm(mq, confirms, n, mq->confirm_ctx);
+
+    mutex_lock(&mq->lock);
+    for (size_t i = 0; i < n; i++)
+        mq_confirmed(mq, confirms[i].ticket);
+    cond_broadcast(&mq->flushed);
+    mutex_unlock(&mq->lock);
+}
+
+/**
+ * Record one confirmed ticket (with mq->lock held).  Tickets confirm out of
+ * order across brokers and pushers, so the low-water mark only advances over
+ * an unbroken run; tickets above it wait in the early min-heap until the gap
+ * below them is confirmed.
+ * @param   mq          Message Queue structure.
+ * @param   ticket      Confirmed ticket.
+ */
+void mq_confirmed(MessageQueue *mq, uint64_t ticket) {
+    if (ticket <= mq->confirmed)
+        return;
+
+    if (ticket != mq->confirmed + 1) {
+        if (mq->nearly == mq->early_capacity) {
+            size_t    capacity = mq->early_capacity ? mq->early_capacity * 2 : 64;
+            uint64_t *early    = realloc(mq->early, capacity * sizeof(uint64_t));
+            if (!early) {
+                error("Unable to track confirm of ticket %" PRIu64, ticket);
+                return;
+            }
+            mq->early          = early;
+            mq->early_capacity = capacity;
+        }
+        size_t i = mq->nearly++;                     // sift up
+        while (i && mq->early[(i - 1) / 2] > ticket) {
+            mq->early[i] = mq->early[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        mq->early[i] = ticket;
+        return;
+    }
+
+    mq->confirmed = ticket;
+    while (mq->nearly && mq->early[0] <= mq->confirmed + 1) {
+        if (mq->early[0] == mq->confirmed + 1)
+            mq->confirmed++;
+
+        uint64_t last = mq->early[--mq->nearly];     // pop root, sift down
+        size_t   i    = 0;
+        for (size_t child; (child = 2 * i + 1) < mq->nearly; i = child) {
+            if (child + 1 < mq->nearly && mq->early[child + 1] < mq->early[child])
+                child++;
+            if (mq->early[child] >= last)
+                break;
+            mq->early[i] = mq->early[child];
+        }
+        if (mq->nearly)
+            mq->early[i] = last;
+    }
+}
+
+/**
+ * Read status line and headers of one HTTP response from server.
+ * @param   fs          Socket file stream.
+ * @param   r           Request to store message attributes in (NULL to
+ *                      discard).
+ * @param   keepalive   Whether or not the connection can be reused.
+ * @param   length      Where to store Content-Length (-1 if there is none).
+ * @return  HTTP status code (-1 if the connection failed).
+ */
+int mq_headers(FILE *fs, Request *r, bool *keepalive, long *length) {
+    char buffer[BUFSIZ];
+    int  status = -1;
+
+    *keepalive = false;
+    *length    = -1;
+
+    if (!fgets(buffer, BUFSIZ, fs) || sscanf(buffer, "HTTP/%*d.%*d %d", &status) != 1)
+        return -1;
+
+    while (fgets(buffer, BUFSIZ, fs)) {
+        if (streq(buffer, "\r\n"))
+            return status;
+        if (strncasecmp(buffer, "Content-Length:", 15) == 0)
+            *length = strtol(buffer + 15, NULL, 10);
+        else if (strncasecmp(buffer, "Connection:", 11) == 0)
+            *keepalive = strncasecmp(buffer + 11 + strspn(buffer + 11, " \t"), "keep-alive", 10) == 0;
+        else if (r && strncasecmp(buffer, "X-Priority:", 11) == 0)
+            r->priority = atoi(buffer + 11);
+        else if (r && strncasecmp(buffer, "X-Sequence:", 11) == 0)
+            r->id = strtoull(buffer + 11, NULL, 10);
+        else if (r && strncasecmp(buffer, "X-Topic:", 8) == 0 && !r->topic) {
+            char *value = buffer + 8 + strspn(buffer + 8, " \t");
+            r->topic = mq_unquote(value, strcspn(value, "\r\n"));
+        }
+    }
+    return -1;
+}
+
+/**
+ * Read one HTTP response from server.
+ * @param   fs          Socket file stream.
+ * @param   r           Request to store newly allocated body and message
+ *                      attributes in (NULL to discard).
+ * @param   keepalive   Whether or not the connection can be reused.
+ * @return  HTTP status code (-1 if the connection failed).
+ */
+int mq_response(FILE *fs, Request *r, bool *keepalive) {
+    char buffer[BUFSIZ];
+    long length;
+    char **body = r ? &r->body : NULL;
+
+    int status = mq_headers(fs, r, keepalive, &length);
+    if (status < 0)
+        return -1;
+
+    // Without a length, the body is whatever arrives before the server closes
+    if (length < 0)
+        *keepalive = false;
+
+    char  *data = NULL;
+    size_t size = 0;
+    while (length < 0 || size < (size_t)length) {
+        size_t want = (length < 0) ? BUFSIZ : (size_t)length - size;
+        if (body) {
+            char *resized = realloc(data, size + want + 1);
+            if (!resized)
+                break;
+            data = resized;
+        }
+        size_t n = fread(body ? data + size : buffer, 1, (body || want < BUFSIZ) ? want : BUFSIZ, fs);
+        if (n == 0)
+            break;
+        size += n;
+    }
+
+    if (length >= 0 && size < (size_t)length) {
+        free(data);
+        return -1;
+    }
+
+    if (body && data) {
+        data[size] = '\0';
+        *body = data;
+    }
+    return status;
+}
+
+/**
+ * Forget leases the servers have already given up on and check whether the
+ * prefetch window of one server is full (mq->lock must be held).
+ * @param   b           Broker structure of server.
+ * @param   deadline    Where to store the earliest deadline of its leases.
+ * @return  Whether or not prefetch leases of server are still held.
+ */
+bool mq_leases_full(MQBroker *b, struct timespec *deadline) {
+    MessageQueue *mq    = b->mq;
+    size_t        index = b - mq->brokers;
+    bool          found = false;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    for (size_t l = 0; l < mq->nleases; ) {
+        struct timespec *d = &mq->leases[l].deadline;
+        if (d->tv_sec < now.tv_sec || (d->tv_sec == now.tv_sec && d->tv_nsec <= now.tv_nsec)) {
+            mq->brokers[mq->leases[l].id % MQ_BROKERS_MAX].nleases--;
+            mq->leases[l] = mq->leases[--mq->nleases];
+            continue;
+        }
+        if (mq->leases[l].id % MQ_BROKERS_MAX == index && (!found || d->tv_sec < deadline->tv_sec ||
+            (d->tv_sec == deadline->tv_sec && d->tv_nsec < deadline->tv_nsec))) {
+            *deadline = *d;
+            found     = true;
+        }
+        l++;
+    }
+
+    return b->nleases >= mq->prefetch;
+}
+
+/**
+ * Parse frame header line:
+ *
+ *  $ID $LENGTH priority=$PRIORITY topic=$TOPIC\r\n
+ *
+ * @param   header      Frame header (ending in \r\n).
+ * @param   id          Where to store id of frame.
+ * @param   length      Where to store length of body that follows.
+ * @return  Newly allocated Request with message attributes (NULL if the
+ *          header is malformed).
+ */
+Request * mq_frame(const char *header, uint64_t *id, size_t *length) {
+    const char *eol = strstr(header, "\r\n");
+    if (!eol || sscanf(header, "%" SCNu64 " %zu", id, length) != 2)
+        return NULL;
+
+    Request *m = request_create(NULL, NULL, NULL);
+    if (!m)
+        return NULL;
+
+    const char *priority = strstr(header, " priority=");
+    if (priority && priority < eol)
+        m->priority = atoi(priority + 10);
+    const char *topic = strstr(header, " topic=");
+    if (topic && topic < eol)
+        m->topic = mq_unquote(topic + 7, strcspn(topic + 7, " \r"));
+    return m;
+}
+
+/**
+ * Read leased messages that make up length bytes of response from stream as
+ * incoming Requests:
+ *
+ *  $ID $LENGTH priority=$PRIORITY\r\n
+ *  $BODY
+ *
+ * Frames are taken off the stream one at a time (see mq_body), so the batch
+ * is never held in memory whole.  Lease ids are made unique across servers
+ * by folding in the server's index (id * MQ_BROKERS_MAX + index), so
+ * acknowledgements find their way back.
+ * @param   b           Broker structure of server that sent the frames.
+ * @param   fs          Socket file stream positioned at first frame.
+ * @param   length      Bytes of frames.
+ * @return  Whether or not every frame was read (false leaves the stream
+ *          unusable).
+ */
+bool mq_frames(MQBroker *b, FILE *fs, size_t length) {
+    MessageQueue *mq = b->mq;
+    char header[BUFSIZ];
+
+    while (length > 0) {
+        if (!fgets(header, sizeof(header), fs))
+            return false;
+
+        uint64_t id;
+        size_t   size;
+        size_t   used = strlen(header);
+        Request *m    = mq_frame(header, &id, &size);
+        if (!m || used + size > length) {
+            error("Malformed message frame from server");
+            if (m)
+                request_delete(m);
+            return false;
+        }
+        if (!mq_body(m, fs, size)) {
+            request_delete(m);
+            return false;
+        }
+        length -= used + size;
+
+        m->id = id * MQ_BROKERS_MAX + (b - mq->brokers);
+
+        mutex_lock(&mq->lock);                            // hold slot before it can be acked
+        if (b->nleases < mq->prefetch) {
+            MQLease *lease = &mq->leases[mq->nleases++];
+            b->nleases++;
+            clock_gettime(CLOCK_REALTIME, &lease->deadline);
+            lease->id                = m->id;
+            lease->deadline.tv_sec  += mq->lease / 1000;
+            lease->deadline.tv_nsec += (mq->lease % 1000) * 1000000;
+            if (lease->deadline.tv_nsec >= 1000000000) {
+                lease->deadline.tv_sec  += 1;
+                lease->deadline.tv_nsec -= 1000000000;
+            }
+        }
+        mutex_unlock(&mq->lock);
+        mq_deliver(mq, m);
+    }
+    return true;
+}
+
+/**
+ * Read body of message from stream, into a temporary file if it is at least
+ * MQ_SPOOL_MIN bytes (so large bodies are never held in memory).
+ * @param   m           Request to store body in.
+ * @param   fs          Socket file stream positioned at body.
+ * @param   size        Bytes of body.
+ * @return  Whether or not the whole body was read.
+ */
+bool mq_body(Request *m, FILE *fs, size_t size) {
+    if (size >= MQ_SPOOL_MIN)
+        return request_spool(m, fs, size);
+
+    if (!(m->body = malloc(size + 1)) || fread(m->body, 1, size, fs) != size)
+        return false;
+    m->body[size] = '\0';
+    return true;
+}
+
+/**
+ * Discard body of response.
+ * @param   fs          Socket file stream positioned at body.
+ * @param   length      Bytes of body (-1 for everything up to end of stream).
+ * @return  Whether or not all of it was there.
+ */
+bool mq_skip(FILE *fs, long length) {
+    char buffer[BUFSIZ];
+    while (length != 0) {
+        size_t want = (length < 0 || length > BUFSIZ) ? BUFSIZ : (size_t)length;
+        size_t n    = fread(buffer, 1, want, fs);
+        if (n == 0)
+            return length < 0;
+        if (length > 0)
+            length -= n;
+    }
+    return true;
+}
+
+/**
+ * Pusher thread takes messages from outgoing queue and sends them to server.
+ *
+ * Up to mq->window requests are kept in flight on one persistent connection
+ * (HTTP pipelining).  Responses arrive in request order, so each one is
+ * matched with the oldest request still in flight.  If the connection is
+ * lost, every unanswered request is sent again on a new connection.
+ * Statuses of confirmed publishes are collected and reported together once
+ * a window's worth has arrived or nothing is left in flight.  The pusher
+ * exits once mq_stop closed the outgoing queue and it is drained, or drops
+ * what it has if mq_stop gives up draining.
+ * @param   arg     Broker structure of server.
+ **/
+
+void * mq_pusher(void *arg) {
+    MQBroker     *b  = (MQBroker *) arg;                  // set arg
+    MessageQueue *mq = b->mq;
+    int           slot = __atomic_fetch_add(&b->slots, 1, __ATOMIC_RELAXED);
+
+    Request *head     = NULL;                             // requests in flight
+    Request *tail     = NULL;
+    size_t   inflight = 0;
+    bool     stopping = false;
+    FILE    *fs       = NULL;                             // responses from server
+    FILE    *out      = NULL;                             // requests to server
+
+    MQConfirm  one;                                       // confirms not yet reported
+    MQConfirm *confirms  = calloc(mq->window, sizeof(MQConfirm));
+    size_t     batch     = confirms ? mq->window : 1;
+    size_t     nconfirms = 0;
+    if (!confirms)
+        confirms = &one;
+
+    while ((!stopping || inflight) && !mq_aborted(mq)) {
+        // Fill window (only block when nothing is awaiting a response)
+        while (!stopping && inflight < mq->window) {
+            Request *r = inflight ? queue_trypop(b->outgoing) : queue_pop(b->outgoing);
+            if (!r) {
+                stopping = !inflight;                     // closed by mq_stop
+                break;
+            }
+            if (mq->prefetch) {                           // stop mq_ack appending
+                mutex_lock(&mq->lock);
+                if (b->ack == r)
+                    b->ack = NULL;
+                mutex_unlock(&mq->lock);
+            }
+
+            r->next = NULL;
+            if (tail)
+                tail->next = r;
+            else
+                head = r;
+            tail = r;
+            inflight++;
+
+            if (out)
+                request_write(r, out);                    // write request to server
+        }
+
+        if (!inflight)
+            continue;
+
+        if (!fs) {
+            if (!(fs = mq_connect(mq, b, &out, slot)))    // connect to server
+                continue;
+            for (Request *r = head; r; r = r->next)
+                request_write(r, out);
+        }
+        fflush(out);
+
+        // Match oldest request in flight with next response
+        bool keepalive;
+        int  status = mq_response(fs, NULL, &keepalive);
+        if (status < 0) {
+            if (!mq_aborted(mq))
+                breaker_failure(&b->breaker);
+            mq_disconnect(mq, b, slot, fs, out);
+            fs = out = NULL;
+            continue;
+        }
+        mq_reached(b);
+
+        Request *r = head;
+        head = r->next;
+        if (!head)
+            tail = NULL;
+        inflight--;
+        if (r->id) {
+            confirms[nconfirms].ticket = r->id;
+            confirms[nconfirms].status = status;
+            nconfirms++;
+        }
+        request_delete(r);
+
+        if (nconfirms && (nconfirms == batch || !inflight)) {
+            mq_confirm(mq, confirms, nconfirms);
+            nconfirms = 0;
+        }
+
+        if (!keepalive) {
+            mq_disconnect(mq, b, slot, fs, out);
+            fs = out = NULL;
+        }
+    }
+
+    if (fs)
+        mq_disconnect(mq, b, slot, fs, out);
+    if (nconfirms)
+        mq_confirm(mq, confirms, nconfirms);
+    if (confirms != &one)
+        free(confirms);
+    mq_drop(mq, head);                                    // given up by mq_stop
+    mq_exited(mq, &mq->nsending);
+    return NULL;
+}
+
+/**
+ * Sender thread sends publishes with bodies in files (see mq_publish_fd) to
+ * server, one at a time on a connection of its own.  Each body is large
+ * enough that pipelining would gain nothing, and keeping them off the
+ * pushers' connections keeps small publishes from waiting behind them.  A
+ * publish is sent again (from the start of its file) if the connection is
+ * lost before its response arrives.  Like the pushers, it drains the queue
+ * when stopping unless mq_stop gives up (the publish is confirmed with
+ * status -1 then).
+ * @param   arg     Broker structure of server.
+ **/
+void * mq_sender(void *arg) {
+    MQBroker     *b  = (MQBroker *)arg;
+    MessageQueue *mq = b->mq;
+    FILE         *fs = NULL;
+    Request      *r;
+
+    while ((r = queue_pop(b->bulk))) {
+        int status = -1;
+        while (status < 0 && !mq_aborted(mq)) {
+            if (!fs && !(fs = mq_connect(mq, b, NULL, MQ_SLOT_SENDER)))  // connect to server
+                continue;
+            request_write(r, fs);
+            fflush(fs);
+
+            bool keepalive;
+            status = mq_response(fs, NULL, &keepalive);
+            if (status >= 0)
+                mq_reached(b);
+            else if (!mq_aborted(mq))
+                breaker_failure(&b->breaker);
+            if (status < 0 || !keepalive) {
+                mq_disconnect(mq, b, MQ_SLOT_SENDER, fs, NULL);
+                fs = NULL;
+            }
+        }
+
+        MQConfirm confirm = { r->id, status };
+        request_delete(r);
+        mq_confirm(mq, &confirm, 1);
+    }
+
+    if (fs)
+        mq_disconnect(mq, b, MQ_SLOT_SENDER, fs, NULL);
+    mq_exited(mq, &mq->nsending);
+    return NULL;
+}
+
+/**
+ * Puller thread requests new messages from server and then puts them in
+ * incoming queue.
+ * @param   arg     Broker structure of server.
+ **/
+
+// Done
+void * mq_puller(void *arg) {
+    MQBroker     *b  = (MQBroker *)arg;
+    MessageQueue *mq = b->mq;
+
+    char uri[BUFSIZ];
+    char member[NI_MAXHOST + 32] = "";
+    if (*mq->group)
+        sprintf(member, "member=%s", mq->member);
+    sprintf(uri, "/queue/%s%s%s", mq_queue(mq), *member ? "?" : "", member);
+
+    // Without acknowledgements, the server pushes messages on one connection
+    if (!mq->prefetch) {
+        mq_stream(b, member);
+        return NULL;
+    }
+
+    FILE *fs = NULL;
+    while (!mq_shutdown(mq)){
+        if (mq->prefetch) {                               // wait for window to open
+            struct timespec deadline;
+            mutex_lock(&mq->lock);
+            while (mq_leases_full(b, &deadline) && !mq_shutdown(mq))
+                cond_timedwait(&mq->acked, &mq->lock, &deadline);
+            size_t want = mq->prefetch - b->nleases;
+            mutex_unlock(&mq->lock);
+
+            if (!want)
+                continue;
+            sprintf(uri, "/queue/%s?prefetch=%zu&lease=%lu.%03lu%s%s",
+                mq_queue(mq), want, mq->lease / 1000, mq->lease % 1000, *member ? "&" : "", member);
+        }
+
+        if (!fs) {
+            if (!(fs = mq_connect(mq, b, NULL, MQ_SLOT_PULLER)))      // connect to server
+                continue;
+            if (!mq_declare(b, fs)) {
+                if (!mq_shutdown(mq))
+                    breaker_failure(&b->breaker);
+                mq_disconnect(mq, b, MQ_SLOT_PULLER, fs, NULL);
+                fs = NULL;
+                continue;
+            }
+            mq_reached(b);
+        }
+
+        Request *r = mq_request("GET", uri, NULL);        // make empty request
+        request_write(r, fs);
+        fflush(fs);
+        request_delete(r);
+
+        // Frames are read off the connection as they come
+        bool keepalive;
+        long length;
+        int  status = mq_headers(fs, NULL, &keepalive, &length);
+        if (status == 200 && length >= 0) {
+            if (!mq_frames(b, fs, length))
+                status = -1;
+        } else if (status >= 0 && !mq_skip(fs, length)) {
+            status = -1;
+        }
+
+        // A server too busy to lease is backed off from like a lost one, and
+        // one that lost our queue (404) gets it declared on a new connection
+        if ((status < 0 || status >= 500) && !mq_shutdown(mq))
+            breaker_failure(&b->breaker);
+        if (status < 0 || status >= 500 || status == 404 || !keepalive || length < 0) {
+            mq_disconnect(mq, b, MQ_SLOT_PULLER, fs, NULL);
+            fs = NULL;
+        }
+    }
+
+    if (fs)
+        mq_disconnect(mq, b, MQ_SLOT_PULLER, fs, NULL);
+    return NULL;
+}
+
+/**
+ * Receive messages the server pushes on GET /stream/$queue until shutdown.
+ * The server numbers the frames it sends, so after a dropped connection the
+ * stream is reopened with the last number received as its resume point and
+ * the server sends again whatever was lost in between.
+ * @param   b           Broker structure of server.
+ * @param   member      Query string naming group member (empty if none).
+ **/
+void mq_stream(MQBroker *b, const char *member) {
+    MessageQueue *mq = b->mq;
+    uint64_t resume  = 0;
+    bool     resumed = false;                             // resume point known
+
+    while (!mq_shutdown(mq)) {
+        FILE *fs = mq_connect(mq, b, NULL, MQ_SLOT_PULLER);   // connect to server
+        if (!fs)
+            continue;
+
+        if (!mq_declare(b, fs)) {
+            if (!mq_shutdown(mq))
+                breaker_failure(&b->breaker);
+            mq_disconnect(mq, b, MQ_SLOT_PULLER, fs, NULL);
+            continue;
+        }
+
+        char uri[BUFSIZ];
+        char point[64] = "";
+        if (resumed)
+            sprintf(point, "resume=%" PRIu64, resume);
+        sprintf(uri, "/stream/%s%s%s%s%s", mq_queue(mq), (*point || *member) ? "?" : "",
+            point, (*point && *member) ? "&" : "", member);
+
+        // The server ends the stream by closing, so no keep-alive
+        Request *r = request_create("GET", uri, NULL);
+        request_write(r, fs);
+        fflush(fs);
+
+        bool keepalive;
+        long length;
+        int  status = mq_headers(fs, r, &keepalive, &length);
+        if (status == 200)
+            mq_reached(b);
+        if (status == 200 && !resumed) {
+            resume  = r->id;
+            resumed = true;
+        }
+        request_delete(r);
+
+        char header[BUFSIZ];
+        while (status == 200 && fgets(header, sizeof(header), fs)) {
+            uint64_t sequence;
+            size_t   size;
+            Request *m = mq_frame(header, &sequence, &size);
+            if (!m || !mq_body(m, fs, size)) {
+                if (m)
+                    request_delete(m);
+                break;
+            }
+            resume = sequence;
+            mq_deliver(mq, m);
+
+            if (mq_shutdown(mq))
+                break;
+        }
+
+        if (!mq_shutdown(mq))                 // connection lost or stream refused
+            breaker_failure(&b->breaker);
+        mq_disconnect(mq, b, MQ_SLOT_PULLER, fs, NULL);
+    }
+}
+
+/**
+ * Create our queue on server by subscribing to the sentinel (groups only
+ * create the queue).  The puller sends this on each new connection of its
+ * own ahead of its reads, so the queue exists by the time they arrive (even
+ * if the server restarted without it), and the response comes at once,
+ * unlike that of a read waiting for messages.
+ * @param   b           Broker structure of server.
+ * @param   fs          Connection of puller.
+ * @return  Whether the queue was created and the connection can be reused.
+ **/
+bool mq_declare(MQBroker *b, FILE *fs) {
+    MessageQueue *mq = b->mq;
+
+    char uri[BUFSIZ];
+    if (*mq->group)
+        sprintf(uri, "/queue/%s", mq->group);
+    else
+        sprintf(uri, "/subscription/%s/%s", mq->name, SENTINEL);
+
+    Request *r = mq_request("PUT", uri, NULL);
+    request_write(r, fs);
+    fflush(fs);
+    request_delete(r);
+
+    bool keepalive;
+    long length;
+    int  status = mq_headers(fs, NULL, &keepalive, &length);
+    return status >= 200 && status < 300 && mq_skip(fs, length) && keepalive && length >= 0;
+}
+
+/**
+ * Receive confirms and messages from the shared memory session of server
+ * until shutdown, and then until the publishes sent through it are all
+ * confirmed (unless mq_stop gives up draining, which reports the rest
+ * lost).  Should the server go away, the publishes it never confirmed are
+ * reported lost and messages are received over HTTP again.
+ * @param   arg         Broker structure of server.
+ **/
+void * mq_reader(void *arg) {
+    MQBroker     *b       = (MQBroker *)arg;
+    MessageQueue *mq      = b->mq;
+    bool          deliver = !mq->prefetch;            // messages come this way
+
+    MQConfirm  one;
+    MQConfirm *confirms  = calloc(mq->window, sizeof(MQConfirm));
+    size_t     batch     = confirms ? mq->window : 1;
+    size_t     nconfirms = 0;
+    if (!confirms)
+        confirms = &one;
+
+    int op;
+    for (;;) {
+        Request *m = NULL;
+        uint64_t ticket;
+        int      status;
+        op = shm_receive(b->shm, &m, &ticket, &status);
+
+        if (op == SHM_DELIVER) {
+            mq_deliver(mq, m);
+            continue;
+        }
+        if (op == SHM_CONFIRM) {
+            confirms[nconfirms].ticket = ticket;
+            confirms[nconfirms].status = status;
+            if (++nconfirms == batch) {
+                mq_confirm(mq, confirms, nconfirms);
+                nconfirms = 0;
+            }
+            continue;
+        }
+
+        if (nconfirms) {
+            mq_confirm(mq, confirms, nconfirms);
+            nconfirms = 0;
+        }
+        if (op == SHM_CLOSED) {
+            error("Shared memory with %s:%s closed, using TCP", b->host, b->port);
+            break;
+        }
+        if (mq_shutdown(mq) && (mq_aborted(mq) || !shm_pending(b->shm)))
+            break;
+    }
+
+    uint64_t *lost;
+    size_t    nlost = shm_lost(b->shm, &lost);
+    for (size_t i = 0; i < nlost; i++) {
+        confirms[nconfirms].ticket = lost[i];
+        confirms[nconfirms].status = -1;
+        if (++nconfirms == batch || i + 1 == nlost) {
+            mq_confirm(mq, confirms, nconfirms);
+            nconfirms = 0;
+        }
+    }
+    free(lost);
+
+    if (op == SHM_CLOSED && deliver && !mq_shutdown(mq)) {
+        char member[NI_MAXHOST + 32] = "";
+        if (*mq->group)
+            sprintf(member, "member=%s", mq->member);
+        mq_stream(b, member);
     }
 
+    if (confirms != &one)
+        free(confirms);
+    mq_exited(mq, &mq->nreading);
     return NULL;
 }
 
@@ -0,0 +1,301 @@
+/* dispatch.c: Work-stealing dispatch pool with per-key ordering */
+
+#include "mq/dispatch.h"
+#include "mq/ring.h"
+#include "mq/string.h"
+
+/* Internal Constants */
+
+#define DEQUE_CAPACITY  16      // Initial strands per deque (power of two)
+
+/* Internal Variables */
+
+static __thread DispatchWorker *Self = NULL;    // Worker of calling thread
+
+/* Deque */
+
+static bool deque_init(Deque *q) {
+    q->items    = calloc(DEQUE_CAPACITY, sizeof(Strand *));
+    q->capacity = DEQUE_CAPACITY;
+    q->top      = 0;
+    q->bottom   = 0;
+    mutex_init(&q->lock, NULL);
+    return q->items != NULL;
+}
+
+/**
+ * Make room for capacity strands (a strand is in at most one deque at a
+ * time, so pushes never need to grow a deque).
+ */
+static bool deque_reserve(Deque *q, size_t capacity) {
+    mutex_lock(&q->lock);
+    if (capacity > q->capacity) {
+        size_t   resized = q->capacity;
+        while (resized < capacity)
+            resized *= 2;
+
+        Strand **items = calloc(resized, sizeof(Strand *));
+        if (!items) {
+            mutex_unlock(&q->lock);
+            return false;
+        }
+        for (size_t i = q->top; i < q->bottom; i++)
+            items[i & (resized - 1)] = q->items[i & (q->capacity - 1)];
+
+        free(q->items);
+        q->items    = items;
+        q->capacity = resized;
+    }
+    mutex_unlock(&q->lock);
+    return true;
+}
+
+static void deque_push(Deque *q, Strand *s) {
+    mutex_lock(&q->lock);
+    q->items[q->bottom++ & (q->capacity - 1)] = s;
+    mutex_unlock(&q->lock);
+}
+
+static Strand * deque_pop(Deque *q) {
+    Strand *s = NULL;
+    mutex_lock(&q->lock);
+    if (q->bottom != q->top)
+        s = q->items[--q->bottom & (q->capacity - 1)];
+    mutex_unlock(&q->lock);
+    return s;
+}
+
+static Strand * deque_steal(Deque *q) {
+    Strand *s = NULL;
+    mutex_lock(&q->lock);
+    if (q->bottom != q->top)
+        s = q->items[q->top++ & (q->capacity - 1)];
+    mutex_unlock(&q->lock);
+    return s;
+}
+
+/* Scheduling */
+
+/**
+ * Put strand in a deque: the calling worker's own, or the next one in turn
+ * when called from outside the pool.  It is pushed and counted as ready
+ * under d->lock, so a worker that steals it (and decrements ready under the
+ * same lock) cannot do so before the count includes it.
+ */
+static void dispatcher_schedule(Dispatcher *d, Strand *s) {
+    DispatchWorker *w = (Self && Self->dispatcher == d) ? Self : NULL;
+
+    mutex_lock(&d->lock);
+    if (!w)
+        w = &d->workers[d->next++ % d->nworkers];
+    deque_push(&w->deque, s);
+    d->ready++;
+    cond_signal(&d->wake);
+    mutex_unlock(&d->lock);
+}
+
+/**
+ * Handle every Request the strand holds, in order, then either release the
+ * strand or, if more arrived meanwhile, schedule it again.
+ */
+static void strand_run(Dispatcher *d, Strand *s) {
+    mutex_lock(&s->lock);
+    Request *       r       = s->head;
+    DispatchHandler handler = s->handler;
+    void *          ctx     = s->ctx;
+    s->head = s->tail = NULL;
+    mutex_unlock(&s->lock);
+
+    while (r) {
+        Request *next = r->next;
+        r->next = NULL;
+        handler(r, ctx);
+        r = next;
+    }
+
+    mutex_lock(&s->lock);
+    bool more = (s->head != NULL);
+    s->scheduled = more;
+    mutex_unlock(&s->lock);
+
+    if (more)
+        dispatcher_schedule(d, s);
+}
+
+static void * dispatcher_worker(void *arg) {
+    DispatchWorker *w     = (DispatchWorker *)arg;
+    Dispatcher     *d     = w->dispatcher;
+    size_t          index = w - d->workers;
+
+    Self = w;
+    while (true) {
+        Strand *s = deque_pop(&w->deque);
+        for (size_t i = 1; !s && i < d->nworkers; i++)   // steal oldest from others
+            s = deque_steal(&d->workers[(index + i) % d->nworkers].deque);
+
+        mutex_lock(&d->lock);
+        if (s) {
+            d->ready--;
+            mutex_unlock(&d->lock);
+            strand_run(d, s);
+            continue;
+        }
+
+        while (!d->ready && !d->stopping)
+            cond_wait(&d->wake, &d->lock);
+        bool done = !d->ready && d->stopping;
+        mutex_unlock(&d->lock);
+
+        if (done)
+            break;
+    }
+
+    return NULL;
+}
+
+static Strand * dispatcher_strand(Dispatcher *d, const char *key) {
+    Strand *s = __atomic_load_n(&d->strands[ring_hash(key) & (DISPATCH_BUCKETS - 1)], __ATOMIC_ACQUIRE);
+    while (s && !streq(s->key, key))
+        s = s->next;
+    return s;
+}
+
+/* External Functions */
+
+/**
+ * Create dispatch pool.
+ * @param   workers     Number of worker threads (1 to DISPATCH_WORKERS_MAX).
+ * @return  Newly allocated Dispatcher structure.
+ */
+Dispatcher * dispatcher_create(size_t workers) {
+    Dispatcher *d = calloc(1, sizeof(Dispatcher));
+    if (!d)
+        return NULL;
+
+    workers = workers < 1 ? 1 : (workers > DISPATCH_WORKERS_MAX ? DISPATCH_WORKERS_MAX : workers);
+    mutex_init(&d->lock, NULL);
+    cond_init(&d->wake, NULL);
+
+    for (size_t i = 0; i < workers; i++) {
+        d->workers[i].dispatcher = d;
+        if (!deque_init(&d->workers[i].deque)) {
+            d->nworkers = i + 1;
+            dispatcher_delete(d);
+            return NULL;
+        }
+    }
+
+    d->nworkers = workers;
+    for (size_t i = 0; i < workers; i++)
+        thread_create(&d->workers[i].thread, NULL, dispatcher_worker, &d->workers[i]);
+    return d;
+}
+
+/**
+ * Delete dispatch pool, first waiting for every submitted Request to be
+ * handled.
+ * @param   d           Dispatcher structure.
+ */
+void dispatcher_delete(Dispatcher *d) {
+    if (!d)
+        return;
+
+    mutex_lock(&d->lock);
+    d->stopping = true;
+    cond_broadcast(&d->wake);
+    mutex_unlock(&d->lock);
+
+    for (size_t i = 0; i < d->nworkers; i++) {
+        if (d->workers[i].thread)
+            thread_join(d->workers[i].thread, NULL);
+        free(d->workers[i].deque.items);
+    }
+
+    for (size_t b = 0; b < DISPATCH_BUCKETS; b++) {
+        for (Strand *s = d->strands[b], *next; s; s = next) {
+            next = s->next;
+            free(s->key);
+            free(s);
+        }
+    }
+    free(d);
+}
+
+/**
+ * Register handler for Requests submitted with key (replacing any earlier
+ * one).  Requests of one key are handled in submission order, one at a
+ * time; Requests of different keys are handled in parallel.
+ * @param   d           Dispatcher structure.
+ * @param   key         Key (topic) to handle.
+ * @param   handler     Function called with each Request (which it owns).
+ * @param   ctx         Passed to handler.
+ * @return  Whether or not the handler was registered.
+ */
+bool dispatcher_register(Dispatcher *d, const char *key, DispatchHandler handler, void *ctx) {
+    mutex_lock(&d->lock);
+    Strand *s = dispatcher_strand(d, key);
+    if (s) {
+        mutex_unlock(&d->lock);
+        mutex_lock(&s->lock);
+        s->handler = handler;
+        s->ctx     = ctx;
+        mutex_unlock(&s->lock);
+        return true;
+    }
+
+    for (size_t i = 0; i < d->nworkers; i++) {
+        if (!deque_reserve(&d->workers[i].deque, d->nstrands + 1)) {
+            mutex_unlock(&d->lock);
+            return false;
+        }
+    }
+
+    s = calloc(1, sizeof(Strand));
+    if (!s || !(s->key = strdup(key))) {
+        free(s);
+        mutex_unlock(&d->lock);
+        return false;
+    }
+    s->handler = handler;
+    s->ctx     = ctx;
+    mutex_init(&s->lock, NULL);
+
+    // Lookups do not lock, so publish the strand only once it is complete
+    Strand **bucket = &d->strands[ring_hash(key) & (DISPATCH_BUCKETS - 1)];
+    s->next = *bucket;
+    __atomic_store_n(bucket, s, __ATOMIC_RELEASE);
+    d->nstrands++;
+    mutex_unlock(&d->lock);
+    return true;
+}
+
+/**
+ * Submit Request to the handler registered for key.
+ * @param   d           Dispatcher structure.
+ * @param   key         Key (topic) of Request.
+ * @param   r           Request (owned by the handler if submitted).
+ * @return  Whether or not a handler was registered for key.
+ */
+bool dispatcher_submit(Dispatcher *d, const char *key, Request *r) {
+    Strand *s = dispatcher_strand(d, key);
+    if (!s)
+        return false;
+
+    r->next = NULL;
+    mutex_lock(&s->lock);
+    if (s->tail)
+        s->tail->next = r;
+    else
+        s->head = r;
+    s->tail = r;
+
+    bool idle = !s->scheduled;
+    s->scheduled = true;
+    mutex_unlock(&s->lock);
+
+    if (idle)
+        dispatcher_schedule(d, s);
+    return true;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
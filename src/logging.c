@@ -0,0 +1,280 @@
+/* logging.c: Asynchronous logging */
+
+#include "mq/logging.h"
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Internal Constants */
+
+#define LOG_RING_SIZE       256         /* Entries per thread (power of two) */
+#define LOG_ENTRY_SIZE      256         /* Bytes per entry */
+#define LOG_IDLE_MIN        1000000     /* Writer idle sleep (ns) */
+#define LOG_IDLE_MAX        16000000    /* Writer idle sleep upper bound (ns) */
+
+/* Internal Structures */
+
+typedef struct LogEntry LogEntry;
+struct LogEntry {
+    uint64_t    timestamp;              // Wall clock time (ns)
+    int         level;                  // Message level
+    char        text[LOG_ENTRY_SIZE - sizeof(uint64_t) - sizeof(int)];
+};
+
+/* Single producer (owning thread), single consumer (writer) ring */
+typedef struct LogRing LogRing;
+struct LogRing {
+    LogEntry    entries[LOG_RING_SIZE];
+    uint64_t    head;                   // Next entry to write (producer)
+    uint64_t    tail;                   // Next entry to read (consumer)
+    uint64_t    dropped;                // Entries dropped because ring was full
+    uint64_t    reported;               // Dropped entries already reported
+    pthread_t   thread;                 // Owning thread
+    int         dead;                   // Whether owning thread has exited
+    LogRing *   next;
+};
+
+/* Internal Variables */
+
+static LogRing *        Rings   = NULL;         // Registered rings (push only at head)
+static __thread LogRing *Ring   = NULL;         // Ring of calling thread
+static pthread_key_t    RingKey;                // Marks ring dead at thread exit
+static pthread_once_t   Once    = PTHREAD_ONCE_INIT;
+static pthread_mutex_t  Drain   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t        Writer;
+static int              Stopped = 0;            // Writer stopped (log synchronously)
+
+static const char *     LEVELS[] = { "DEBUG", "INFO ", "ERROR" };
+
+/* Internal Functions */
+
+static uint64_t log_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t log_format(char *buffer, size_t size, pthread_t thread, uint64_t timestamp, int level, const char *text) {
+    int n = snprintf(buffer, size, "%lu.%06lu [%09lu] %s %s\n",
+        (unsigned long)(timestamp / 1000000000ULL),
+        (unsigned long)(timestamp % 1000000000ULL / 1000),
+        thread, LEVELS[level], text);
+    return (n < 0) ? 0 : ((size_t)n < size ? (size_t)n : size - 1);
+}
+
+static void log_output(const char *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(STDERR_FILENO, buffer, length);
+        if (n <= 0)
+            return;
+        buffer += n;
+        length -= n;
+    }
+}
+
+/**
+ * Move every pending entry from every ring to stderr (one write per batch).
+ * @return  Number of entries written.
+ */
+static size_t log_drain() {
+    char    buffer[BUFSIZ];
+    size_t  used    = 0;
+    size_t  entries = 0;
+
+    pthread_mutex_lock(&Drain);
+    LogRing *prev = NULL;
+    LogRing *ring = __atomic_load_n(&Rings, __ATOMIC_ACQUIRE);
+    while (ring) {
+        int      dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        for (uint64_t tail = ring->tail; tail < head; tail++, entries++) {
+            LogEntry *e = &ring->entries[tail & (LOG_RING_SIZE - 1)];
+            if (BUFSIZ - used < LOG_ENTRY_SIZE * 2) {
+                log_output(buffer, used);
+                used = 0;
+            }
+            used += log_format(buffer + used, BUFSIZ - used, ring->thread, e->timestamp, e->level, e->text);
+        }
+        __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+
+        uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->reported) {
+            char text[64];
+            snprintf(text, sizeof(text), "Dropped %lu log messages", (unsigned long)(dropped - ring->reported));
+            ring->reported = dropped;
+            if (BUFSIZ - used < LOG_ENTRY_SIZE * 2) {
+                log_output(buffer, used);
+                used = 0;
+            }
+            used += log_format(buffer + used, BUFSIZ - used, ring->thread, log_now(), LOG_LEVEL_ERROR, text);
+        }
+
+        /* Producers only ever replace the list head, so any other dead ring
+         * can be unlinked here without racing them. */
+        LogRing *next = ring->next;
+        if (dead && prev && __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == head) {
+            prev->next = next;
+            free(ring);
+        } else {
+            prev = ring;
+        }
+        ring = next;
+    }
+    pthread_mutex_unlock(&Drain);
+
+    log_output(buffer, used);
+    return entries;
+}
+
+static void * log_writer(void *arg) {
+    long idle = LOG_IDLE_MIN;
+
+    while (!__atomic_load_n(&Stopped, __ATOMIC_ACQUIRE)) {
+        if (log_drain()) {
+            idle = LOG_IDLE_MIN;
+            continue;
+        }
+
+        struct timespec ts = { 0, idle };
+        nanosleep(&ts, NULL);
+        idle = (idle * 2 > LOG_IDLE_MAX) ? LOG_IDLE_MAX : idle * 2;
+    }
+
+    return NULL;
+}
+
+static void log_release(void *arg) {
+    LogRing *ring = (LogRing *)arg;
+    __atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void log_shutdown() {
+    if (!__atomic_exchange_n(&Stopped, 1, __ATOMIC_ACQ_REL))
+        pthread_join(Writer, NULL);
+    log_drain();
+}
+
+static void log_init() {
+    pthread_key_create(&RingKey, log_release);
+    if (pthread_create(&Writer, NULL, log_writer, NULL) != 0) {
+        Stopped = 1;
+        return;
+    }
+    atexit(log_shutdown);
+}
+
+static LogRing * log_ring() {
+    if (Ring)
+        return __atomic_load_n(&Stopped, __ATOMIC_ACQUIRE) ? NULL : Ring;
+
+    pthread_once(&Once, log_init);
+    if (__atomic_load_n(&Stopped, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    LogRing *ring = calloc(1, sizeof(LogRing));
+    if (!ring)
+        return NULL;
+
+    ring->thread = pthread_self();
+    ring->next   = __atomic_load_n(&Rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&Rings, &ring->next, ring, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        continue;
+
+    pthread_setspecific(RingKey, ring);
+    return (Ring = ring);
+}
+
+/**
+ * Check per call site rate limit.
+ * @param   limit       Rate limit state of call site.
+ * @param   suppressed  Number of messages suppressed since last allowed one.
+ * @return  Whether or not message should be logged.
+ */
+static bool log_allow(LogLimit *limit, uint32_t *suppressed) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    uint64_t window = __atomic_load_n(&limit->window, __ATOMIC_RELAXED);
+    if (window != (uint64_t)ts.tv_sec &&
+        __atomic_compare_exchange_n(&limit->window, &window, ts.tv_sec, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&limit->count, 0, __ATOMIC_RELAXED);
+    }
+
+    if (__atomic_add_fetch(&limit->count, 1, __ATOMIC_RELAXED) > LOG_LIMIT_BURST) {
+        __atomic_add_fetch(&limit->suppressed, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    *suppressed = __atomic_exchange_n(&limit->suppressed, 0, __ATOMIC_RELAXED);
+    return true;
+}
+
+/* External Functions */
+
+/**
+ * Log message without blocking on terminal I/O: the message is formatted into
+ * the calling thread's ring and written to stderr by a background thread.
+ * Messages are dropped (and counted) if the ring is full.
+ * @param   level       Message level.
+ * @param   limit       Rate limit state of call site (NULL for unlimited).
+ * @param   file        Source file of call site.
+ * @param   line        Source line of call site.
+ * @param   func        Function of call site.
+ * @param   fmt         Message format string.
+ */
+void log_write(int level, LogLimit *limit, const char *file, int line, const char *func, const char *fmt, ...) {
+    uint32_t suppressed = 0;
+    if (limit && !log_allow(limit, &suppressed))
+        return;
+
+    LogRing *ring = log_ring();
+    LogEntry local;
+    LogEntry *e   = &local;
+    uint64_t head = 0;
+
+    if (ring) {
+        head = ring->head;
+        if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+            __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        e = &ring->entries[head & (LOG_RING_SIZE - 1)];
+    }
+
+    e->timestamp = log_now();
+    e->level     = level;
+
+    size_t  n = 0;
+    if (level == LOG_LEVEL_DEBUG) {
+        int w = snprintf(e->text, sizeof(e->text), "%s:%d:%s: ", file, line, func);
+        n = (w < 0) ? 0 : ((size_t)w < sizeof(e->text) ? (size_t)w : sizeof(e->text) - 1);
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    int w = vsnprintf(e->text + n, sizeof(e->text) - n, fmt, args);
+    va_end(args);
+    n += (w < 0) ? 0 : ((size_t)w < sizeof(e->text) - n ? (size_t)w : sizeof(e->text) - n - 1);
+
+    if (suppressed)
+        snprintf(e->text + n, sizeof(e->text) - n, " (suppressed %u repeats)", suppressed);
+
+    if (ring) {
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    } else {
+        char buffer[LOG_ENTRY_SIZE * 2];
+        log_output(buffer, log_format(buffer, sizeof(buffer), pthread_self(), e->timestamp, e->level, e->text));
+    }
+}
+
+/**
+ * Write every pending log message to stderr now.
+ */
+void log_flush() {
+    log_drain();
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -2,6 +2,42 @@
 
 #include "mq/queue.h"
 
+/* Internal Functions */
+
+/**
+ * Clamp request priority to a valid level.
+ * @param   r       Request structure.
+ * @return  Priority level of request.
+ */
+static int queue_level(Request *r) {
+    if (r->priority < 0)
+        return 0;
+    if (r->priority >= REQUEST_PRIORITIES)
+        return REQUEST_PRIORITIES - 1;
+    return r->priority;
+}
+
+/**
+ * Remove request from the front of the highest non-empty level (lock held).
+ * @param   q       Queue structure.
+ * @return  Request structure.
+ */
+static Request * queue_take(Queue *q) {
+    int         level = 31 - __builtin_clz(q->nonempty);
+    QueueLevel *l     = &q->levels[level];
+    Request    *pop   = l->head;
+
+    l->head = pop->next;
+    if (!l->head) {
+        l->tail = NULL;
+        q->nonempty &= ~(1u << level);
+    }
+    q->size--;
+    return pop;
+}
+
+/* External Functions */
+
 /**
  * Create queue structure.
  * @return  Newly allocated queue structure.
@@ -25,9 +61,11 @@ void queue_delete(Queue *q) {
     mutex_lock(&q->lock);
     Request *temp;
 
-    for (Request *r = q->head; r != NULL; r = temp){
-        temp = r->next;
-        request_delete(r);
+    for (int level = 0; level < REQUEST_PRIORITIES; level++){
+        for (Request *r = q->levels[level].head; r != NULL; r = temp){
+            temp = r->next;
+            request_delete(r);
+        }
     }
     
     mutex_unlock(&q->lock);
@@ -35,23 +73,38 @@ void queue_delete(Queue *q) {
 }
 
 /**
- * Push request to the back of queue.
+ * Close queue: whoever is blocked in queue_pop (or pops later) gets what is
+ * left and then NULL instead of waiting.  Requests may still be pushed.
+ * @param   q       Queue structure.
+ */
+void queue_close(Queue *q) {
+    mutex_lock(&q->lock);
+    q->closed = true;
+    cond_broadcast(&q->block);
+    mutex_unlock(&q->lock);
+}
+
+/**
+ * Push request to the back of its priority level.
  * @param   q       Queue structure.
  * @param   r       Request structure.
  */
 void queue_push(Queue *q, Request *r) {
     mutex_lock(&q->lock);
+    int         level = queue_level(r);
+    QueueLevel *l     = &q->levels[level];
     
     // Check if youre pushing the first element
-    if (q->size == 0){
-        q->head = r;
-        q->tail = r;
+    if (!l->head){
+        l->head = r;
+        l->tail = r;
+        q->nonempty |= 1u << level;
     }
 
     // If its not the first element...
     else{
-        q->tail->next = r;
-        q->tail = r;
+        l->tail->next = r;
+        l->tail = r;
     }
 
     // Standard for both cases
@@ -64,22 +117,21 @@ void queue_push(Queue *q, Request *r) {
 }
 
 /**
- * Pop request to the front of queue (block until there is something to return).
+ * Pop request from the front of the highest priority non-empty level (block
+ * until there is something to return or the queue is closed).
  * @param   q       Queue structure.
- * @return  Request structure.
+ * @return  Request structure (NULL once the queue is closed and empty).
  */
 
 // POP CAN BLOCK... check if the queue is empty
 Request * queue_pop(Queue *q) {
     // Block Pop :)
     mutex_lock(&q->lock);
-    while (q->size == 0)
+    while (q->size == 0 && !q->closed)
         cond_wait(&q->block, &q->lock);
 
     // Update Queue data
-    Request *pop = q->head;
-    q->head = q->head->next;
-    q->size--;
+    Request *pop = q->size ? queue_take(q) : NULL;
 
     // Unlock the lock yo
     //cond_signal(&q->block);
@@ -88,4 +140,16 @@ Request * queue_pop(Queue *q) {
     return pop;
 }
 
+/**
+ * Pop request from the front of queue (without blocking).
+ * @param   q       Queue structure.
+ * @return  Request structure (NULL if queue is empty).
+ */
+Request * queue_trypop(Queue *q) {
+    mutex_lock(&q->lock);
+    Request *pop = q->size ? queue_take(q) : NULL;
+    mutex_unlock(&q->lock);
+    return pop;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
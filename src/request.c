@@ -1,9 +1,93 @@
 /* request.c: Request structure */
 
+#define _GNU_SOURCE                         /* O_TMPFILE, splice */
+
 #include "mq/request.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Internal Functions */
+
+/**
+ * Create temporary file that disappears once closed.
+ * @return  Descriptor of file (-1 on failure).
+ */
+static int request_tmpfile() {
+    const char *directory = getenv("TMPDIR");
+    if (!directory || !*directory)
+        directory = P_tmpdir;
+
+    int fd = open(directory, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0)
+        return fd;
+
+    // File systems without O_TMPFILE get a named file unlinked at once
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/mq.XXXXXX", directory);
+    if ((fd = mkostemp(path, O_CLOEXEC)) >= 0)
+        unlink(path);
+    return fd;
+}
+
+/**
+ * Write whole buffer to file.
+ * @param   fd          File descriptor.
+ * @param   buffer      Data to write.
+ * @param   n           Bytes of data.
+ * @return  Whether or not all of it was written.
+ */
+static bool request_fill(int fd, const char *buffer, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, buffer, n);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return false;
+        buffer += w;
+        n      -= w;
+    }
+    return true;
+}
+
+/**
+ * Write body kept in file to stream.  The kernel copies it straight to
+ * the socket with sendfile, unless the stream has no descriptor (io_uring)
+ * or the file cannot be sent that way, in which case it is copied through
+ * a buffer.  Offsets are explicit, so a request can be sent again.
+ * @param   r           Request structure.
+ * @param   fs          Socket file stream.
+ */
+static void request_send(Request *r, FILE *fs) {
+    off_t   offset = r->offset;
+    size_t  left   = r->length;
+    int     sd     = fileno(fs);
+
+    if (sd >= 0 && fflush(fs) == 0) {
+        ssize_t n = 0;
+        while (left > 0 && (n = sendfile(sd, r->fd, &offset, left)) > 0)
+            left -= n;
+        if (!left || (n < 0 && errno != EINVAL && errno != ENOSYS))
+            return;                             // sent (or the connection failed)
+    }
+
+    char buffer[REQUEST_CHUNK];
+    while (left > 0) {
+        ssize_t n = pread(r->fd, buffer, left < sizeof(buffer) ? left : sizeof(buffer), offset);
+        if (n <= 0 || fwrite(buffer, 1, n, fs) != (size_t)n)
+            return;
+        offset += n;
+        left   -= n;
+    }
+}
+
+/* External Functions */
 
 /**
  * Create Request structure.
@@ -40,34 +124,202 @@ void request_delete(Request *r) {
     free(r->method);
     free(r->uri);
     free(r->body);
+    free(r->headers);
+    free(r->topic);
+    if (r->file)
+        close(r->fd);
     free(r);
 }
 
+/**
+ * Append header line to Request.
+ * @param   r           Request structure.
+ * @param   name        Header name string.
+ * @param   value       Header value string.
+ */
+void request_header(Request *r, const char *name, const char *value) {
+    size_t used    = r->headers ? strlen(r->headers) : 0;
+    size_t length  = strlen(name) + strlen(value) + 4;
+    char  *headers = realloc(r->headers, used + length + 1);
+    if (headers) {
+        sprintf(headers + used, "%s: %s\r\n", name, value);
+        r->headers = headers;
+    }
+}
+
 /**
  * Write HTTP Request to stream:
  *  
  *  $METHOD $URI HTTP/1.0\r\n
+ *  $HEADERS
  *  Content-Length: Length($BODY)\r\n
  *  \r\n
  *  $BODY
+ *
+ * $HEADERS is only written if the Request has extra headers.  Content-Length
+ * is written for every request with a body, and as 0 for bodyless requests
+ * other than GET (so the server can keep the connection alive).  A Request
+ * with a prefix has it written as is in place of the request line (and
+ * $HEADERS continue it).  A body kept in a file is sent from there.
  *      
  * @param   r           Request structure.
  * @param   fs          Socket file stream.
  */
 void request_write(Request *r, FILE *fs) {
-    int length = 0;
-   
-    if (r->body){
-        length = strlen(r->body);
+    if (r->prefix)
+        fputs(r->prefix, fs);
+    else
         fprintf(fs, "%s %s HTTP/1.0\r\n", r->method, r->uri);
-        fprintf(fs, "Content-Length: %d\r\n", length);
-        fprintf(fs, "\r\n");
-        fprintf(fs, "%s", r->body);
+    if (r->headers)
+        fputs(r->headers, fs);
+
+    if (r->file) {
+        fprintf(fs, "Content-Length: %zu\r\n\r\n", r->length);
+        request_send(r, fs);
+    }
+    else if (r->body){
+        fprintf(fs, "Content-Length: %zu\r\n\r\n", strlen(r->body));
+        fputs(r->body, fs);
     }
     else{
-        fprintf(fs, "%s %s HTTP/1.0\r\n", r->method, r->uri);
+        if (!r->method || strcmp(r->method, "GET") != 0)
+            fprintf(fs, "Content-Length: 0\r\n");
         fprintf(fs, "\r\n");
     }
 }
 
+/**
+ * Use length bytes of file, from its offset on, as body of Request (and
+ * move the offset past them).  A regular file is sent from where it is, so
+ * the caller may close fd but must not change those bytes until the
+ * Request is deleted.  Anything else (a pipe or socket) is moved to a
+ * temporary file first, by splice where the kernel supports it.
+ * @param   r           Request structure.
+ * @param   fd          File descriptor holding body.
+ * @param   length      Bytes of body.
+ * @return  Whether or not the body could be attached (all of it).
+ */
+bool request_attach(Request *r, int fd, size_t length) {
+    struct stat st;
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (offset >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        if (offset + (off_t)length > st.st_size) {
+            errno = EINVAL;
+            return false;
+        }
+        if ((r->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0)
+            return false;
+        r->file   = true;
+        r->offset = offset;
+        r->length = length;
+        lseek(fd, offset + length, SEEK_SET);
+        return true;
+    }
+
+    int spool = request_tmpfile();
+    if (spool < 0)
+        return false;
+
+    loff_t  done = 0;
+    ssize_t n    = 0;
+    errno = 0;
+    while ((size_t)done < length && (n = splice(fd, NULL, spool, &done, length - done, SPLICE_F_MOVE)) != 0) {
+        if (n < 0 && errno != EINTR)
+            break;
+    }
+
+    if (n < 0 && errno == EINVAL) {                     // splice unsupported for fd
+        char buffer[REQUEST_CHUNK];
+        errno = 0;
+        while ((size_t)done < length) {
+            size_t  want = length - done < sizeof(buffer) ? length - done : sizeof(buffer);
+            ssize_t m    = read(fd, buffer, want);
+            if (m < 0 && errno == EINTR)
+                continue;
+            if (m <= 0 || !request_fill(spool, buffer, m))
+                break;
+            done += m;
+        }
+    }
+
+    if ((size_t)done < length) {
+        int saved = errno ? errno : EPIPE;
+        close(spool);
+        errno = saved;
+        return false;
+    }
+    r->file   = true;
+    r->fd     = spool;
+    r->offset = 0;
+    r->length = length;
+    return true;
+}
+
+/**
+ * Read body of length bytes from stream into a temporary file (so it is
+ * never held in memory whole).
+ * @param   r           Request structure.
+ * @param   fs          Socket file stream positioned at body.
+ * @param   length      Bytes of body.
+ * @return  Whether or not all of the body was read.
+ */
+bool request_spool(Request *r, FILE *fs, size_t length) {
+    int spool = request_tmpfile();
+    if (spool < 0)
+        return false;
+
+    char   buffer[REQUEST_CHUNK];
+    size_t done = 0;
+    while (done < length) {
+        size_t want = length - done < sizeof(buffer) ? length - done : sizeof(buffer);
+        size_t n    = fread(buffer, 1, want, fs);
+        if (n == 0 || !request_fill(spool, buffer, n))
+            break;
+        done += n;
+    }
+
+    if (done < length) {
+        close(spool);
+        return false;
+    }
+    r->file   = true;
+    r->fd     = spool;
+    r->offset = 0;
+    r->length = length;
+    return true;
+}
+
+/**
+ * Read body kept in file into memory (as a string).
+ * @param   r           Request structure.
+ * @return  Whether or not the body is now in memory.
+ */
+bool request_load(Request *r) {
+    if (!r->file)
+        return true;
+
+    char *body = malloc(r->length + 1);
+    if (!body)
+        return false;
+
+    size_t done = 0;
+    while (done < r->length) {
+        ssize_t n = pread(r->fd, body + done, r->length - done, r->offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            free(body);
+            return false;
+        }
+        done += n;
+    }
+    body[done] = '\0';
+
+    free(r->body);
+    close(r->fd);
+    r->body = body;
+    r->file = false;
+    return true;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */ 
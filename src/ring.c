@@ -0,0 +1,80 @@
+/* ring.c: Consistent hash ring */
+
+#include "mq/ring.h"
+
+#include <stdio.h>
+
+/**
+ * Hash string to a position on the ring (FNV-1a, then mixed so that similar
+ * keys such as "host:port#1" and "host:port#2" land far apart).
+ * @param   key         String to hash.
+ * @return  32-bit hash of key.
+ */
+uint32_t ring_hash(const char *key) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *)key; *c; c++) {
+        h ^= *c;
+        h *= 16777619u;
+    }
+
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+/**
+ * Add node to ring, placing RING_VNODES points for it.  Keys only ever move
+ * to the new node, so adding a node remaps about 1/nnodes of them.
+ * @param   ring        Ring structure.
+ * @param   name        Name of node (points are derived from it).
+ * @return  Index of new node (-1 if the ring is full).
+ */
+int ring_add(Ring *ring, const char *name) {
+    if (ring->nnodes >= RING_NODES_MAX)
+        return -1;
+
+    uint32_t node = ring->nnodes++;
+    for (size_t v = 0; v < RING_VNODES; v++) {
+        char key[BUFSIZ];
+        snprintf(key, sizeof(key), "%s#%zu", name, v);
+
+        RingPoint point = { ring_hash(key), node };
+        size_t    p     = ring->npoints++;
+        while (p > 0 && (ring->points[p - 1].hash > point.hash ||
+               (ring->points[p - 1].hash == point.hash && ring->points[p - 1].node > point.node))) {
+            ring->points[p] = ring->points[p - 1];
+            p--;
+        }
+        ring->points[p] = point;
+    }
+
+    return node;
+}
+
+/**
+ * Find node owning key: the first point at or after the key's hash
+ * (wrapping around to the first point).
+ * @param   ring        Ring structure (with at least one node).
+ * @param   key         Key to look up.
+ * @return  Index of node owning key.
+ */
+size_t ring_lookup(const Ring *ring, const char *key) {
+    uint32_t hash = ring_hash(key);
+    size_t   low  = 0;
+    size_t   high = ring->npoints;
+
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (ring->points[middle].hash < hash)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return ring->points[low == ring->npoints ? 0 : low].node;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,282 @@
+/* router.c: In-process fan-out of messages to local consumers */
+
+#include "mq/router.h"
+#include "mq/logging.h"
+#include "mq/ring.h"
+#include "mq/string.h"
+
+#include <errno.h>
+
+/* Internal Functions */
+
+static RouterTopic ** router_bucket(Router *router, const char *topic) {
+    return &router->topics[ring_hash(topic) & (ROUTER_BUCKETS - 1)];
+}
+
+static RouterTopic * router_topic(Router *router, const char *topic) {
+    RouterTopic *t = *router_bucket(router, topic);
+    while (t && !streq(t->name, topic))
+        t = t->next;
+    return t;
+}
+
+/**
+ * Append delivery to consumer (growing its ring buffer when full).
+ * @param   c           Consumer structure.
+ * @param   d           Delivery structure.
+ * @return  Whether or not there was room for it.
+ */
+static bool consumer_push(Consumer *c, Delivery *d) {
+    mutex_lock(&c->lock);
+    if (c->size == c->capacity) {
+        size_t     capacity = c->capacity ? c->capacity * 2 : 16;
+        Delivery **items    = malloc(capacity * sizeof(Delivery *));
+        if (!items) {
+            mutex_unlock(&c->lock);
+            return false;
+        }
+        for (size_t i = 0; i < c->size; i++)
+            items[i] = c->items[(c->head + i) & (c->capacity - 1)];
+        free(c->items);
+        c->items    = items;
+        c->capacity = capacity;
+        c->head     = 0;
+    }
+
+    c->items[(c->head + c->size++) & (c->capacity - 1)] = d;
+    cond_signal(&c->ready);
+    mutex_unlock(&c->lock);
+    return true;
+}
+
+/**
+ * Drop reference to delivery without handing its request to done.
+ * @param   d           Delivery structure.
+ */
+static void delivery_discard(Delivery *d) {
+    if (__atomic_sub_fetch(&d->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        request_delete(d->request);
+        free(d);
+    }
+}
+
+/* External Functions */
+
+/**
+ * Create router.
+ * @param   done        Called with each request once every consumer it was
+ *                      delivered to has released it (it owns the request).
+ * @param   ctx         Passed to done.
+ * @return  Newly allocated Router structure (NULL on failure).
+ */
+Router * router_create(RouterDone done, void *ctx) {
+    Router *router = calloc(1, sizeof(Router));
+    if (!router)
+        return NULL;
+
+    router->done = done;
+    router->ctx  = ctx;
+    mutex_init(&router->lock, NULL);
+    return router;
+}
+
+/**
+ * Delete router with its topics and consumers.  Messages nobody received
+ * are deleted without being handed to done.
+ * @param   router      Router structure (may be NULL).
+ */
+void router_delete(Router *router) {
+    if (!router)
+        return;
+
+    for (size_t b = 0; b < ROUTER_BUCKETS; b++) {
+        for (RouterTopic *t = router->topics[b], *tnext; t; t = tnext) {
+            tnext = t->next;
+            for (Consumer *c = t->consumers, *cnext; c; c = cnext) {
+                cnext = c->next;
+                for (size_t i = 0; i < c->size; i++)
+                    delivery_discard(c->items[(c->head + i) & (c->capacity - 1)]);
+                free(c->items);
+                free(c);
+            }
+            free(t->name);
+            free(t);
+        }
+    }
+    free(router);
+}
+
+/**
+ * Close router: receivers get what was already delivered to them and then
+ * NULL instead of blocking.
+ * @param   router      Router structure.
+ */
+void router_close(Router *router) {
+    mutex_lock(&router->lock);
+    __atomic_store_n(&router->closed, true, __ATOMIC_RELEASE);
+    for (size_t b = 0; b < ROUTER_BUCKETS; b++) {
+        for (RouterTopic *t = router->topics[b]; t; t = t->next) {
+            for (Consumer *c = t->consumers; c; c = c->next) {
+                mutex_lock(&c->lock);
+                cond_broadcast(&c->ready);
+                mutex_unlock(&c->lock);
+            }
+        }
+    }
+    mutex_unlock(&router->lock);
+}
+
+/**
+ * Add consumer of topic.  The changed callback of the router runs before
+ * the router is unlocked, so its calls for a topic keep the order of the
+ * transitions.
+ * @param   router      Router structure.
+ * @param   topic       Topic to consume.
+ * @param   first       Where to store whether topic had no consumers before.
+ * @return  Newly allocated Consumer structure (NULL on failure).
+ */
+Consumer * router_subscribe(Router *router, const char *topic, bool *first) {
+    Consumer *c = calloc(1, sizeof(Consumer));
+    if (!c)
+        return NULL;
+    mutex_init(&c->lock, NULL);
+    cond_init(&c->ready, NULL);
+
+    mutex_lock(&router->lock);
+    RouterTopic *t = router_topic(router, topic);
+    *first = !t;
+    if (!t) {
+        if (!(t = calloc(1, sizeof(RouterTopic))) || !(t->name = strdup(topic))) {
+            mutex_unlock(&router->lock);
+            free(t);
+            free(c);
+            return NULL;
+        }
+        RouterTopic **bucket = router_bucket(router, topic);
+        t->next = *bucket;
+        *bucket = t;
+    }
+
+    c->router     = router;
+    c->topic      = t;
+    c->next       = t->consumers;
+    t->consumers  = c;
+    t->nconsumers++;
+    if (*first && router->changed)
+        router->changed(topic, true, router->ctx);
+    mutex_unlock(&router->lock);
+    return c;
+}
+
+/**
+ * Remove consumer (which nobody may be receiving from any more), releasing
+ * whatever it did not receive.
+ * @param   c           Consumer structure (deleted).
+ * @return  Whether it was the last consumer of its topic.
+ */
+bool router_unsubscribe(Consumer *c) {
+    Router      *router = c->router;
+    RouterTopic *t      = c->topic;
+
+    mutex_lock(&router->lock);
+    Consumer **link = &t->consumers;
+    while (*link != c)
+        link = &(*link)->next;
+    *link = c->next;
+
+    bool last = --t->nconsumers == 0;
+    if (last) {
+        if (router->changed)
+            router->changed(t->name, false, router->ctx);
+        RouterTopic **tlink = router_bucket(router, t->name);
+        while (*tlink != t)
+            tlink = &(*tlink)->next;
+        *tlink = t->next;
+        free(t->name);
+        free(t);
+    }
+    mutex_unlock(&router->lock);
+
+    for (size_t i = 0; i < c->size; i++)
+        router_release(c->items[(c->head + i) & (c->capacity - 1)]);
+    free(c->items);
+    free(c);
+    return last;
+}
+
+/**
+ * Hand message to every consumer of its topic.  The consumers share the one
+ * request (its body is read into memory first if it is in a file), which
+ * goes to done once the last of them releases it.
+ * @param   router      Router structure.
+ * @param   r           Request holding message (owned by router if delivered).
+ * @return  Whether topic has consumers (false leaves request with caller).
+ */
+bool router_deliver(Router *router, Request *r) {
+    if (!r->topic)
+        return false;
+
+    mutex_lock(&router->lock);
+    RouterTopic *t = router_topic(router, r->topic);
+    if (!t) {
+        mutex_unlock(&router->lock);
+        return false;
+    }
+
+    Delivery *d = malloc(sizeof(Delivery));
+    if (!d || !request_load(r)) {
+        mutex_unlock(&router->lock);
+        error("Unable to share message of %s: %s", r->topic, strerror(errno));
+        free(d);
+        request_delete(r);                      // redelivered if leased
+        return true;
+    }
+
+    // Every reference is counted before the first consumer can release one
+    d->request = r;
+    d->refs    = t->nconsumers;
+    d->router  = router;
+    for (Consumer *c = t->consumers; c; c = c->next) {
+        if (!consumer_push(c, d)) {
+            error("Unable to queue message of %s for consumer", r->topic);
+            router_release(d);
+        }
+    }
+    mutex_unlock(&router->lock);
+    return true;
+}
+
+/**
+ * Receive next message of consumer's topic (waiting for one).
+ * @param   c           Consumer structure.
+ * @return  Shared message (to be passed to router_release), or NULL once
+ *          the router is closed and nothing is left.
+ */
+Delivery * router_receive(Consumer *c) {
+    Delivery *d = NULL;
+
+    mutex_lock(&c->lock);
+    while (!c->size && !__atomic_load_n(&c->router->closed, __ATOMIC_ACQUIRE))
+        cond_wait(&c->ready, &c->lock);
+    if (c->size) {
+        d = c->items[c->head];
+        c->head = (c->head + 1) & (c->capacity - 1);
+        c->size--;
+    }
+    mutex_unlock(&c->lock);
+    return d;
+}
+
+/**
+ * Release received message; the last consumer to do so hands its request
+ * to done.
+ * @param   d           Delivery structure.
+ */
+void router_release(Delivery *d) {
+    if (__atomic_sub_fetch(&d->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        d->router->done(d->request, d->router->ctx);
+        free(d);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
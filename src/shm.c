@@ -0,0 +1,562 @@
+/* shm.c: Shared memory transport */
+
+#define _GNU_SOURCE                         /* SOCK_CLOEXEC */
+
+#include "mq/shm.h"
+#include "mq/logging.h"
+#include "mq/thread.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Internal Constants */
+
+#define SHM_PAD             0       // Skip to end of ring
+#define SHM_PUBLISH         1       // Publish message (client to broker)
+#define SHM_SUBSCRIBE       4       // Subscribe queue to topic (client to broker)
+#define SHM_UNSUBSCRIBE     5       // Unsubscribe queue from topic (client to broker)
+#define SHM_CONSUME         6       // Push messages of queue (client to broker)
+
+#define SHM_FILE            0x1     // Deliver flag: body is in file passed on socket
+
+#define SHM_HEAD            0       // Offsets in ring (each counter on its own cache line)
+#define SHM_TAIL            64
+#define SHM_SIGNALED        128
+#define SHM_DATA            192
+
+#define SHM_BACKOFF_MIN     1000    // Wait for room in a full ring (ns)
+#define SHM_BACKOFF_MAX     1000000 // Upper bound of that wait (ns)
+
+/* Internal Structures */
+
+typedef struct ShmRing ShmRing;
+struct ShmRing {
+    uint64_t *  head;                   // Bytes written (by producer)
+    uint64_t *  tail;                   // Bytes read (by consumer)
+    uint32_t *  signaled;               // Set by producer, cleared by consumer when it wakes
+    char *      data;
+    uint64_t    capacity;
+};
+
+/* Every record starts with this header and is padded to 8 bytes */
+typedef struct ShmRecord ShmRecord;
+struct ShmRecord {
+    uint32_t    length;                 // Bytes of record including padding
+    uint8_t     op;
+    uint8_t     reserved[3];
+};
+
+/* Followed by topic, query, id, and body (without terminators) */
+typedef struct ShmPublish ShmPublish;
+struct ShmPublish {
+    uint64_t    ticket;                 // 0 if the status is not wanted
+    uint32_t    topic;
+    uint32_t    query;
+    uint32_t    id;
+    uint32_t    body;
+    uint8_t     priority;
+    uint8_t     reserved[7];
+};
+
+typedef struct ShmConfirm ShmConfirm;
+struct ShmConfirm {
+    uint64_t    ticket;
+    uint32_t    status;
+    uint32_t    reserved;
+};
+
+/* Followed by queue and topic (SUBSCRIBE, UNSUBSCRIBE) or member (CONSUME) */
+typedef struct ShmQueue ShmQueue;
+struct ShmQueue {
+    uint32_t    queue;
+    uint32_t    name;
+};
+
+/* Followed by topic and body (only topic with SHM_FILE) */
+typedef struct ShmDeliver ShmDeliver;
+struct ShmDeliver {
+    uint32_t    topic;
+    uint32_t    body;
+    uint8_t     priority;
+    uint8_t     flags;
+    uint8_t     reserved[6];
+};
+
+struct Shm {
+    int         socket;                 // Closed by either side to end session
+    int         wakeup;                 // Eventfd signalled by client
+    int         notify;                 // Eventfd signalled by broker
+    char *      memory;
+    size_t      size;
+    ShmRing     out;                    // Client to broker
+    ShmRing     in;                     // Broker to client
+
+    Mutex       lock;                   // Protects out, tickets, and closed
+    bool        closed;
+    uint64_t *  tickets;                // Published tickets not yet confirmed (FIFO)
+    size_t      first;
+    size_t      ntickets;
+    size_t      capacity;
+
+    bool        idle;                   // SHM_IDLE returned since last wait (reader only)
+};
+
+/* Internal Functions */
+
+static void shm_ring(ShmRing *ring, char *base, uint64_t capacity) {
+    ring->head     = (uint64_t *)(base + SHM_HEAD);
+    ring->tail     = (uint64_t *)(base + SHM_TAIL);
+    ring->signaled = (uint32_t *)(base + SHM_SIGNALED);
+    ring->data     = base + SHM_DATA;
+    ring->capacity = capacity;
+}
+
+/**
+ * Receive handshake reply along with memfd and eventfds of session.
+ * @param   fd          Unix socket connected to broker.
+ * @param   fds         Where to store memfd, wakeup, and notify.
+ * @return  Capacity of each ring (0 on failure).
+ */
+static uint64_t shm_handshake(int fd, int fds[3]) {
+    char    reply[64] = "";
+    char    control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec  iov = { reply, sizeof(reply) - 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+
+    ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+        errno = EPROTO;
+        return 0;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+
+    // The line normally arrives with the descriptors, but finish it if not
+    while (!memchr(reply, '\n', n) && n < (ssize_t)sizeof(reply) - 1) {
+        ssize_t m = read(fd, reply + n, sizeof(reply) - 1 - n);
+        if (m <= 0)
+            break;
+        n += m;
+    }
+
+    unsigned long long capacity = 0;
+    if (sscanf(reply, "OK %llu", &capacity) != 1 || !capacity || capacity % 8) {
+        for (int i = 0; i < 3; i++)
+            close(fds[i]);
+        errno = EPROTO;
+        return 0;
+    }
+    return capacity;
+}
+
+/**
+ * Receive file the broker passed along with a SHM_FILE delivery (the broker
+ * sends each one ahead of its record, so it is already waiting).
+ * @param   s       Shm structure.
+ * @return  Descriptor of file (-1 on failure).
+ */
+static int shm_file(Shm *s) {
+    char    byte;
+    char    control[CMSG_SPACE(sizeof(int))];
+    struct iovec  iov = { &byte, 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    ssize_t n;
+
+    while ((n = recvmsg(s->socket, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+        continue;
+
+    struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+        errno = n == 0 ? ECONNRESET : EPROTO;
+        return -1;
+    }
+
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+/**
+ * Remember ticket until its confirm arrives (s->lock must be held).
+ * @param   s       Shm structure.
+ * @param   ticket  Ticket of publish.
+ * @return  Whether or not there was memory for it.
+ */
+static bool shm_track(Shm *s, uint64_t ticket) {
+    if (s->ntickets == s->capacity) {
+        size_t    capacity = s->capacity ? s->capacity * 2 : 64;
+        uint64_t *tickets  = malloc(capacity * sizeof(uint64_t));
+        if (!tickets)
+            return false;
+        for (size_t i = 0; i < s->ntickets; i++)
+            tickets[i] = s->tickets[(s->first + i) % s->capacity];
+        free(s->tickets);
+        s->tickets  = tickets;
+        s->capacity = capacity;
+        s->first    = 0;
+    }
+    s->tickets[(s->first + s->ntickets++) % s->capacity] = ticket;
+    return true;
+}
+
+/**
+ * Write record to broker, waiting for room if the ring is full.
+ * @param   s           Shm structure.
+ * @param   op          Record type.
+ * @param   header      Fixed part of record.
+ * @param   size        Bytes of fixed part.
+ * @param   parts       Strings following fixed part (without terminators).
+ * @param   lengths     Length of each string.
+ * @param   n           Number of strings.
+ * @param   ticket      Ticket to remember until confirmed (0 for none).
+ * @return  Whether or not it was written (false if the session is closed or
+ *          the record is too large for the ring).
+ */
+static bool shm_write(Shm *s, int op, const void *header, size_t size, const char **parts, const uint32_t *lengths, size_t n, uint64_t ticket) {
+    ShmRing *ring   = &s->out;
+    uint64_t length = sizeof(ShmRecord) + size;
+    for (size_t i = 0; i < n; i++)
+        length += lengths[i];
+    length = (length + 7) & ~7ULL;
+    if (length > ring->capacity / 2)
+        return false;
+
+    uint64_t head, position, pad;
+    long     backoff = SHM_BACKOFF_MIN;
+    mutex_lock(&s->lock);
+    for (;;) {
+        if (s->closed) {
+            mutex_unlock(&s->lock);
+            return false;
+        }
+        head     = *ring->head;
+        position = head % ring->capacity;
+        pad      = position + length > ring->capacity ? ring->capacity - position : 0;
+        if (head + pad + length - __atomic_load_n(ring->tail, __ATOMIC_ACQUIRE) <= ring->capacity)
+            break;
+
+        mutex_unlock(&s->lock);                             // wait for broker to catch up
+        struct timespec ts = { 0, backoff };
+        nanosleep(&ts, NULL);
+        backoff = backoff * 2 > SHM_BACKOFF_MAX ? SHM_BACKOFF_MAX : backoff * 2;
+        mutex_lock(&s->lock);
+    }
+    if (ticket && !shm_track(s, ticket)) {
+        mutex_unlock(&s->lock);
+        return false;
+    }
+
+    if (pad) {
+        ShmRecord skip = { .length = pad, .op = SHM_PAD };
+        memcpy(ring->data + position, &skip, sizeof(skip));
+        position = 0;
+    }
+    ShmRecord record = { .length = length, .op = op };
+    char *cursor = ring->data + position;
+    memcpy(cursor, &record, sizeof(record));
+    memcpy(cursor += sizeof(record), header, size);
+    cursor += size;
+    for (size_t i = 0; i < n; cursor += lengths[i++])
+        if (lengths[i])
+            memcpy(cursor, parts[i], lengths[i]);
+    __atomic_store_n(ring->head, head + pad + length, __ATOMIC_RELEASE);
+    mutex_unlock(&s->lock);
+
+    // Full barrier, so the broker either sees the new head or our signal
+    if (!__atomic_exchange_n(ring->signaled, 1, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        if (write(s->wakeup, &one, sizeof(one)) < 0)
+            debug("eventfd write: %s", strerror(errno));
+    }
+    return true;
+}
+
+/* External Functions */
+
+/**
+ * Set up shared memory session with broker on this host.  The client writes
+ * publishes and subscription changes to one ring (so the broker applies
+ * them in order) and the broker writes confirms, and once asked to with
+ * shm_consume the messages of a queue, to the other.  Each side signals the
+ * other's eventfd after writing (the client only if the broker has woken
+ * since its last signal), so a busy reader takes many records per wakeup.
+ *
+ * The broker reads and writes the rings with plain loads and stores from
+ * Python, which only keeps records and counters in order where stores are
+ * not reordered, so the transport is limited to x86-64.
+ * @param   path        Unix socket of broker.
+ * @return  Newly allocated Shm structure (NULL with errno set on failure).
+ */
+Shm * shm_connect(const char *path) {
+#if !defined(__x86_64__)
+    errno = ENOTSUP;
+    return NULL;
+#else
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return NULL;
+
+    const char *hello = "HELLO\n";
+    int         fds[3];
+    uint64_t    capacity = 0;
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        write(fd, hello, strlen(hello)) != (ssize_t)strlen(hello) ||
+        !(capacity = shm_handshake(fd, fds))) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return NULL;
+    }
+
+    Shm *s = calloc(1, sizeof(Shm));
+    size_t size = 2 * (SHM_DATA + capacity);
+    char *memory = s ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0) : MAP_FAILED;
+    close(fds[0]);
+    if (memory == MAP_FAILED) {
+        int saved = s ? errno : ENOMEM;
+        close(fds[1]);
+        close(fds[2]);
+        close(fd);
+        free(s);
+        errno = saved;
+        return NULL;
+    }
+
+    s->socket = fd;
+    s->wakeup = fds[1];
+    s->notify = fds[2];
+    s->memory = memory;
+    s->size   = size;
+    shm_ring(&s->out, memory, capacity);
+    shm_ring(&s->in, memory + SHM_DATA + capacity, capacity);
+    mutex_init(&s->lock, NULL);
+    return s;
+#endif
+}
+
+/**
+ * End session (the broker notices the closed socket) and free it.
+ * @param   s       Shm structure.
+ */
+void shm_delete(Shm *s) {
+    if (s) {
+        munmap(s->memory, s->size);
+        close(s->socket);
+        close(s->wakeup);
+        close(s->notify);
+        free(s->tickets);
+        free(s);
+    }
+}
+
+/**
+ * Write publish to broker.
+ * @param   s           Shm structure.
+ * @param   topic       Topic to publish to.
+ * @param   query       Query string of publish (NULL for none).
+ * @param   id          Message id (NULL for none).
+ * @param   body        Message body.
+ * @param   priority    Priority of message.
+ * @param   ticket      Ticket to confirm with status (0 for none).
+ * @return  Whether or not it was written (false if the session is closed or
+ *          the message is too large for the ring, so it goes over HTTP).
+ */
+bool shm_publish(Shm *s, const char *topic, const char *query, const char *id, const char *body, int priority, uint64_t ticket) {
+    const char *parts[]   = { topic, query, id, body };
+    uint32_t    lengths[] = { strlen(topic), query ? strlen(query) : 0, id ? strlen(id) : 0, body ? strlen(body) : 0 };
+    ShmPublish  p = {
+        .ticket   = ticket,
+        .topic    = lengths[0],
+        .query    = lengths[1],
+        .id       = lengths[2],
+        .body     = lengths[3],
+        .priority = priority,
+    };
+    return shm_write(s, SHM_PUBLISH, &p, sizeof(p), parts, lengths, 4, ticket);
+}
+
+/**
+ * Write subscription change to broker (applied in order with publishes).
+ * @param   s           Shm structure.
+ * @param   queue       Queue to subscribe.
+ * @param   topic       Topic to subscribe queue to.
+ * @param   subscribe   Whether to subscribe or unsubscribe.
+ * @return  Whether or not it was written.
+ */
+bool shm_subscribe(Shm *s, const char *queue, const char *topic, bool subscribe) {
+    const char *parts[]   = { queue, topic };
+    uint32_t    lengths[] = { strlen(queue), strlen(topic) };
+    ShmQueue    q = { lengths[0], lengths[1] };
+    return shm_write(s, subscribe ? SHM_SUBSCRIBE : SHM_UNSUBSCRIBE, &q, sizeof(q), parts, lengths, 2, 0);
+}
+
+/**
+ * Ask broker to push messages of queue (as SHM_DELIVER records).
+ * @param   s           Shm structure.
+ * @param   queue       Queue to receive from.
+ * @param   member      Member name in consumer group queue (NULL if none).
+ * @return  Whether or not it was written.
+ */
+bool shm_consume(Shm *s, const char *queue, const char *member) {
+    const char *parts[]   = { queue, member };
+    uint32_t    lengths[] = { strlen(queue), member ? strlen(member) : 0 };
+    ShmQueue    q = { lengths[0], lengths[1] };
+    return shm_write(s, SHM_CONSUME, &q, sizeof(q), parts, lengths, 2, 0);
+}
+
+/**
+ * Read next record from broker (only one thread may receive).
+ * @param   s           Shm structure.
+ * @param   message     Where to store newly allocated Request of SHM_DELIVER.
+ * @param   ticket      Where to store ticket of SHM_CONFIRM.
+ * @param   status      Where to store status of SHM_CONFIRM.
+ * @return  SHM_DELIVER or SHM_CONFIRM, SHM_IDLE once the ring is empty
+ *          (the next call waits for the broker or shm_wake), or SHM_CLOSED
+ *          if the broker went away.
+ */
+int shm_receive(Shm *s, Request **message, uint64_t *ticket, int *status) {
+    ShmRing *ring = &s->in;
+
+    for (;;) {
+        uint64_t tail = *ring->tail;
+        uint64_t head = __atomic_load_n(ring->head, __ATOMIC_ACQUIRE);
+
+        while (tail < head) {
+            ShmRecord *record  = (ShmRecord *)(ring->data + tail % ring->capacity);
+            char      *payload = (char *)(record + 1);
+            int        op      = record->op;
+            tail += record->length;
+
+            if (op == SHM_CONFIRM) {
+                ShmConfirm *c = (ShmConfirm *)payload;
+                *ticket = c->ticket;
+                *status = c->status;
+                __atomic_store_n(ring->tail, tail, __ATOMIC_RELEASE);
+
+                mutex_lock(&s->lock);
+                if (s->ntickets) {
+                    s->first = (s->first + 1) % s->capacity;
+                    s->ntickets--;
+                }
+                mutex_unlock(&s->lock);
+                return op;
+            }
+
+            if (op == SHM_DELIVER) {
+                ShmDeliver *d = (ShmDeliver *)payload;
+                char       *t = payload + sizeof(*d);
+                Request    *m = request_create(NULL, NULL, NULL);
+                int         f = (d->flags & SHM_FILE) ? shm_file(s) : -1;
+                if (m && (m->topic = strndup(t, d->topic)) && (d->flags & SHM_FILE) && f >= 0) {
+                    m->file     = true;                 // body stays in the broker's file
+                    m->fd       = f;
+                    m->length   = d->body;
+                    m->priority = d->priority;
+                    *message    = m;
+                } else if (m && m->topic && !(d->flags & SHM_FILE) && (m->body = malloc(d->body + 1))) {
+                    memcpy(m->body, t + d->topic, d->body);
+                    m->body[d->body] = '\0';
+                    m->priority = d->priority;
+                    *message = m;
+                } else {
+                    if (m)
+                        request_delete(m);
+                    if (f >= 0)
+                        close(f);
+                    m = NULL;
+                }
+                __atomic_store_n(ring->tail, tail, __ATOMIC_RELEASE);
+                if (m)
+                    return op;
+                error("Dropped message from shared memory: %s", strerror(errno));
+            }
+        }
+        __atomic_store_n(ring->tail, tail, __ATOMIC_RELEASE);
+
+        if (!s->idle) {
+            s->idle = true;
+            return SHM_IDLE;
+        }
+
+        struct pollfd fds[2] = { { s->notify, POLLIN, 0 }, { s->socket, POLLIN, 0 } };
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+            fds[1].revents = POLLERR;
+
+        // Peek, so files passed ahead of their records stay put
+        char    c;
+        ssize_t n = fds[1].revents ? recv(s->socket, &c, 1, MSG_DONTWAIT | MSG_PEEK) : 1;
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            mutex_lock(&s->lock);
+            s->closed = true;
+            mutex_unlock(&s->lock);
+            return SHM_CLOSED;
+        }
+        if (fds[0].revents & POLLIN) {
+            uint64_t n;
+            if (read(s->notify, &n, sizeof(n)) < 0 && errno != EAGAIN)
+                debug("eventfd read: %s", strerror(errno));
+        }
+        s->idle = false;
+    }
+}
+
+/**
+ * Make a waiting shm_receive return SHM_IDLE.
+ * @param   s       Shm structure.
+ */
+void shm_wake(Shm *s) {
+    uint64_t one = 1;
+    if (write(s->notify, &one, sizeof(one)) < 0)
+        debug("eventfd write: %s", strerror(errno));
+}
+
+/**
+ * Count tickets published but not confirmed yet.
+ * @param   s       Shm structure.
+ * @return  Number of tickets.
+ */
+size_t shm_pending(Shm *s) {
+    mutex_lock(&s->lock);
+    size_t n = s->ntickets;
+    mutex_unlock(&s->lock);
+    return n;
+}
+
+/**
+ * Take tickets published but never confirmed (after SHM_CLOSED, or when
+ * giving up on them).
+ * @param   s       Shm structure.
+ * @param   tickets Where to store newly allocated array of tickets.
+ * @return  Number of tickets.
+ */
+size_t shm_lost(Shm *s, uint64_t **tickets) {
+    mutex_lock(&s->lock);
+    size_t n = s->ntickets;
+    *tickets = n ? malloc(n * sizeof(uint64_t)) : NULL;
+    if (*tickets)
+        for (size_t i = 0; i < n; i++)
+            (*tickets)[i] = s->tickets[(s->first + i) % s->capacity];
+    else
+        n = 0;
+    s->ntickets = 0;
+    mutex_unlock(&s->lock);
+    return n;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -13,9 +13,9 @@
  * Create socket connection to specified host and port.
  * @param   host    Host string to connect to.
  * @param   port    Port string to connect to.
- * @return  Socket file stream of connection if successful, otherwise NULL.
+ * @return  Socket file descriptor of connection if successful, otherwise -1.
  */
-FILE *  socket_connect(const char *host, const char *port) {
+int     socket_dial(const char *host, const char *port) {
     /* Lookup server address information */
     struct addrinfo *results;
     struct addrinfo  hints = {
@@ -25,7 +25,7 @@ FILE *  socket_connect(const char *host, const char *port) {
     int status;
     if ((status = getaddrinfo(host, port, &hints, &results)) != 0) {
         error("Unable to resolve %s:%s: %s", host, port, gai_strerror(status));
-        return NULL;
+        return -1;
     }
 
     /* For each server entry, allocate socket and try to connect */
@@ -48,10 +48,21 @@ FILE *  socket_connect(const char *host, const char *port) {
     /* Release allocate address information */
     freeaddrinfo(results);
 
-    if (socket_fd < 0) {
+    if (socket_fd < 0)
         error("Unable to connect to %s:%s: %s", host, port, strerror(errno));
+    return socket_fd;
+}
+
+/**
+ * Create socket connection to specified host and port.
+ * @param   host    Host string to connect to.
+ * @param   port    Port string to connect to.
+ * @return  Socket file stream of connection if successful, otherwise NULL.
+ */
+FILE *  socket_connect(const char *host, const char *port) {
+    int socket_fd = socket_dial(host, port);
+    if (socket_fd < 0)
         return NULL;
-    }
 
     /* Make file stream */
     FILE *fs = fdopen(socket_fd, "r+");
@@ -0,0 +1,545 @@
+/* uring.c: io_uring transport */
+
+#define _GNU_SOURCE                         /* fopencookie */
+
+#include "mq/uring.h"
+#include "mq/logging.h"
+#include "mq/thread.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_URING
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+/* Internal Structures */
+
+/* One read or write waiting for its completion (lives on the caller's stack) */
+typedef struct UringOp UringOp;
+struct UringOp {
+    int     result;     // Bytes transferred or -errno
+    bool    done;       // Whether completion has been reaped
+    int     fd;         // File descriptor operated on
+    unsigned position;  // Submission queue tail the entry was queued at
+};
+
+struct Uring {
+    int         fd;
+
+    void *      sq_ring;                    // Submission queue ring (mmap)
+    size_t      sq_size;
+    unsigned *  sq_head;
+    unsigned *  sq_tail;
+    unsigned *  sq_array;
+    unsigned    sq_mask;
+    unsigned    sq_entries;
+    struct io_uring_sqe *sqes;              // Submission queue entries (mmap)
+    size_t      sqes_size;
+
+    void *      cq_ring;                    // Completion queue ring (mmap, may be sq_ring)
+    size_t      cq_size;
+    unsigned *  cq_head;
+    unsigned *  cq_tail;
+    unsigned    cq_mask;
+    struct io_uring_cqe *cqes;
+
+    char *      buffers;                    // Registered buffers (NULL if none)
+    bool *      used;                       // Whether each buffer belongs to a stream
+    size_t      nbuffers;
+
+    Mutex       lock;                       // Protects rings, buffers, and fields below
+    Cond        reaped;                     // Signalled after completions are reaped
+    bool        reaping;                    // Whether a thread waits in io_uring_enter
+    int         bell;                       // Eventfd whose read wakes the reaper
+    uint64_t    bell_count;                 // Filled by the read of bell
+    UringOp     bell_op;                    // Completion of the read of bell
+    bool        armed;                      // Whether a read of bell is queued or in flight
+    bool        rung;                       // Whether bell was written since its last read
+    int         failed;                     // -errno once io_uring_enter has failed (0 if not)
+    uint64_t    ops;                        // Reads and writes submitted
+    uint64_t    calls;                      // io_uring_enter system calls
+};
+
+typedef struct UringStream UringStream;
+struct UringStream {
+    Uring *     uring;
+    int         fd;
+    int         buffer;                     // Registered buffer of stream (-1 if none)
+};
+
+/* Internal Functions */
+
+/**
+ * Submit every queued entry (u->lock must be held for the count to be
+ * exact, which the kernel needs in order to wait at all).
+ * @param   u       Uring structure.
+ * @param   wait    Completions to wait for (only if everything was submitted).
+ * @return  Entries submitted or -1 on error.
+ */
+static int uring_enter(Uring *u, unsigned wait) {
+    unsigned submit = *u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (!submit && !wait)
+        return 0;
+    u->calls++;
+    if (wait)
+        mutex_unlock(&u->lock);
+    int rc = (int)syscall(__NR_io_uring_enter, u->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (wait) {
+        int errnum = errno;
+        mutex_lock(&u->lock);
+        errno = errnum;
+    }
+    return rc;
+}
+
+/**
+ * Wake the reaper out of io_uring_enter (u->lock must be held), so that it
+ * submits the entries queued since it went in.  The bell is written once
+ * per read of it however many threads queue entries meanwhile.
+ * @param   u       Uring structure.
+ */
+static void uring_ring(Uring *u) {
+    if (!u->rung) {
+        uint64_t one = 1;
+        u->rung = write(u->bell, &one, sizeof(one)) == sizeof(one);
+    }
+}
+
+/**
+ * Mark every completion in the queue done (u->lock must be held).
+ * @param   u       Uring structure.
+ */
+static void uring_reap(Uring *u) {
+    unsigned head = *u->cq_head;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+        UringOp *op = (UringOp *)(uintptr_t)cqe->user_data;
+        op->result = cqe->res;
+        op->done   = true;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+    if (u->bell_op.done) {
+        u->bell_op.done = false;
+        u->armed        = false;
+        u->rung         = false;
+    }
+}
+
+/**
+ * Queue one entry (u->lock must be held), first making room in the
+ * submission queue if it is full: the reaper is woken to submit what is
+ * queued, or without one everything queued is submitted right here.
+ * @param   u       Uring structure.
+ * @param   op      Operation the completion goes to.
+ * @param   opcode  IORING_OP_* operation.
+ * @param   buf     Data buffer.
+ * @param   len     Length of data buffer.
+ * @param   buffer  Index of registered buffer (for *_FIXED operations).
+ * @return  Whether the entry was queued (false once the ring has failed).
+ */
+static bool uring_queue(Uring *u, UringOp *op, int opcode, void *buf, size_t len, int buffer) {
+    while (*u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+        if (u->failed)
+            return false;
+        if (u->reaping) {
+            uring_ring(u);
+            cond_wait(&u->reaped, &u->lock);
+        } else if (uring_enter(u, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            error("Unable to submit to io_uring: %s", strerror(errno));
+            u->failed = -errno;
+            cond_broadcast(&u->reaped);
+        }
+    }
+
+    unsigned tail  = *u->sq_tail;
+    unsigned index = tail & u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = opcode;
+    sqe->fd        = op->fd;
+    sqe->off       = 0;                     // sockets have no file position
+    sqe->addr      = (uintptr_t)buf;
+    sqe->len       = len;
+    sqe->buf_index = buffer < 0 ? 0 : buffer;
+    sqe->user_data = (uintptr_t)op;
+    op->position   = tail;
+    u->sq_array[index] = index;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Settle operation after io_uring_enter has failed (u->lock must be held).
+ * An entry the kernel never took is simply abandoned, as nobody submits
+ * again.  One in flight still refers to the caller's buffer and stack, so it
+ * must complete before the caller may return: its socket is shut down,
+ * which ends the operation, and the completion queue is polled for it
+ * (io_uring_enter cannot be relied on to wait any more).
+ * @param   u       Uring structure.
+ * @param   op      Operation of caller.
+ */
+static void uring_settle(Uring *u, UringOp *op) {
+    uring_reap(u);
+    if (op->done)
+        return;
+
+    if ((int)(op->position - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE)) >= 0) {
+        op->result = u->failed;
+        op->done   = true;
+        return;
+    }
+
+    shutdown(op->fd, SHUT_RDWR);
+    mutex_unlock(&u->lock);
+    struct timespec pause = { 0, 1000000 };
+    nanosleep(&pause, NULL);
+    mutex_lock(&u->lock);
+    uring_reap(u);
+}
+
+/**
+ * Submit one read or write and wait for it to complete.
+ *
+ * Threads share the ring: whichever thread finds nobody waiting in the
+ * kernel becomes the reaper, submits everything queued so far and waits
+ * there in the same io_uring_enter call, then hands out the completions it
+ * reaps.  Everyone else only queues its entry and rings the bell (an
+ * eventfd the reaper always has a read queued on), which brings the reaper
+ * back to submit it along with whatever else was queued meanwhile, so
+ * operations that overlap share one io_uring_enter call.
+ *
+ * Should io_uring_enter fail, the ring is unusable: the error is returned
+ * for the operations still waiting and every later one, so the streams fail and their
+ * connections are dropped.  Operations in flight are settled first (see
+ * uring_settle), so nothing completes into a buffer its caller has freed.
+ * @param   u       Uring structure.
+ * @param   opcode  IORING_OP_* operation.
+ * @param   fd      File descriptor.
+ * @param   buf     Data buffer.
+ * @param   len     Length of data buffer.
+ * @param   buffer  Index of registered buffer (for *_FIXED operations).
+ * @return  Bytes transferred or -errno.
+ */
+static int uring_io(Uring *u, int opcode, int fd, void *buf, size_t len, int buffer) {
+    UringOp op = { 0, false, fd, 0 };
+
+    mutex_lock(&u->lock);
+    if (u->failed || !uring_queue(u, &op, opcode, buf, len, buffer)) {
+        mutex_unlock(&u->lock);
+        return u->failed;
+    }
+    u->ops++;
+
+    while (!op.done) {
+        if (u->failed) {
+            uring_settle(u, &op);
+            continue;
+        }
+
+        if (u->reaping) {                   // the reaper submits our entry
+            uring_ring(u);
+            cond_wait(&u->reaped, &u->lock);
+            continue;
+        }
+
+        u->reaping = true;
+        if (!u->armed)                      // so that uring_ring can wake us
+            u->armed = uring_queue(u, &u->bell_op, IORING_OP_READ, &u->bell_count, sizeof(u->bell_count), -1);
+        if (!u->failed) {
+            if (uring_enter(u, 1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                error("Unable to wait on io_uring: %s", strerror(errno));
+                u->failed = -errno;
+            } else {
+                uring_reap(u);
+            }
+        }
+        u->reaping = false;
+        cond_broadcast(&u->reaped);
+    }
+    mutex_unlock(&u->lock);
+
+    return op.result;
+}
+
+static bool uring_fixed(UringStream *s, const char *buf, size_t size) {
+    const char *base = s->buffer < 0 ? NULL : s->uring->buffers + (size_t)s->buffer * URING_BUFFER_SIZE;
+    return base && buf >= base && buf + size <= base + URING_BUFFER_SIZE;
+}
+
+static ssize_t uring_read(void *cookie, char *buf, size_t size) {
+    UringStream *s = (UringStream *)cookie;
+    bool fixed     = uring_fixed(s, buf, size);
+    int  n;
+
+    do {
+        n = uring_io(s->uring, fixed ? IORING_OP_READ_FIXED : IORING_OP_READ, s->fd, buf, size, s->buffer);
+    } while (n == -EINTR || n == -EAGAIN);
+
+    if (n < 0) {
+        errno = -n;
+        return -1;
+    }
+    return n;
+}
+
+static ssize_t uring_write(void *cookie, const char *buf, size_t size) {
+    UringStream *s = (UringStream *)cookie;
+    bool   fixed   = uring_fixed(s, buf, size);
+    size_t written = 0;
+
+    while (written < size) {
+        int n = uring_io(s->uring, fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, s->fd,
+                         (char *)buf + written, size - written, s->buffer);
+        if (n == -EINTR || n == -EAGAIN)
+            continue;
+        if (n <= 0) {
+            errno = n < 0 ? -n : EPIPE;
+            return written ? (ssize_t)written : -1;
+        }
+        written += n;
+    }
+    return written;
+}
+
+static int uring_close(void *cookie) {
+    UringStream *s = (UringStream *)cookie;
+    Uring       *u = s->uring;
+
+    if (s->buffer >= 0) {
+        mutex_lock(&u->lock);
+        u->used[s->buffer] = false;
+        mutex_unlock(&u->lock);
+    }
+
+    int status = close(s->fd);
+    free(s);
+    return status;
+}
+
+/**
+ * Check that the kernel supports every operation the streams use.
+ * @param   u       Uring structure.
+ * @return  Whether or not the ring is usable.
+ */
+static bool uring_probe(Uring *u) {
+    static const int needed[] = { IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED };
+
+    struct io_uring_probe *probe = calloc(1, sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+    if (!probe)
+        return false;
+
+    bool supported = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (size_t i = 0; supported && i < sizeof(needed) / sizeof(needed[0]); i++)
+        supported = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+
+    free(probe);
+    return supported;
+}
+
+/* External Functions */
+
+/**
+ * Create io_uring shared by the streams of one client.
+ * @param   entries     Submission queue entries.
+ * @param   buffers     Number of buffers to register (streams beyond that
+ *                      many use unregistered buffers).
+ * @return  Newly allocated Uring structure (NULL if io_uring is unavailable).
+ */
+Uring * uring_create(unsigned entries, size_t buffers) {
+    Uring *u = calloc(1, sizeof(Uring));
+    if (!u)
+        return NULL;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    if ((u->fd = (int)syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+        free(u);
+        return NULL;
+    }
+    mutex_init(&u->lock, NULL);
+    cond_init(&u->reaped, NULL);
+    if ((u->bell = eventfd(0, EFD_CLOEXEC)) < 0)
+        goto failure;
+    u->bell_op.fd = u->bell;
+
+    u->sq_size   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_size   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        u->sq_size = u->cq_size = u->sq_size > u->cq_size ? u->sq_size : u->cq_size;
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    u->sq_ring = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) {
+        u->sq_ring = NULL;
+        goto failure;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else if ((u->cq_ring = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+        u->cq_ring = NULL;
+        goto failure;
+    }
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        goto failure;
+    }
+
+    u->sq_head    = (unsigned *)((char *)u->sq_ring + p.sq_off.head);
+    u->sq_tail    = (unsigned *)((char *)u->sq_ring + p.sq_off.tail);
+    u->sq_array   = (unsigned *)((char *)u->sq_ring + p.sq_off.array);
+    u->sq_mask    = *(unsigned *)((char *)u->sq_ring + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->cq_head    = (unsigned *)((char *)u->cq_ring + p.cq_off.head);
+    u->cq_tail    = (unsigned *)((char *)u->cq_ring + p.cq_off.tail);
+    u->cq_mask    = *(unsigned *)((char *)u->cq_ring + p.cq_off.ring_mask);
+    u->cqes       = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+
+    if (!uring_probe(u))
+        goto failure;
+
+    // Registered buffers spare the kernel mapping each transfer's pages,
+    // but are locked memory, so do without them if that is not allowed
+    struct iovec *iovecs = calloc(buffers, sizeof(struct iovec));
+    u->buffers = buffers ? aligned_alloc(4096, buffers * URING_BUFFER_SIZE) : NULL;
+    u->used    = calloc(buffers, sizeof(bool));
+    if (iovecs && u->buffers && u->used) {
+        for (size_t i = 0; i < buffers; i++) {
+            iovecs[i].iov_base = u->buffers + i * URING_BUFFER_SIZE;
+            iovecs[i].iov_len  = URING_BUFFER_SIZE;
+        }
+        if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, iovecs, (unsigned)buffers) == 0)
+            u->nbuffers = buffers;
+        else
+            info("Unable to register io_uring buffers: %s", strerror(errno));
+    }
+    free(iovecs);
+    if (!u->nbuffers) {
+        free(u->buffers);
+        free(u->used);
+        u->buffers = NULL;
+        u->used    = NULL;
+    }
+
+    return u;
+
+failure:
+    uring_delete(u);
+    return NULL;
+}
+
+/**
+ * Delete Uring structure (after every stream has been closed).
+ * @param   u       Uring structure.
+ */
+void uring_delete(Uring *u) {
+    if (u) {
+        if (u->sqes)
+            munmap(u->sqes, u->sqes_size);
+        if (u->cq_ring && u->cq_ring != u->sq_ring)
+            munmap(u->cq_ring, u->cq_size);
+        if (u->sq_ring)
+            munmap(u->sq_ring, u->sq_size);
+        close(u->fd);
+        if (u->bell >= 0)
+            close(u->bell);
+        free(u->buffers);
+        free(u->used);
+        free(u);
+    }
+}
+
+/**
+ * Make file stream whose reads and writes go through the io_uring.  The
+ * stream buffers in one of the registered buffers if any is free, so stdio
+ * refills and flushes use the *_FIXED operations.  Once the ring has
+ * failed, new connections get ordinary file streams instead.
+ * @param   u       Uring structure.
+ * @param   fd      Connected socket (closed along with the stream).
+ * @param   mode    Stream mode (as for fdopen).
+ * @return  Socket file stream (NULL on failure, leaving fd open).
+ */
+FILE * uring_fdopen(Uring *u, int fd, const char *mode) {
+    mutex_lock(&u->lock);
+    bool failed = u->failed;
+    mutex_unlock(&u->lock);
+    if (failed)
+        return fdopen(fd, mode);
+
+    UringStream *s = calloc(1, sizeof(UringStream));
+    if (!s)
+        return NULL;
+    s->uring  = u;
+    s->fd     = fd;
+    s->buffer = -1;
+
+    cookie_io_functions_t io = { uring_read, uring_write, NULL, uring_close };
+    FILE *fs = fopencookie(s, mode, io);
+    if (!fs) {
+        free(s);
+        return NULL;
+    }
+
+    mutex_lock(&u->lock);
+    for (size_t i = 0; i < u->nbuffers && s->buffer < 0; i++) {
+        if (!u->used[i]) {
+            u->used[i] = true;
+            s->buffer  = i;
+        }
+    }
+    mutex_unlock(&u->lock);
+
+    if (s->buffer >= 0)
+        setvbuf(fs, u->buffers + (size_t)s->buffer * URING_BUFFER_SIZE, _IOFBF, URING_BUFFER_SIZE);
+    return fs;
+}
+
+/**
+ * Report how well submissions are batched.
+ * @param   u       Uring structure.
+ * @param   ops     Where to store number of reads and writes submitted.
+ * @param   calls   Where to store number of io_uring_enter system calls.
+ */
+void uring_stats(Uring *u, uint64_t *ops, uint64_t *calls) {
+    mutex_lock(&u->lock);
+    *ops   = u->ops;
+    *calls = u->calls;
+    mutex_unlock(&u->lock);
+}
+
+#else
+
+/* Without HAVE_URING every client falls back to blocking sockets */
+
+Uring * uring_create(unsigned entries, size_t buffers) {
+    errno = ENOSYS;
+    return NULL;
+}
+
+void uring_delete(Uring *u) {
+}
+
+FILE * uring_fdopen(Uring *u, int fd, const char *mode) {
+    errno = ENOSYS;
+    return NULL;
+}
+
+void uring_stats(Uring *u, uint64_t *ops, uint64_t *calls) {
+    *ops   = 0;
+    *calls = 0;
+}
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,84 @@
+/* bench_transport.c: Compare blocking, io_uring and shared memory transports
+ *
+ *  Usage: bench_transport [host] [port] [messages] [size] [pushers]
+ *
+ * Publishes messages to a topic the client itself subscribes to and then
+ * retrieves them, once with blocking sockets, once through io_uring (build
+ * with URING=1, otherwise that run falls back to blocking) and once through
+ * shared memory (only if the server is on this host, otherwise that run
+ * falls back to TCP).
+ */
+
+#include "mq/client.h"
+
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Functions */
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench(const char *label, const char *host, const char *port, int flags, size_t messages, size_t size, size_t pushers) {
+    char name[64];
+    sprintf(name, "bench_%d_%d", getpid(), flags);
+
+    MessageQueue *mq = mq_create_flags(name, host, port, flags);
+    assert(mq);
+    mq_set_pushers(mq, pushers);
+    mq_set_prefetch(mq, 256, 0);
+    mq_subscribe(mq, name);
+    mq_start(mq);
+
+    char *body = malloc(size + 1);
+    assert(body);
+    memset(body, 'x', size);
+    body[size] = '\0';
+
+    double started = now();
+    for (size_t i = 0; i < messages; i++)
+        mq_publish_async(mq, name, body);
+    mq_flush(mq);
+    double published = now();
+
+    for (size_t i = 0; i < messages; i++)
+        free(mq_retrieve(mq));
+    double retrieved = now();
+
+    uint64_t ops = 0, calls = 0;
+    if (mq->uring)
+        uring_stats(mq->uring, &ops, &calls);
+
+    printf("%-10s publish %9.0f msg/s  retrieve %9.0f msg/s  (%s",
+        label, messages / (published - started), messages / (retrieved - published),
+        mq->brokers[0].shm ? "shared memory" : mq->uring ? "io_uring" : "blocking");
+    if (calls)
+        printf(", %.2f ops per io_uring_enter", (double)ops / calls);
+    printf(")\n");
+
+    mq_unsubscribe(mq, name);
+    mq_stop(mq);
+    mq_delete(mq);
+    free(body);
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    char  *host     = argc > 1 ? argv[1] : "localhost";
+    char  *port     = argc > 2 ? argv[2] : "9620";
+    size_t messages = argc > 3 ? strtoul(argv[3], NULL, 10) : 10000;
+    size_t size     = argc > 4 ? strtoul(argv[4], NULL, 10) : 128;
+    size_t pushers  = argc > 5 ? strtoul(argv[5], NULL, 10) : 2;
+
+    bench("blocking", host, port, MQ_TRANSPORT_TCP, messages, size, pushers);
+    bench("uring", host, port, MQ_TRANSPORT_TCP | MQ_TRANSPORT_URING, messages, size, pushers);
+    bench("shm", host, port, 0, messages, size, pushers);
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,241 @@
+/* test_breaker_unit.c: Test reconnect Breaker (Unit) */
+
+#include "mq/breaker.h"
+#include "mq/client.h"
+
+#include <assert.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define NCLIENTS    16
+
+/* Structures */
+
+typedef struct Waiter Waiter;
+struct Waiter {
+    Breaker *   breaker;
+    bool *      cancel;
+    bool        allowed;
+    bool        done;
+};
+
+/* Functions */
+
+double elapsed(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+void * wait_thread(void *arg) {
+    Waiter *w = (Waiter *)arg;
+    w->allowed = breaker_wait(w->breaker, w->cancel);
+    __atomic_store_n(&w->done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Server that accepts connections and closes them without answering */
+void * drop_thread(void *arg) {
+    int listener = *(int *)arg;
+    int fd;
+    while ((fd = accept(listener, NULL, NULL)) >= 0)
+        close(fd);
+    return NULL;
+}
+
+int test_00_breaker_failure() {
+    Breaker b;
+    breaker_init(&b, 1);
+    b.base = 10;
+    b.max  = 1000;
+
+    assert(breaker_state(&b, NULL, NULL) == BREAKER_CLOSED);
+    assert(breaker_wait(&b, NULL));
+
+    unsigned long delay = breaker_failure(&b);
+    assert(delay <= b.base && b.delay == b.base);
+
+    unsigned      failures;
+    unsigned long retry;
+    assert(breaker_state(&b, &failures, &retry) == BREAKER_OPEN);
+    assert(failures == 1 && retry <= b.base);
+
+    // Failures of attempts already under way do not count again
+    breaker_failure(&b);
+    assert(breaker_state(&b, &failures, NULL) == BREAKER_OPEN && failures == 1);
+
+    // Delays stay between base and max, never more than three times the last
+    for (int i = 0; i < 64; i++) {
+        unsigned long last = b.delay;
+        b.state = BREAKER_HALF_OPEN;
+        breaker_failure(&b);
+        assert(b.delay >= b.base && b.delay <= b.max && b.delay <= last * 3);
+    }
+    assert(b.failures == 65);
+
+    assert(breaker_success(&b) == 65);
+    assert(breaker_state(&b, &failures, &retry) == BREAKER_CLOSED);
+    assert(failures == 0 && retry == 0);
+    assert(breaker_success(&b) == 0);
+    return EXIT_SUCCESS;
+}
+
+int test_01_breaker_half_open() {
+    Breaker b;
+    breaker_init(&b, 2);
+    b.base = 50;
+    b.max  = 50;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    breaker_failure(&b);
+
+    // First caller probes once the delay has passed
+    assert(breaker_wait(&b, NULL));
+    assert(elapsed(&start) >= 49);
+    assert(breaker_state(&b, NULL, NULL) == BREAKER_HALF_OPEN);
+
+    // Everyone else waits for the probe
+    Waiter   w = { &b, NULL, false, false };
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, wait_thread, &w) == 0);
+    usleep(100000);
+    assert(!__atomic_load_n(&w.done, __ATOMIC_ACQUIRE));
+
+    // A failed probe opens the circuit again, a successful one lets them in
+    breaker_failure(&b);
+    usleep(20000);
+    assert(!__atomic_load_n(&w.done, __ATOMIC_ACQUIRE));
+    assert(pthread_join(thread, NULL) == 0);
+    assert(w.allowed);
+    assert(breaker_state(&b, NULL, NULL) == BREAKER_HALF_OPEN);
+
+    w.done = false;
+    assert(pthread_create(&thread, NULL, wait_thread, &w) == 0);
+    usleep(20000);
+    assert(!__atomic_load_n(&w.done, __ATOMIC_ACQUIRE));
+    breaker_success(&b);
+    assert(pthread_join(thread, NULL) == 0);
+    assert(w.allowed);
+    assert(breaker_state(&b, NULL, NULL) == BREAKER_CLOSED);
+    return EXIT_SUCCESS;
+}
+
+int test_02_breaker_cancel() {
+    Breaker b;
+    bool    cancel = false;
+    breaker_init(&b, 3);
+    b.base = 60000;
+    b.max  = 60000;
+    breaker_failure(&b);
+
+    Waiter   w = { &b, &cancel, true, false };
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, wait_thread, &w) == 0);
+    usleep(20000);
+    assert(!__atomic_load_n(&w.done, __ATOMIC_ACQUIRE));
+
+    __atomic_store_n(&cancel, true, __ATOMIC_RELEASE);
+    breaker_wake(&b);
+    assert(pthread_join(thread, NULL) == 0);
+    assert(!w.allowed);
+    assert(!breaker_wait(&b, &cancel));
+    return EXIT_SUCCESS;
+}
+
+int test_03_breaker_jitter() {
+    Breaker clients[NCLIENTS];
+    for (size_t c = 0; c < NCLIENTS; c++) {
+        breaker_init(&clients[c], c * 7919 + 1);
+        clients[c].base = 100;
+        clients[c].max  = 10000;
+    }
+
+    // Clients losing a server together retry it at different times
+    for (int round = 0; round < 8; round++) {
+        unsigned long lowest = ~0UL, highest = 0;
+        for (size_t c = 0; c < NCLIENTS; c++) {
+            clients[c].state = BREAKER_CLOSED;
+            breaker_failure(&clients[c]);
+            lowest  = clients[c].delay < lowest  ? clients[c].delay : lowest;
+            highest = clients[c].delay > highest ? clients[c].delay : highest;
+        }
+        assert(round == 0 || highest > lowest);
+    }
+    return EXIT_SUCCESS;
+}
+
+int test_04_breaker_request_failure() {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    assert(listener >= 0);
+
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t length = sizeof(address);
+    assert(bind(listener, (struct sockaddr *)&address, length) == 0);
+    assert(listen(listener, NCLIENTS) == 0);
+    assert(getsockname(listener, (struct sockaddr *)&address, &length) == 0);
+
+    Thread dropper;
+    thread_create(&dropper, NULL, drop_thread, &listener);
+
+    char port[NI_MAXSERV];
+    sprintf(port, "%d", ntohs(address.sin_port));
+    MessageQueue *mq = mq_create_flags("breaker_test", "127.0.0.1", port, MQ_TRANSPORT_TCP);
+    assert(mq);
+    mq_set_backoff(mq, 10, 20);
+    mq_start(mq);
+
+    // Connecting works but no request gets an answer, so failures add up
+    // instead of every connection resetting them
+    MQHealth health = { 0 };
+    for (int i = 0; i < 200 && health.failures < 4; i++) {
+        usleep(10000);
+        mq_health(mq, &health, 1);
+    }
+    assert(health.failures >= 4);
+
+    mq_set_drain(mq, 0);
+    mq_stop(mq);
+    mq_delete(mq);
+
+    shutdown(listener, SHUT_RDWR);
+    thread_join(dropper, NULL);
+    close(listener);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test breaker_failure\n");
+        fprintf(stderr, "    1. Test breaker_half_open\n");
+        fprintf(stderr, "    2. Test breaker_cancel\n");
+        fprintf(stderr, "    3. Test breaker_jitter\n");
+        fprintf(stderr, "    4. Test breaker_request_failure\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_breaker_failure(); break;
+        case 1:  status = test_01_breaker_half_open(); break;
+        case 2:  status = test_02_breaker_cancel(); break;
+        case 3:  status = test_03_breaker_jitter(); break;
+        case 4:  status = test_04_breaker_request_failure(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
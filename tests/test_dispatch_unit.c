@@ -0,0 +1,182 @@
+/* test_dispatch_unit.c: Test work-stealing Dispatcher (Unit) */
+
+#include "mq/dispatch.h"
+
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define NKEYS       8
+#define NREQUESTS   1000
+
+/* Structures */
+
+typedef struct Tally Tally;
+struct Tally {
+    size_t      next;           // Sequence number expected next
+    size_t      handled;
+    pthread_t   threads[NKEYS * NREQUESTS];
+};
+
+/* Handlers */
+
+void handle_in_order(Request *r, void *ctx) {
+    Tally *tally = (Tally *)ctx;
+    size_t sequence = strtoul(r->body, NULL, 10);
+    assert(sequence == tally->next);
+    tally->next++;
+    tally->handled++;
+    request_delete(r);
+}
+
+size_t Waiting = 0;
+
+void handle_rendezvous(Request *r, void *ctx) {
+    bool *met = (bool *)ctx;
+    __atomic_add_fetch(&Waiting, 1, __ATOMIC_SEQ_CST);
+    for (size_t i = 0; i < 2000 && __atomic_load_n(&Waiting, __ATOMIC_SEQ_CST) < 2; i++) {
+        struct timespec ts = { 0, 1000000 };
+        nanosleep(&ts, NULL);
+    }
+    *met = __atomic_load_n(&Waiting, __ATOMIC_SEQ_CST) >= 2;
+    request_delete(r);
+}
+
+void handle_record(Request *r, void *ctx) {
+    Tally *tally = (Tally *)ctx;
+    struct timespec ts = { 0, 1000000 };
+    nanosleep(&ts, NULL);
+    size_t slot = __atomic_fetch_add(&tally->handled, 1, __ATOMIC_SEQ_CST);
+    tally->threads[slot] = pthread_self();
+    request_delete(r);
+}
+
+Dispatcher *Spawner = NULL;
+
+void handle_spawn(Request *r, void *ctx) {
+    for (size_t i = 0; i < NKEYS * 4; i++) {
+        char key[32];
+        sprintf(key, "work%zu", i % NKEYS);
+        assert(dispatcher_submit(Spawner, key, request_create(NULL, NULL, "work")));
+    }
+    request_delete(r);
+}
+
+/* Functions */
+
+int test_00_dispatcher_order() {
+    Dispatcher *d = dispatcher_create(4);
+    Tally tallies[NKEYS] = {{0}};
+    assert(d);
+
+    for (size_t k = 0; k < NKEYS; k++) {
+        char key[32];
+        sprintf(key, "topic%zu", k);
+        assert(dispatcher_register(d, key, handle_in_order, &tallies[k]));
+    }
+
+    for (size_t i = 0; i < NREQUESTS; i++) {
+        for (size_t k = 0; k < NKEYS; k++) {
+            char key[32], body[32];
+            sprintf(key, "topic%zu", k);
+            sprintf(body, "%zu", i);
+            assert(dispatcher_submit(d, key, request_create(NULL, NULL, body)));
+        }
+    }
+
+    dispatcher_delete(d);
+    for (size_t k = 0; k < NKEYS; k++)
+        assert(tallies[k].handled == NREQUESTS);
+    return EXIT_SUCCESS;
+}
+
+int test_01_dispatcher_parallel() {
+    Dispatcher *d = dispatcher_create(2);
+    bool met[2] = { false, false };
+    assert(d);
+
+    assert(dispatcher_register(d, "a", handle_rendezvous, &met[0]));
+    assert(dispatcher_register(d, "b", handle_rendezvous, &met[1]));
+    assert(dispatcher_submit(d, "a", request_create(NULL, NULL, "a")));
+    assert(dispatcher_submit(d, "b", request_create(NULL, NULL, "b")));
+
+    dispatcher_delete(d);
+    assert(met[0] && met[1]);
+    return EXIT_SUCCESS;
+}
+
+int test_02_dispatcher_register() {
+    Dispatcher *d = dispatcher_create(1);
+    Tally first = {0}, second = {0};
+    assert(d);
+
+    Request *r = request_create(NULL, NULL, "0");
+    assert(!dispatcher_submit(d, "missing", r));
+    request_delete(r);
+
+    assert(dispatcher_register(d, "topic", handle_in_order, &first));
+    assert(dispatcher_register(d, "topic", handle_in_order, &second));
+    assert(dispatcher_submit(d, "topic", request_create(NULL, NULL, "0")));
+
+    dispatcher_delete(d);
+    assert(first.handled == 0 && second.handled == 1);
+    return EXIT_SUCCESS;
+}
+
+int test_03_dispatcher_steal() {
+    Dispatcher *d = dispatcher_create(4);
+    Tally *tally = calloc(1, sizeof(Tally));
+    assert(d && tally);
+
+    Spawner = d;
+    assert(dispatcher_register(d, "spawn", handle_spawn, NULL));
+    for (size_t k = 0; k < NKEYS; k++) {
+        char key[32];
+        sprintf(key, "work%zu", k);
+        assert(dispatcher_register(d, key, handle_record, tally));
+    }
+
+    // Everything lands in the spawning worker's deque; others must steal
+    assert(dispatcher_submit(d, "spawn", request_create(NULL, NULL, "spawn")));
+    dispatcher_delete(d);
+
+    assert(tally->handled == NKEYS * 4);
+    bool stolen = false;
+    for (size_t i = 1; i < tally->handled; i++)
+        stolen |= !pthread_equal(tally->threads[i], tally->threads[0]);
+    assert(stolen);
+
+    free(tally);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test dispatcher_order\n");
+        fprintf(stderr, "    1. Test dispatcher_parallel\n");
+        fprintf(stderr, "    2. Test dispatcher_register\n");
+        fprintf(stderr, "    3. Test dispatcher_steal\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_dispatcher_order(); break;
+        case 1:  status = test_01_dispatcher_parallel(); break;
+        case 2:  status = test_02_dispatcher_register(); break;
+        case 3:  status = test_03_dispatcher_steal(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -9,8 +9,28 @@
 /* Constants */
 
 const char * TOPIC     = "testing";
+const char * CALLBACKS = "testing_callbacks";
+const char * NOBODY    = "testing_nobody";
 const size_t NMESSAGES = 10;
 
+/* Callbacks */
+
+void on_message(MessageQueue *mq, const char *topic, const char *body, void *ctx) {
+    size_t *handled = (size_t *)ctx;
+    assert(strcmp(topic, CALLBACKS) == 0);
+    assert((size_t)atoi(body) == *handled);     // in publish order
+    (*handled)++;
+}
+
+void on_confirm(MessageQueue *mq, const MQConfirm *confirms, size_t n, void *ctx) {
+    size_t *statuses = (size_t *)ctx;             // [0] = 200s, [1] = 404s
+    for (size_t i = 0; i < n; i++) {
+        assert(confirms[i].ticket > 0 && confirms[i].ticket <= NMESSAGES + 1);
+        assert(confirms[i].status == 200 || confirms[i].status == 404);
+        __atomic_add_fetch(&statuses[confirms[i].status == 404], 1, __ATOMIC_RELAXED);
+    }
+}
+
 /* Threads */
 
 void *incoming_thread(void *arg) {
@@ -32,12 +52,17 @@ void *incoming_thread(void *arg) {
 
 void *outgoing_thread(void *arg) {
     MessageQueue *mq = (MessageQueue *)arg;
+    MQTopic *topic = mq_topic_open(mq, TOPIC);
     char body[BUFSIZ];
 
+    assert(topic && mq_topic_open(mq, TOPIC) == topic);
     for (size_t i = 0; i < NMESSAGES; i++) {
     	sprintf(body, "%lu. Hello from %lu\n", i, time(NULL));
-    	mq_publish(mq, TOPIC, body);
+    	mq_publish_to(topic, body);
+    	assert(mq_publish_async(mq, CALLBACKS, body) == i + 1);
     }
+    mq_publish_async(mq, NOBODY, body);
+    mq_flush(mq);
 
     sleep(5);
     mq_stop(mq);
@@ -53,16 +78,26 @@ int main(int argc, char *argv[]) {
     char *port = "9620";
 
     if (argc > 1) { host = argv[1]; }
+    int   flags = 0;
+
     if (argc > 2) { port = argv[2]; }
+    for (int i = 3; i < argc; i++) {            // transports (shm is the default)
+        if (strcmp(argv[i], "uring") == 0) { flags |= MQ_TRANSPORT_URING; }
+        if (strcmp(argv[i], "tcp") == 0)   { flags |= MQ_TRANSPORT_TCP; }
+    }
     if (!name)    { name = "echo_client_test";  }
 
     /* Create and start message queue */
-    MessageQueue *mq = mq_create(name, host, port);
+    MessageQueue *mq = mq_create_flags(name, host, port, flags);
     assert(mq);
 
     mq_subscribe(mq, TOPIC);
     mq_unsubscribe(mq, TOPIC);
     mq_subscribe(mq, TOPIC);
+    size_t handled = 0;
+    mq_on_message(mq, CALLBACKS, on_message, &handled);
+    size_t statuses[2] = {0};
+    mq_set_confirm(mq, on_confirm, statuses);
     mq_start(mq);
 
     /* Run and wait for incoming and outgoing threads */
@@ -72,6 +107,8 @@ int main(int argc, char *argv[]) {
     thread_create(&outgoing, NULL, outgoing_thread, mq);
     thread_join(incoming, NULL);
     thread_join(outgoing, NULL);
+    assert(handled == NMESSAGES);
+    assert(statuses[0] == NMESSAGES && statuses[1] == 1);
 
     mq_delete(mq);
     return 0;
@@ -0,0 +1,156 @@
+/* test_logging_unit.c: Test asynchronous logging (Unit) */
+
+#include "mq/logging.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define NBURST      25
+
+/* Functions */
+
+/**
+ * Send stderr to temporary file.
+ * @return  Path of file (static).
+ */
+const char * capture() {
+    static char path[] = "/tmp/test_logging_unit.XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    assert(dup2(fd, STDERR_FILENO) == STDERR_FILENO);
+    close(fd);
+    return path;
+}
+
+/**
+ * Count lines of file containing text.
+ * @param   path    Path of file.
+ * @param   text    Text to look for.
+ * @return  Number of lines containing text.
+ */
+size_t count_lines(const char *path, const char *text) {
+    char   line[BUFSIZ];
+    size_t count = 0;
+    FILE  *fs    = fopen(path, "r");
+    assert(fs);
+    while (fgets(line, sizeof(line), fs))
+        count += strstr(line, text) != NULL;
+    fclose(fs);
+    return count;
+}
+
+/**
+ * Flush log and wait (briefly) for the writer to finish writing.
+ * @param   path    Path of captured stderr.
+ * @param   text    Text of lines to wait for.
+ * @param   want    Number of lines expected.
+ * @return  Number of lines containing text.
+ */
+size_t wait_lines(const char *path, const char *text, size_t want) {
+    struct timespec pause = { 0, 10000000 };
+    for (int i = 0; i < 100 && count_lines(path, text) < want; i++) {
+        log_flush();
+        nanosleep(&pause, NULL);
+    }
+    nanosleep(&pause, NULL);
+    log_flush();
+    return count_lines(path, text);
+}
+
+/**
+ * Wait for the start of the next rate limit window (whole second).
+ */
+void next_window() {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &start);
+    do {
+        struct timespec pause = { 0, 1000000 };
+        nanosleep(&pause, NULL);
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    } while (now.tv_sec == start.tv_sec);
+}
+
+void log_burst(size_t n) {
+    for (size_t i = 0; i < n; i++)
+        error("burst %zu", i);
+}
+
+int test_00_log_write() {
+    const char *path = capture();
+
+    for (int i = 0; i < 3; i++)
+        info("message %d", i);
+    assert(wait_lines(path, "INFO  message", 3) == 3);
+    assert(count_lines(path, "message 2") == 1);
+
+    unlink(path);
+    return EXIT_SUCCESS;
+}
+
+int test_01_log_limit() {
+    const char *path = capture();
+
+    next_window();
+    log_burst(NBURST);
+    assert(wait_lines(path, "ERROR burst", LOG_LIMIT_BURST) == LOG_LIMIT_BURST);
+
+    // The next message allowed reports how many were suppressed
+    next_window();
+    log_burst(1);
+    assert(wait_lines(path, "ERROR burst", LOG_LIMIT_BURST + 1) == LOG_LIMIT_BURST + 1);
+
+    char summary[64];
+    snprintf(summary, sizeof(summary), "burst 0 (suppressed %d repeats)", NBURST - LOG_LIMIT_BURST);
+    assert(count_lines(path, summary) == 1);
+
+    unlink(path);
+    return EXIT_SUCCESS;
+}
+
+int test_02_log_limit_sites() {
+    const char *path = capture();
+
+    // Every call site has a limit of its own
+    next_window();
+    log_burst(NBURST);
+    for (int i = 0; i < LOG_LIMIT_BURST; i++)
+        error("other %d", i);
+    assert(wait_lines(path, "ERROR other", LOG_LIMIT_BURST) == LOG_LIMIT_BURST);
+    assert(count_lines(path, "ERROR burst") == LOG_LIMIT_BURST);
+
+    unlink(path);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test log_write\n");
+        fprintf(stderr, "    1. Test log_limit\n");
+        fprintf(stderr, "    2. Test log_limit_sites\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_log_write(); break;
+        case 1:  status = test_01_log_limit(); break;
+        case 2:  status = test_02_log_limit_sites(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,63 @@
+/* test_pipeline_functional.c: Test pipelined publishing (Functional) */
+
+#include "mq/client.h"
+
+#include <assert.h>
+#include <signal.h>
+#include <unistd.h>
+
+/* Constants */
+
+const char * TOPIC     = "pipelined";
+const size_t NWINDOWS  = 4;
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    /* Parse command-line arguments */
+    char *host = "localhost";
+    char *port = "9620";
+
+    if (argc > 1) { host = argv[1]; }
+    if (argc > 2) { port = argv[2]; }
+
+    /* Create and start message queue (publishes to a server on this host
+     * would otherwise skip the pusher through shared memory) */
+    MessageQueue *mq = mq_create_flags("pipeline_test", host, port, MQ_TRANSPORT_TCP);
+    assert(mq);
+
+    mq_subscribe(mq, TOPIC);
+    mq_start(mq);
+
+    /* Starting leaves the process's SIGPIPE disposition alone */
+    struct sigaction action;
+    assert(sigaction(SIGPIPE, NULL, &action) == 0);
+    assert(action.sa_handler == SIG_DFL);
+
+    /* Publish full windows back to back, so responses arrive while the
+     * pusher is still writing requests */
+    size_t nmessages = NWINDOWS * mq->window;
+    char   body[BUFSIZ];
+    for (size_t i = 0; i < nmessages; i++) {
+        sprintf(body, "%zu", i);
+        mq_publish(mq, TOPIC, body);
+    }
+
+    /* Every publish reaches the server exactly once, in order */
+    for (size_t i = 0; i < nmessages; i++) {
+        char *message = mq_retrieve(mq);
+        assert(message);
+        assert((size_t)atoi(message) == i);
+        free(message);
+    }
+
+    /* Nothing is left over once stopped (re-sent duplicates would be) */
+    sleep(1);
+    mq_stop(mq);
+    assert(mq_retrieve(mq) == NULL);
+
+    mq_delete(mq);
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -6,6 +6,7 @@
 #include "mq/string.h"
 
 #include <assert.h>
+#include <unistd.h>
 
 /* Constants */
 
@@ -20,12 +21,17 @@ Request REQUESTS[] = {
 
 /* Functions */
 
+void * pop_thread(void *arg) {
+    return queue_pop((Queue *)arg);
+}
+
 int test_00_queue_create() {
     Queue *q = queue_create();
     assert(q);
-    assert(q->head == NULL);
-    assert(q->tail == NULL);
+    assert(q->levels[0].head == NULL);
+    assert(q->levels[0].tail == NULL);
     assert(q->size == 0);
+    assert(q->nonempty == 0);
 
     free(q);
     return EXIT_SUCCESS;
@@ -37,9 +43,9 @@ int test_01_queue_push() {
 
     for (size_t r = 0; REQUESTS[r].method; r++) {
     	queue_push(q, &REQUESTS[r]);
-    	assert(q->head == &REQUESTS[0]);
+    	assert(q->levels[0].head == &REQUESTS[0]);
     	assert(q->size == r + 1);
-    	assert(q->tail == &REQUESTS[r]); 
+    	assert(q->levels[0].tail == &REQUESTS[r]); 
     }
 
     free(q);
@@ -52,9 +58,9 @@ int test_02_queue_pop() {
 
     for (size_t r = 0; REQUESTS[r].method; r++) {
     	queue_push(q, &REQUESTS[r]);
-    	assert(q->head == &REQUESTS[0]);
+    	assert(q->levels[0].head == &REQUESTS[0]);
     	assert(q->size == r + 1);
-    	assert(q->tail == &REQUESTS[r]); 
+    	assert(q->levels[0].tail == &REQUESTS[r]); 
     }
 
     for (size_t r = 0; REQUESTS[r].method; r++) {
@@ -78,8 +84,63 @@ int test_03_queue_delete() {
 
     	queue_push(q, n);
     	assert(q->size == r + 1);
-    	assert(q->tail == n);
+    	assert(q->levels[0].tail == n);
+    }
+
+    queue_delete(q);
+    return EXIT_SUCCESS;
+}
+
+int test_04_queue_priority() {
+    Queue *q = queue_create();
+    assert(q);
+
+    Request requests[] = {
+        { "m0", "u0", "b0", NULL, 0 },
+        { "m1", "u1", "b1", NULL, 3 },
+        { "m2", "u2", "b2", NULL, 0 },
+        { "m3", "u3", "b3", NULL, REQUEST_PRIORITIES - 1 },
+        { "m4", "u4", "b4", NULL, 3 },
+    };
+    size_t order[] = { 3, 1, 4, 0, 2 };
+
+    for (size_t r = 0; r < 5; r++) {
+        queue_push(q, &requests[r]);
+        assert(q->size == r + 1);
     }
+    assert(q->nonempty == (1u | (1u << 3) | (1u << (REQUEST_PRIORITIES - 1))));
+
+    for (size_t r = 0; r < 5; r++) {
+        assert(queue_pop(q) == &requests[order[r]]);
+    }
+    assert(q->size == 0);
+    assert(q->nonempty == 0);
+    assert(queue_trypop(q) == NULL);
+
+    free(q);
+    return EXIT_SUCCESS;
+}
+
+int test_05_queue_close() {
+    Queue *q = queue_create();
+    assert(q);
+
+    // Closing wakes a blocked pop
+    Thread   thread;
+    Request *r;
+    thread_create(&thread, NULL, pop_thread, q);
+    usleep(50000);
+    queue_close(q);
+    thread_join(thread, (void **)&r);
+    assert(r == NULL);
+
+    // What is left (or pushed later) is still popped before NULL
+    queue_push(q, &REQUESTS[0]);
+    queue_push(q, &REQUESTS[1]);
+    assert(queue_pop(q) == &REQUESTS[0]);
+    assert(queue_pop(q) == &REQUESTS[1]);
+    assert(queue_pop(q) == NULL);
+    assert(queue_trypop(q) == NULL);
 
     queue_delete(q);
     return EXIT_SUCCESS;
@@ -95,6 +156,8 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "    1. Test queue_push\n");
         fprintf(stderr, "    2. Test queue_pop\n");
         fprintf(stderr, "    3. Test queue_delete\n");
+        fprintf(stderr, "    4. Test queue_priority\n");
+        fprintf(stderr, "    5. Test queue_close\n");
         return EXIT_FAILURE;
     }
 
@@ -106,6 +169,8 @@ int main(int argc, char *argv[]) {
         case 1:  status = test_01_queue_push(); break;
         case 2:  status = test_02_queue_pop(); break;
         case 3:  status = test_03_queue_delete(); break;
+        case 4:  status = test_04_queue_priority(); break;
+        case 5:  status = test_05_queue_close(); break;
         default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
     }   
 
@@ -114,6 +114,68 @@ failure:
     return status;
 }
 
+int test_03_request_prefix() {
+    char  *data = NULL;
+    size_t size = 0;
+    FILE  *fs   = open_memstream(&data, &size);
+    assert(fs);
+
+    Request *r = request_create(NULL, NULL, "SOME LIKE IT");
+    assert(r);
+    r->prefix  = "PUT /topic/HOT HTTP/1.0\r\nX-Message-Id: 1-";
+    r->headers = strdup("2\r\n");
+    request_write(r, fs);
+    fclose(fs);
+
+    const char *target = "PUT /topic/HOT HTTP/1.0\r\nX-Message-Id: 1-2\r\nContent-Length: 12\r\n\r\nSOME LIKE IT";
+    int status = streq(data, target) ? EXIT_SUCCESS : EXIT_FAILURE;
+    if (status != EXIT_SUCCESS)
+        fprintf(stderr, "%s != %s\n", data, target);
+
+    request_delete(r);                          // prefix is not freed
+    free(data);
+    return status;
+}
+
+int test_04_request_attach() {
+    int pipefd[2];
+    assert(pipe(pipefd) == 0);
+    assert(write(pipefd[1], "SOME LIKE IT HOT", 16) == 16);
+
+    // A pipe is moved to a temporary file (by splice), up to the length only
+    Request *r = request_create("PUT", "/topic/HOT", NULL);
+    assert(r && request_attach(r, pipefd[0], 12));
+    close(pipefd[0]);
+    close(pipefd[1]);
+
+    char  *data = NULL;
+    size_t size = 0;
+    FILE  *fs   = open_memstream(&data, &size);
+    assert(fs);
+    request_write(r, fs);
+    request_write(r, fs);                       // may be sent again
+    fclose(fs);
+
+    const char *target = "PUT /topic/HOT HTTP/1.0\r\nContent-Length: 12\r\n\r\nSOME LIKE IT";
+    int status = EXIT_FAILURE;
+    if (size != 2 * strlen(target) || strncmp(data, target, strlen(target)) || strcmp(data + strlen(target), target)) {
+        fprintf(stderr, "%s != %s (twice)\n", data, target);
+        goto failure;
+    }
+
+    // Loading brings the body into memory and lets go of the file
+    if (!request_load(r) || r->file || !streq(r->body, "SOME LIKE IT")) {
+        fprintf(stderr, "Unable to load body\n");
+        goto failure;
+    }
+    status = EXIT_SUCCESS;
+
+failure:
+    request_delete(r);
+    free(data);
+    return status;
+}
+
 /* Main execution */
 
 int main(int argc, char *argv[]) {
@@ -123,6 +185,8 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "    0. Test request_create\n");
         fprintf(stderr, "    1. Test request_delete\n");
         fprintf(stderr, "    2. Test request_write\n");
+        fprintf(stderr, "    3. Test request_write with prefix\n");
+        fprintf(stderr, "    4. Test request_attach\n");
         return EXIT_FAILURE;
     }
 
@@ -133,6 +197,8 @@ int main(int argc, char *argv[]) {
         case 0:  status = test_00_request_create(); break;
         case 1:  status = test_01_request_delete(); break;
         case 2:  status = test_02_request_write(); break;
+        case 3:  status = test_03_request_prefix(); break;
+        case 4:  status = test_04_request_attach(); break;
         default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
     }   
 
@@ -0,0 +1,115 @@
+/* test_ring_unit.c: Test consistent hash Ring (Unit) */
+
+#include "mq/ring.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Constants */
+
+const char * NODES[] = { "localhost:9620", "localhost:9621", "localhost:9622", "localhost:9623", "localhost:9624" };
+const size_t NKEYS   = 10000;
+
+/* Functions */
+
+int test_00_ring_add() {
+    Ring *ring = calloc(1, sizeof(Ring));
+    assert(ring);
+
+    for (size_t n = 0; n < RING_NODES_MAX; n++) {
+        char name[32];
+        sprintf(name, "node%zu", n);
+        assert(ring_add(ring, name) == (int)n);
+    }
+    assert(ring_add(ring, "overflow") < 0);
+    assert(ring->npoints == RING_NODES_MAX * RING_VNODES);
+
+    for (size_t p = 1; p < ring->npoints; p++)
+        assert(ring->points[p - 1].hash <= ring->points[p].hash);
+
+    free(ring);
+    return EXIT_SUCCESS;
+}
+
+int test_01_ring_balance() {
+    Ring  *ring = calloc(1, sizeof(Ring));
+    size_t counts[4] = {0};
+    assert(ring);
+
+    for (size_t n = 0; n < 4; n++)
+        ring_add(ring, NODES[n]);
+
+    for (size_t k = 0; k < NKEYS; k++) {
+        char key[32];
+        sprintf(key, "topic%zu", k);
+        size_t node = ring_lookup(ring, key);
+        assert(node < 4);
+        counts[node]++;
+    }
+
+    for (size_t n = 0; n < 4; n++)
+        assert(counts[n] > NKEYS / 4 / 2 && counts[n] < NKEYS / 4 * 3 / 2);
+
+    free(ring);
+    return EXIT_SUCCESS;
+}
+
+int test_02_ring_stability() {
+    Ring  *ring  = calloc(1, sizeof(Ring));
+    size_t *before = calloc(NKEYS, sizeof(size_t));
+    size_t moved = 0;
+    assert(ring && before);
+
+    for (size_t n = 0; n < 4; n++)
+        ring_add(ring, NODES[n]);
+
+    for (size_t k = 0; k < NKEYS; k++) {
+        char key[32];
+        sprintf(key, "topic%zu", k);
+        before[k] = ring_lookup(ring, key);
+    }
+
+    ring_add(ring, NODES[4]);
+    for (size_t k = 0; k < NKEYS; k++) {
+        char key[32];
+        sprintf(key, "topic%zu", k);
+        size_t node = ring_lookup(ring, key);
+        if (node != before[k]) {
+            assert(node == 4);
+            moved++;
+        }
+    }
+    assert(moved > NKEYS / 5 / 2 && moved < NKEYS / 5 * 3 / 2);
+
+    free(before);
+    free(ring);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test ring_add\n");
+        fprintf(stderr, "    1. Test ring_balance\n");
+        fprintf(stderr, "    2. Test ring_stability\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_ring_add(); break;
+        case 1:  status = test_01_ring_balance(); break;
+        case 2:  status = test_02_ring_stability(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
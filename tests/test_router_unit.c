@@ -0,0 +1,268 @@
+/* test_router_unit.c: Test in-process fan-out Router (Unit) */
+
+#include "mq/client.h"
+#include "mq/router.h"
+#include "mq/string.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define NCONSUMERS  4
+#define NMESSAGES   1000
+
+/* Structures */
+
+typedef struct Tally Tally;
+struct Tally {
+    size_t      done;           // Requests handed to done
+    size_t      received;       // Deliveries received by consumers
+    size_t      topics;         // Topics with consumers (tracked by changed)
+};
+
+/* Functions */
+
+void count_done(Request *r, void *ctx) {
+    Tally *tally = (Tally *)ctx;
+    __atomic_add_fetch(&tally->done, 1, __ATOMIC_RELAXED);
+    request_delete(r);
+}
+
+void count_changed(const char *topic, bool consumed, void *ctx) {
+    Tally *tally = (Tally *)ctx;
+    if (consumed)
+        tally->topics++;
+    else
+        tally->topics--;
+}
+
+Request * make_message(const char *topic, const char *body) {
+    Request *r = request_create(NULL, NULL, body);
+    assert(r);
+    r->topic = strdup(topic);
+    assert(r->topic);
+    return r;
+}
+
+void * receive_thread(void *arg) {
+    return router_receive((Consumer *)arg);
+}
+
+bool next_request(Queue *q, const char *method) {
+    Request *r = queue_trypop(q);
+    bool matched = r && streq(r->method, method) && streq(r->uri, "/subscription/router_test/weather");
+    if (r)
+        request_delete(r);
+    return matched;
+}
+
+void * consume_thread(void *arg) {
+    Consumer *c     = (Consumer *)arg;
+    Tally    *tally = (Tally *)c->router->ctx;
+    size_t    next  = 0;
+    Delivery *d;
+
+    while ((d = router_receive(c))) {
+        assert(strtoul(d->request->body, NULL, 10) == next++);
+        __atomic_add_fetch(&tally->received, 1, __ATOMIC_RELAXED);
+        router_release(d);
+    }
+    assert(next == NMESSAGES);
+    return NULL;
+}
+
+int test_00_router_subscribe() {
+    Tally   tally  = {0};
+    Router *router = router_create(count_done, &tally);
+    bool    first;
+    assert(router);
+    router->changed = count_changed;
+
+    Consumer *a = router_subscribe(router, "weather", &first);
+    assert(a && first);
+    Consumer *b = router_subscribe(router, "weather", &first);
+    assert(b && !first);
+    Consumer *c = router_subscribe(router, "news", &first);
+    assert(c && first);
+    assert(tally.topics == 2);
+
+    // Topics without consumers are left to the caller
+    Request *r = make_message("sports", "1");
+    assert(!router_deliver(router, r));
+    request_delete(r);
+
+    assert(!router_unsubscribe(a));
+    assert(tally.topics == 2);
+    assert(router_unsubscribe(b));
+    assert(router_unsubscribe(c));
+    assert(tally.topics == 0);
+
+    r = make_message("weather", "2");
+    assert(!router_deliver(router, r));
+    request_delete(r);
+
+    router_delete(router);
+    return EXIT_SUCCESS;
+}
+
+int test_01_router_share() {
+    Tally     tally  = {0};
+    Router   *router = router_create(count_done, &tally);
+    Consumer *consumers[3];
+    bool      first;
+    assert(router);
+
+    for (size_t i = 0; i < 3; i++)
+        assert((consumers[i] = router_subscribe(router, "weather", &first)));
+
+    assert(router_deliver(router, make_message("weather", "sunny")));
+
+    // Every consumer gets the same message, finished after the last release
+    Delivery *d[3];
+    for (size_t i = 0; i < 3; i++) {
+        assert((d[i] = router_receive(consumers[i])));
+        assert(d[i]->request == d[0]->request);
+        assert(streq(d[i]->request->body, "sunny"));
+    }
+    router_release(d[0]);
+    router_release(d[1]);
+    assert(tally.done == 0);
+    router_release(d[2]);
+    assert(tally.done == 1);
+
+    // What an unsubscribing consumer did not receive is released for it
+    assert(router_deliver(router, make_message("weather", "rainy")));
+    assert(!router_unsubscribe(consumers[2]));
+    for (size_t i = 0; i < 2; i++) {
+        assert((d[i] = router_receive(consumers[i])));
+        router_release(d[i]);
+    }
+    assert(tally.done == 2);
+
+    // Deliveries left when the router is deleted are not finished
+    assert(router_deliver(router, make_message("weather", "windy")));
+    router_delete(router);
+    assert(tally.done == 2);
+    return EXIT_SUCCESS;
+}
+
+int test_02_router_close() {
+    Tally     tally  = {0};
+    Router   *router = router_create(count_done, &tally);
+    bool      first;
+    assert(router);
+
+    Consumer *c = router_subscribe(router, "weather", &first);
+    assert(c);
+    assert(router_deliver(router, make_message("weather", "0")));
+
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, receive_thread, c) == 0);
+    Delivery *d;
+    assert(pthread_join(thread, (void **)&d) == 0);
+    assert(d && streq(d->request->body, "0"));
+    router_release(d);
+
+    // Closing wakes a blocked receiver
+    assert(pthread_create(&thread, NULL, receive_thread, c) == 0);
+    usleep(50000);
+    router_close(router);
+    assert(pthread_join(thread, (void **)&d) == 0);
+    assert(d == NULL);
+    assert(router_receive(c) == NULL);
+
+    assert(router_unsubscribe(c));
+    router_delete(router);
+    assert(tally.done == 1);
+    return EXIT_SUCCESS;
+}
+
+int test_03_router_concurrent() {
+    Tally     tally  = {0};
+    Router   *router = router_create(count_done, &tally);
+    Consumer *consumers[NCONSUMERS];
+    pthread_t threads[NCONSUMERS];
+    bool      first;
+    assert(router);
+
+    for (size_t i = 0; i < NCONSUMERS; i++) {
+        assert((consumers[i] = router_subscribe(router, "weather", &first)));
+        assert(pthread_create(&threads[i], NULL, consume_thread, consumers[i]) == 0);
+    }
+
+    for (size_t m = 0; m < NMESSAGES; m++) {
+        char body[32];
+        sprintf(body, "%zu", m);
+        assert(router_deliver(router, make_message("weather", body)));
+    }
+    router_close(router);
+
+    for (size_t i = 0; i < NCONSUMERS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+        router_unsubscribe(consumers[i]);
+    }
+    assert(tally.received == NCONSUMERS * NMESSAGES);
+    assert(tally.done == NMESSAGES);
+    router_delete(router);
+    return EXIT_SUCCESS;
+}
+
+int test_04_router_explicit() {
+    /* Not started, so subscription changes stay queued for the server */
+    MessageQueue *mq = mq_create_flags("router_test", "localhost", "9", MQ_TRANSPORT_TCP);
+    assert(mq);
+    Queue *outgoing = mq->brokers[0].outgoing;
+
+    // Local consumers come and go without touching an explicit subscription
+    mq_subscribe(mq, "weather");
+    assert(next_request(outgoing, "PUT"));
+    Consumer *c = mq_consumer_create(mq, "weather");
+    assert(c);
+    mq_consumer_delete(c);
+    assert(queue_trypop(outgoing) == NULL);
+
+    // and keep the topic subscribed until the last of them is gone
+    assert((c = mq_consumer_create(mq, "weather")));
+    mq_unsubscribe(mq, "weather");
+    assert(queue_trypop(outgoing) == NULL);
+    mq_consumer_delete(c);
+    assert(next_request(outgoing, "DELETE"));
+    assert(queue_trypop(outgoing) == NULL);
+
+    mq_delete(mq);
+    return EXIT_SUCCESS;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s NUMBER\n\n", argv[0]);
+        fprintf(stderr, "Where NUMBER is right of the following:\n");
+        fprintf(stderr, "    0. Test router_subscribe\n");
+        fprintf(stderr, "    1. Test router_share\n");
+        fprintf(stderr, "    2. Test router_close\n");
+        fprintf(stderr, "    3. Test router_concurrent\n");
+        fprintf(stderr, "    4. Test router_explicit\n");
+        return EXIT_FAILURE;
+    }
+
+    int number = atoi(argv[1]);
+    int status = EXIT_FAILURE;
+
+    switch (number) {
+        case 0:  status = test_00_router_subscribe(); break;
+        case 1:  status = test_01_router_share(); break;
+        case 2:  status = test_02_router_close(); break;
+        case 3:  status = test_03_router_concurrent(); break;
+        case 4:  status = test_04_router_explicit(); break;
+        default: fprintf(stderr, "Unknown NUMBER: %d\n", number); break;
+    }
+
+    return status;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
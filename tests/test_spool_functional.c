@@ -0,0 +1,104 @@
+/* test_spool_functional.c: Test retrieving bodies received into files (Functional) */
+
+#include "mq/client.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+const char *  TOPIC  = "spooled";
+const size_t  NBYTES = MQ_SPOOL_MIN;
+const unsigned long LEASE = 1000;
+
+/* Functions */
+
+/**
+ * Wait for body to be received whole into a file in directory.
+ * @param   directory   Directory temporary files are made in.
+ * @return  File descriptor of the file (-1 if none showed up).
+ */
+int wait_spool(const char *directory) {
+    struct timespec pause = { 0, 10000000 };
+    for (int i = 0; i < 1000; i++) {
+        DIR *d = opendir("/proc/self/fd");
+        assert(d);
+
+        struct dirent *e;
+        int found = -1;
+        while (found < 0 && (e = readdir(d))) {
+            char link[BUFSIZ], path[BUFSIZ];
+            snprintf(link, sizeof(link), "/proc/self/fd/%s", e->d_name);
+            ssize_t n = readlink(link, path, sizeof(path) - 1);
+            if (n <= 0)
+                continue;
+            path[n] = '\0';
+
+            struct stat s;
+            int fd = atoi(e->d_name);
+            if (strncmp(path, directory, strlen(directory)) == 0 &&
+                fstat(fd, &s) == 0 && (size_t)s.st_size == NBYTES)
+                found = fd;
+        }
+        closedir(d);
+
+        if (found >= 0)
+            return found;
+        nanosleep(&pause, NULL);
+    }
+    return -1;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    /* Parse command-line arguments */
+    char *host = "localhost";
+    char *port = "9620";
+
+    if (argc > 1) { host = argv[1]; }
+    if (argc > 2) { port = argv[2]; }
+
+    /* Received bodies this large go to temporary files in TMPDIR */
+    char directory[] = "/tmp/test_spool_functional.XXXXXX";
+    assert(mkdtemp(directory));
+    setenv("TMPDIR", directory, 1);
+
+    MessageQueue *mq = mq_create_flags("spool_test", host, port, MQ_TRANSPORT_TCP);
+    assert(mq);
+
+    mq_set_prefetch(mq, 1, LEASE);
+    mq_subscribe(mq, TOPIC);
+    mq_start(mq);
+
+    char *body = malloc(NBYTES + 1);
+    assert(body);
+    for (size_t i = 0; i < NBYTES; i++)
+        body[i] = 'a' + i % 26;
+    body[NBYTES] = '\0';
+    mq_publish(mq, TOPIC, body);
+
+    /* A body that cannot be read back is not acknowledged, so the message
+     * comes again once its lease runs out */
+    int fd = wait_spool(directory);
+    assert(fd >= 0);
+    assert(ftruncate(fd, 0) == 0);
+
+    char *message = mq_retrieve(mq);
+    assert(message);
+    assert(strcmp(message, body) == 0);
+    free(message);
+
+    mq_stop(mq);
+    assert(mq_retrieve(mq) == NULL);
+
+    mq_delete(mq);
+    free(body);
+    rmdir(directory);
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,69 @@
+/* test_stop_functional.c: Test stopping a client that cannot reach its server (Functional) */
+
+#include "mq/client.h"
+
+#include <assert.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Constants */
+
+const char *  TOPIC = "unreachable";
+const unsigned long DRAIN = 500;
+const unsigned long SLACK = 2000;    // Valgrind slows everything down
+
+/* Functions */
+
+/**
+ * Find port nothing listens on (one the kernel just handed out and took back).
+ * @param   port    Where to store port (as a string).
+ */
+void closed_port(char *port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(fd >= 0);
+
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t length = sizeof(address);
+    assert(bind(fd, (struct sockaddr *)&address, length) == 0);
+    assert(getsockname(fd, (struct sockaddr *)&address, &length) == 0);
+    close(fd);
+
+    sprintf(port, "%d", ntohs(address.sin_port));
+}
+
+double elapsed(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Main execution */
+
+int main(int argc, char *argv[]) {
+    char port[NI_MAXSERV];
+    closed_port(port);
+
+    MessageQueue *mq = mq_create_flags("stop_test", "127.0.0.1", port, MQ_TRANSPORT_TCP);
+    assert(mq);
+
+    mq_set_drain(mq, DRAIN);
+    mq_subscribe(mq, TOPIC);
+    mq_start(mq);
+    mq_publish(mq, TOPIC, "never delivered");
+    usleep(200000);
+
+    /* Connecting keeps failing, so what is queued is given up once the
+     * drain timeout runs out, and stopping takes no longer than that */
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    mq_stop(mq);
+    assert(elapsed(&start) < DRAIN + SLACK);
+    assert(mq_retrieve(mq) == NULL);
+
+    mq_delete(mq);
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */